@@ -0,0 +1,92 @@
+/**********************************
+ * License:     MIT
+ *
+ **********************************/
+/*! \file bench_basic_pool.cpp
+ *
+ *  Throughput of thpool::basic_pool (static dispatch, typed ring) against
+ *  the type-erased C API (thpool_add_work, function pointer per job).
+ *
+ *  usage: bench_basic_pool [threads] [jobs] [work]
+ *
+ ********************************/
+
+#include "../thpool.h"
+#include "../thpool_basic.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+namespace {
+
+std::atomic<unsigned long> sink{0};
+unsigned g_work = 16;
+
+/* A few dependent multiply-adds, so the job body is not free */
+inline unsigned long spin_work(unsigned long seed, unsigned work) {
+	unsigned long x = seed;
+	for (unsigned i = 0; i < work; i++) x = x * 6364136223846793005UL + 1442695040888963407UL;
+	return x;
+}
+
+struct static_job {
+	unsigned long seed;
+	void operator()() const {
+		unsigned long x = spin_work(seed, g_work);
+		if (x == 0) sink.fetch_add(1, std::memory_order_relaxed);
+	}
+};
+
+void c_job(void* arg) {
+	unsigned long x = spin_work((unsigned long)arg, g_work);
+	if (x == 0) sink.fetch_add(1, std::memory_order_relaxed);
+}
+
+double seconds_since(std::chrono::steady_clock::time_point t0) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+void report(const char* name, int threads, long jobs, double secs) {
+	printf("%-34s threads=%-3d jobs=%-9ld %8.3f s  %12.0f jobs/s  %8.1f ns/job\n",
+	       name, threads, jobs, secs, jobs / secs, secs * 1e9 / jobs);
+}
+
+double bench_c_api(int threads, long jobs) {
+	threadpool pool = thpool_init(threads);
+	auto t0 = std::chrono::steady_clock::now();
+	for (long i = 0; i < jobs; i++) thpool_add_work(pool, c_job, (void*)(i + 1));
+	thpool_wait(pool);
+	double secs = seconds_since(t0);
+	thpool_destroy(pool);
+	return secs;
+}
+
+template<typename Pool>
+double bench_basic(int threads, long jobs) {
+	Pool pool(threads);
+	auto t0 = std::chrono::steady_clock::now();
+	for (long i = 0; i < jobs; i++) pool.submit(static_job{(unsigned long)(i + 1)});
+	pool.wait();
+	return seconds_since(t0);
+}
+
+} /* namespace */
+
+int main(int argc, char** argv) {
+	int  threads = argc > 1 ? atoi(argv[1]) : 4;
+	long jobs    = argc > 2 ? atol(argv[2]) : 1000000;
+	if (argc > 3) g_work = (unsigned)atoi(argv[3]);
+
+	report("thpool_add_work (C API)", threads, jobs, bench_c_api(threads, jobs));
+	report("basic_pool<mpmc_ring, hybrid>", threads, jobs,
+	       bench_basic<thpool::basic_pool<static_job, thpool::mpmc_ring, thpool::hybrid_idle<>>>(threads, jobs));
+	report("basic_pool<mpmc_ring, blocking>", threads, jobs,
+	       bench_basic<thpool::basic_pool<static_job, thpool::mpmc_ring, thpool::blocking_idle>>(threads, jobs));
+	report("basic_pool<mpmc_ring, spinning>", threads, jobs,
+	       bench_basic<thpool::basic_pool<static_job, thpool::mpmc_ring, thpool::spinning_idle>>(threads, jobs));
+	report("basic_pool<locked_ring, blocking>", threads, jobs,
+	       bench_basic<thpool::basic_pool<static_job, thpool::locked_ring, thpool::blocking_idle>>(threads, jobs));
+	return 0;
+}
@@ -0,0 +1,300 @@
+/**********************************
+ * License:     MIT
+ *
+ **********************************/
+/*! \file bench_common.h
+ *
+ *  Helpers shared by the benchmarks: clock, open loop pacing, latency
+ *  recorder, statistics of repeated runs and a small JSON writer.
+ *
+ *  Latencies are taken from the time a request was due, not from the time
+ *  the driver got around to issue it. A stall of the pool then shows up in
+ *  the latency of every request it held back instead of only the one it
+ *  hit (coordinated omission). Drivers issue at fixed due times with
+ *  bench::pacer; closed loop drivers use latency::record_corrected().
+ *
+ ********************************/
+
+#ifndef _BENCH_COMMON_H_
+#define _BENCH_COMMON_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BENCH_CPU_RELAX() _mm_pause()
+#else
+#define BENCH_CPU_RELAX() std::this_thread::yield()
+#endif
+
+namespace bench {
+
+inline uint64_t now_ns() {
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+/* Sleep while the time is far off, spin the last stretch */
+inline void wait_until(uint64_t due_ns) {
+	for (;;) {
+		uint64_t now = now_ns();
+		if (now >= due_ns) return;
+		if (due_ns - now > 200000) std::this_thread::sleep_for(std::chrono::nanoseconds(due_ns - now - 100000));
+		else BENCH_CPU_RELAX();
+	}
+}
+
+
+/* Due times of an open loop driver
+ *
+ * next(gap) waits for the current due time and returns it; the following
+ * one is gap later, however late the caller is.
+ */
+class pacer {
+public:
+	pacer() : due_(now_ns()) {}
+
+	uint64_t next(uint64_t gap_ns) {
+		uint64_t due = due_;
+		due_ += gap_ns;
+		wait_until(due);
+		return due;
+	}
+
+private:
+	uint64_t due_;
+};
+
+
+/* Latency samples in ns */
+class latency {
+public:
+	void record(uint64_t ns) {
+		samples_.push_back(ns);
+		sorted_ = false;
+	}
+
+	/* Sample of a closed loop meant to issue every interval_ns: also
+	 * records the samples the stall kept from being taken */
+	void record_corrected(uint64_t ns, uint64_t interval_ns) {
+		record(ns);
+		if (interval_ns == 0) return;
+		for (uint64_t missing = ns; missing >= 2 * interval_ns; ) {
+			missing -= interval_ns;
+			record(missing);
+		}
+	}
+
+	std::size_t count() const { return samples_.size(); }
+
+	double mean() const {
+		if (samples_.empty()) return 0.0;
+		double sum = 0.0;
+		for (uint64_t s : samples_) sum += (double)s;
+		return sum / (double)samples_.size();
+	}
+
+	/* Nearest rank, percentile in 0 .. 100 */
+	uint64_t percentile(double percentile) {
+		if (samples_.empty()) return 0;
+		if (!sorted_) {
+			std::sort(samples_.begin(), samples_.end());
+			sorted_ = true;
+		}
+		std::size_t rank = (std::size_t)(percentile / 100.0 * (double)samples_.size() + 0.5);
+		if (rank < 1) rank = 1;
+		if (rank > samples_.size()) rank = samples_.size();
+		return samples_[rank - 1];
+	}
+
+	void clear() { samples_.clear(); }
+
+private:
+	std::vector<uint64_t> samples_;
+	bool                  sorted_ = false;
+};
+
+
+/* Mean, sample standard deviation and 95% confidence half width of
+ * repeated measurements */
+struct summary {
+	int    n      = 0;
+	double mean   = 0.0;
+	double stddev = 0.0;
+	double ci95   = 0.0;
+};
+
+/* Two-sided 95% quantile of Student's t, rounded to the safe side */
+inline double t95(double df) {
+	static const double table[30] = {
+		12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+		 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+		 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+	};
+	if (df < 1.0)    return table[0];
+	if (df <= 30.0)  return table[(int)df - 1];
+	if (df < 40.0)   return 2.042;
+	if (df < 60.0)   return 2.021;
+	if (df < 120.0)  return 2.000;
+	return 1.980;
+}
+
+inline summary summarize(const std::vector<double>& xs) {
+	summary s;
+	s.n = (int)xs.size();
+	if (s.n == 0) return s;
+	for (double x : xs) s.mean += x;
+	s.mean /= s.n;
+	if (s.n < 2) return s;
+	double sq = 0.0;
+	for (double x : xs) sq += (x - s.mean) * (x - s.mean);
+	s.stddev = std::sqrt(sq / (s.n - 1));
+	s.ci95   = t95(s.n - 1) * s.stddev / std::sqrt((double)s.n);
+	return s;
+}
+
+/* Welch's t of a - b, degrees of freedom into *df; 0 if either side has
+ * fewer than two runs */
+inline double welch_t(const summary& a, const summary& b, double* df) {
+	*df = 1.0;
+	if (a.n < 2 || b.n < 2) return 0.0;
+	double va = a.stddev * a.stddev / a.n, vb = b.stddev * b.stddev / b.n;
+	if (va + vb == 0.0) return a.mean == b.mean ? 0.0 : (a.mean > b.mean ? HUGE_VAL : -HUGE_VAL);
+	*df = (va + vb) * (va + vb) / (va * va / (a.n - 1) + vb * vb / (b.n - 1));
+	return (a.mean - b.mean) / std::sqrt(va + vb);
+}
+
+
+/* Streaming JSON writer, indented, no escaping beyond quotes */
+class json {
+public:
+	explicit json(FILE* out) : out_(out) {}
+
+	json& begin_object(const char* key = nullptr) { open(key, '{'); return *this; }
+	json& end_object()                            { close('}'); return *this; }
+	json& begin_array(const char* key = nullptr)  { open(key, '['); return *this; }
+	json& end_array()                             { close(']'); return *this; }
+
+	json& field(const char* key, const char* value) {
+		item(key);
+		string(value);
+		return *this;
+	}
+	json& field(const char* key, double value) {
+		item(key);
+		fprintf(out_, "%.6g", value);
+		return *this;
+	}
+	json& field(const char* key, int value)           { item(key); fprintf(out_, "%d", value); return *this; }
+	json& field(const char* key, long value)          { item(key); fprintf(out_, "%ld", value); return *this; }
+	json& field(const char* key, unsigned long value) { item(key); fprintf(out_, "%lu", value); return *this; }
+	json& field(const char* key, unsigned long long value) { item(key); fprintf(out_, "%llu", value); return *this; }
+	json& field(const char* key, bool value)          { item(key); fputs(value ? "true" : "false", out_); return *this; }
+
+	/* count, mean and percentiles of a latency, in ns */
+	json& field(const char* key, latency& lat) {
+		begin_object(key);
+		field("count",   (unsigned long)lat.count());
+		field("mean_ns", lat.mean());
+		field("p50_ns",  (unsigned long long)lat.percentile(50.0));
+		field("p90_ns",  (unsigned long long)lat.percentile(90.0));
+		field("p99_ns",  (unsigned long long)lat.percentile(99.0));
+		field("p999_ns", (unsigned long long)lat.percentile(99.9));
+		field("max_ns",  (unsigned long long)lat.percentile(100.0));
+		return end_object();
+	}
+
+	json& field(const char* key, const summary& s) {
+		begin_object(key);
+		field("n",      s.n);
+		field("mean",   s.mean);
+		field("stddev", s.stddev);
+		field("ci95",   s.ci95);
+		return end_object();
+	}
+
+	/* Where and when the numbers were taken */
+	json& meta() {
+		char date[32];
+		time_t now = time(nullptr);
+		strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+		begin_object("meta");
+		field("date", date);
+		field("cpus", (int)std::thread::hardware_concurrency());
+#ifdef __VERSION__
+		field("compiler", __VERSION__);
+#endif
+#ifdef THPOOL_NO_STATS
+		field("stats", false);
+#else
+		field("stats", true);
+#endif
+		return end_object();
+	}
+
+	void finish() { fputc('\n', out_); fflush(out_); }
+
+private:
+	void indent() {
+		fputc('\n', out_);
+		for (std::size_t i = 0; i < first_.size(); i++) fputs("  ", out_);
+	}
+
+	void item(const char* key) {
+		if (!first_.empty()) {
+			if (!first_.back()) fputc(',', out_);
+			first_.back() = false;
+			indent();
+		}
+		if (key) {
+			string(key);
+			fputs(": ", out_);
+		}
+	}
+
+	void open(const char* key, char c) {
+		item(key);
+		fputc(c, out_);
+		first_.push_back(true);
+	}
+
+	void close(char c) {
+		bool empty = first_.back();
+		first_.pop_back();
+		if (!empty) indent();
+		fputc(c, out_);
+	}
+
+	void string(const char* s) {
+		fputc('"', out_);
+		for (; *s; s++) {
+			if (*s == '"' || *s == '\\') fputc('\\', out_);
+			if ((unsigned char)*s >= 0x20) fputc(*s, out_);
+		}
+		fputc('"', out_);
+	}
+
+	FILE*             out_;
+	std::vector<bool> first_;          /* per open level: nothing written yet */
+};
+
+
+/* 1, 2, 4, .. up to and including max_threads */
+inline std::vector<int> thread_counts(int max_threads) {
+	std::vector<int> counts;
+	for (int n = 1; n < max_threads; n *= 2) counts.push_back(n);
+	counts.push_back(max_threads > 0 ? max_threads : 1);
+	return counts;
+}
+
+} /* namespace bench */
+
+#endif
@@ -0,0 +1,534 @@
+/**********************************
+ * License:     MIT
+ *
+ **********************************/
+/*! \file bench_compare.cpp
+ *
+ *  The same workloads on thpool, std::async, OpenMP tasks and a naive
+ *  mutex + condition variable std::thread pool, written side by side as
+ *  JSON to stdout:
+ *
+ *    parallel_for   hash an array, split in 8 chunks per thread
+ *    fib            fork-join Fibonacci, serial below a cutoff
+ *    fan_out        rounds of 8 small jobs per thread, each round joined
+ *    pipeline       blocks through generate -> transform -> reduce, every
+ *                   stage its own job, the reduce stages serialized
+ *
+ *  Each runtime gets its idiomatic form: OpenMP uses parallel for, task /
+ *  taskwait and task dependencies, std::async launches a thread per task
+ *  and joins on futures, thpool and the naive pool queue continuations
+ *  (a job queues its successors, a blocking join inside a worker would
+ *  deadlock) and fan in with a decsemaphore or a wait. Every workload
+ *  yields a checksum that has to agree across the runtimes. Needs
+ *  -fopenmp.
+ *
+ *  usage: bench_compare [threads] [reps] [scale] > compare.json
+ *
+ ********************************/
+
+#include "../thpool.h"
+#include "bench_common.h"
+
+#include <omp.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+namespace {
+
+/* Reference pool: one queue of std::function under a mutex */
+class naive_pool {
+public:
+	explicit naive_pool(int threads) {
+		for (int i = 0; i < threads; i++) workers_.emplace_back([this] { run(); });
+	}
+
+	~naive_pool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stop_ = true;
+		}
+		work_.notify_all();
+		for (std::thread& t : workers_) t.join();
+	}
+
+	void submit(std::function<void()> job) {
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			jobs_.push(std::move(job));
+			pending_++;
+		}
+		work_.notify_one();
+	}
+
+	/* Until the queue is empty and no job runs */
+	void wait() {
+		std::unique_lock<std::mutex> lock(mutex_);
+		idle_.wait(lock, [this] { return pending_ == 0; });
+	}
+
+private:
+	void run() {
+		std::unique_lock<std::mutex> lock(mutex_);
+		for (;;) {
+			work_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+			if (jobs_.empty()) return;
+			std::function<void()> job = std::move(jobs_.front());
+			jobs_.pop();
+			lock.unlock();
+			job();
+			lock.lock();
+			if (--pending_ == 0) idle_.notify_all();
+		}
+	}
+
+	std::mutex                        mutex_;
+	std::condition_variable           work_;
+	std::condition_variable           idle_;
+	std::queue<std::function<void()>> jobs_;
+	long                              pending_ = 0;
+	bool                              stop_    = false;
+	std::vector<std::thread>          workers_;
+};
+
+
+/* The pool the continuation passing workloads queue on */
+threadpool  g_thpool;
+naive_pool* g_naive;
+
+void submit(void (*function)(void*), void* arg) {
+	if (g_naive) g_naive->submit([function, arg] { function(arg); });
+	else         thpool_add_work(g_thpool, function, arg);
+}
+
+void wait_all() {
+	if (g_naive) g_naive->wait();
+	else         thpool_wait(g_thpool);
+}
+
+
+inline uint32_t hash(uint32_t x, int rounds) {
+	for (int i = 0; i < rounds; i++) {
+		x ^= x >> 16;
+		x *= 0x7feb352dU;
+		x ^= x >> 15;
+		x *= 0x846ca68bU;
+		x ^= x >> 16;
+	}
+	return x;
+}
+
+
+/* ----------------------------- parallel for ----------------------------- */
+
+const int FOR_ROUNDS = 16;
+
+struct for_chunk {
+	uint32_t*   data;
+	std::size_t begin;
+	std::size_t end;
+};
+
+void for_body(uint32_t* data, std::size_t begin, std::size_t end) {
+	for (std::size_t i = begin; i < end; i++) data[i] = hash((uint32_t)i, FOR_ROUNDS);
+}
+
+void for_job(void* arg) {
+	for_chunk* c = (for_chunk*)arg;
+	for_body(c->data, c->begin, c->end);
+}
+
+std::vector<for_chunk> split(std::vector<uint32_t>& data, int chunks) {
+	std::vector<for_chunk> out(chunks);
+	for (int i = 0; i < chunks; i++)
+		out[i] = { data.data(), data.size() * i / chunks, data.size() * (i + 1) / chunks };
+	return out;
+}
+
+uint64_t sum(const std::vector<uint32_t>& data) {
+	uint64_t s = 0;
+	for (uint32_t x : data) s += x;
+	return s;
+}
+
+uint64_t for_pool(std::vector<uint32_t>& data, int threads) {
+	std::vector<for_chunk> chunks = split(data, 8 * threads);
+	for (for_chunk& c : chunks) submit(for_job, &c);
+	wait_all();
+	return sum(data);
+}
+
+uint64_t for_async(std::vector<uint32_t>& data, int threads) {
+	std::vector<for_chunk> chunks = split(data, 8 * threads);
+	std::vector<std::future<void>> done;
+	for (for_chunk& c : chunks)
+		done.push_back(std::async(std::launch::async, for_body, c.data, c.begin, c.end));
+	for (std::future<void>& f : done) f.get();
+	return sum(data);
+}
+
+uint64_t for_omp(std::vector<uint32_t>& data, int) {
+	long n = (long)data.size();
+	uint32_t* d = data.data();
+	#pragma omp parallel for schedule(static)
+	for (long i = 0; i < n; i++) d[i] = hash((uint32_t)i, FOR_ROUNDS);
+	return sum(data);
+}
+
+
+/* ----------------------------- fib ----------------------------- */
+
+const int FIB_N      = 30;
+const int FIB_CUTOFF = 18;
+
+uint64_t fib_serial(int n) {
+	return n < 2 ? (uint64_t)n : fib_serial(n - 1) + fib_serial(n - 2);
+}
+
+/* Continuation: the last child to finish adds the sum to its parent */
+struct fib_node {
+	int                   n;
+	fib_node*             parent;
+	std::atomic<int>      pending;
+	std::atomic<uint64_t> sum;
+	uint64_t*             result;      /* root only */
+};
+
+void fib_done(fib_node* node, uint64_t value) {
+	while (node->parent) {
+		fib_node* parent = node->parent;
+		delete node;
+		parent->sum.fetch_add(value, std::memory_order_relaxed);
+		if (parent->pending.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+		node  = parent;
+		value = node->sum.load(std::memory_order_relaxed);
+	}
+	*node->result = value;
+	delete node;
+}
+
+void fib_job(void* arg) {
+	fib_node* node = (fib_node*)arg;
+	if (node->n < FIB_CUTOFF) {
+		fib_done(node, fib_serial(node->n));
+		return;
+	}
+	node->sum.store(0, std::memory_order_relaxed);
+	node->pending.store(2, std::memory_order_relaxed);
+	for (int i = 1; i <= 2; i++) {
+		fib_node* child = new fib_node;
+		child->n      = node->n - i;
+		child->parent = node;
+		submit(fib_job, child);
+	}
+}
+
+uint64_t fib_pool(int) {
+	uint64_t result = 0;
+	fib_node* root = new fib_node;
+	root->n      = FIB_N;
+	root->parent = nullptr;
+	root->result = &result;
+	submit(fib_job, root);
+	wait_all();
+	return result;
+}
+
+uint64_t fib_async_rec(int n) {
+	if (n < FIB_CUTOFF) return fib_serial(n);
+	std::future<uint64_t> a = std::async(std::launch::async, fib_async_rec, n - 1);
+	uint64_t b = fib_async_rec(n - 2);
+	return a.get() + b;
+}
+
+uint64_t fib_async(int) { return fib_async_rec(FIB_N); }
+
+uint64_t fib_omp_rec(int n) {
+	if (n < FIB_CUTOFF) return fib_serial(n);
+	uint64_t a, b;
+	#pragma omp task shared(a)
+	a = fib_omp_rec(n - 1);
+	b = fib_omp_rec(n - 2);
+	#pragma omp taskwait
+	return a + b;
+}
+
+uint64_t fib_omp(int) {
+	uint64_t result = 0;
+	#pragma omp parallel
+	#pragma omp single
+	result = fib_omp_rec(FIB_N);
+	return result;
+}
+
+
+/* ----------------------------- fan-out ----------------------------- */
+
+const int FAN_ROUNDS = 2000;
+
+struct fan_slot {
+	uint32_t seed;
+	uint32_t value;
+};
+
+void fan_body(fan_slot* slot) { slot->value = hash(slot->seed, 256); }
+void fan_job(void* arg) { fan_body((fan_slot*)arg); }
+
+uint64_t fan_sum(const std::vector<fan_slot>& slots) {
+	uint64_t s = 0;
+	for (const fan_slot& slot : slots) s += slot.value;
+	return s;
+}
+
+void fan_seed(std::vector<fan_slot>& slots, int round) {
+	for (std::size_t i = 0; i < slots.size(); i++) slots[i].seed = (uint32_t)(round * slots.size() + i);
+}
+
+uint64_t fan_thpool(int threads, int rounds) {
+	std::vector<fan_slot> slots(8 * threads);
+	uint64_t total = 0;
+	for (int r = 0; r < rounds; r++) {
+		fan_seed(slots, r);
+		thpool_decsemaphore sem;
+		thpool_decsem_init(&sem, (int)slots.size());
+		for (fan_slot& slot : slots) thpool_add_work_with_sem(g_thpool, sem, fan_job, &slot);
+		thpool_wait_cond(&sem);
+		total += fan_sum(slots);
+	}
+	return total;
+}
+
+uint64_t fan_naive(int threads, int rounds) {
+	std::vector<fan_slot> slots(8 * threads);
+	uint64_t total = 0;
+	for (int r = 0; r < rounds; r++) {
+		fan_seed(slots, r);
+		for (fan_slot& slot : slots) submit(fan_job, &slot);
+		wait_all();
+		total += fan_sum(slots);
+	}
+	return total;
+}
+
+uint64_t fan_async(int threads, int rounds) {
+	std::vector<fan_slot> slots(8 * threads);
+	std::vector<std::future<void>> done(slots.size());
+	uint64_t total = 0;
+	for (int r = 0; r < rounds; r++) {
+		fan_seed(slots, r);
+		for (std::size_t i = 0; i < slots.size(); i++) done[i] = std::async(std::launch::async, fan_body, &slots[i]);
+		for (std::future<void>& f : done) f.get();
+		total += fan_sum(slots);
+	}
+	return total;
+}
+
+uint64_t fan_omp(int threads, int rounds) {
+	std::vector<fan_slot> slots(8 * threads);
+	uint64_t total = 0;
+	#pragma omp parallel
+	#pragma omp single
+	for (int r = 0; r < rounds; r++) {
+		fan_seed(slots, r);
+		for (std::size_t i = 0; i < slots.size(); i++) {
+			fan_slot* slot = &slots[i];
+			#pragma omp task firstprivate(slot)
+			fan_body(slot);
+		}
+		#pragma omp taskwait
+		total += fan_sum(slots);
+	}
+	return total;
+}
+
+
+/* ----------------------------- pipeline ----------------------------- */
+
+const std::size_t BLOCK_LEN = 16384;
+
+struct block {
+	uint32_t              seed;
+	std::vector<uint32_t> data;
+};
+
+void generate(block* b) {
+	for (std::size_t i = 0; i < BLOCK_LEN; i++) b->data[i] = b->seed * (uint32_t)BLOCK_LEN + (uint32_t)i;
+}
+
+void transform(block* b) {
+	for (std::size_t i = 0; i < BLOCK_LEN; i++) b->data[i] = hash(b->data[i], 4);
+}
+
+/* Sink of the pipeline, called by one stage at a time */
+uint64_t g_sink;
+std::mutex g_sink_mutex;
+
+void reduce(block* b) {
+	uint64_t s = 0;
+	for (uint32_t x : b->data) s += x;
+	g_sink += s;
+}
+
+void reduce_job(void* arg) {
+	std::lock_guard<std::mutex> lock(g_sink_mutex);
+	reduce((block*)arg);
+}
+
+void transform_job(void* arg) {
+	transform((block*)arg);
+	submit(reduce_job, arg);
+}
+
+void generate_job(void* arg) {
+	generate((block*)arg);
+	submit(transform_job, arg);
+}
+
+void blocks_init(std::vector<block>& blocks) {
+	for (std::size_t i = 0; i < blocks.size(); i++) {
+		blocks[i].seed = (uint32_t)i;
+		blocks[i].data.resize(BLOCK_LEN);
+	}
+	g_sink = 0;
+}
+
+uint64_t pipe_pool(std::vector<block>& blocks) {
+	blocks_init(blocks);
+	for (block& b : blocks) submit(generate_job, &b);
+	wait_all();
+	return g_sink;
+}
+
+uint64_t pipe_async(std::vector<block>& blocks) {
+	blocks_init(blocks);
+	std::vector<std::future<void>> done;
+	for (block& b : blocks) {
+		block* p = &b;
+		std::shared_future<void> generated = std::async(std::launch::async, generate, p).share();
+		done.push_back(std::async(std::launch::async, [p, generated] {
+			generated.get();
+			transform(p);
+			std::lock_guard<std::mutex> lock(g_sink_mutex);
+			reduce(p);
+		}));
+	}
+	for (std::future<void>& f : done) f.get();
+	return g_sink;
+}
+
+uint64_t pipe_omp(std::vector<block>& blocks) {
+	blocks_init(blocks);
+	#pragma omp parallel
+	#pragma omp single
+	for (block& b : blocks) {
+		block* p = &b;
+		#pragma omp task firstprivate(p) depend(out: p[0])
+		generate(p);
+		#pragma omp task firstprivate(p) depend(inout: p[0])
+		transform(p);
+		#pragma omp task firstprivate(p) depend(in: p[0]) depend(inout: g_sink)
+		reduce(p);
+	}
+	return g_sink;
+}
+
+
+/* ----------------------------- driver ----------------------------- */
+
+const char* const BACKENDS[] = { "thpool", "std_async", "openmp", "naive_pool" };
+const int         NBACKENDS  = 4;
+
+/* One warm-up and reps timed runs of work; checksum of the last run */
+template <class F>
+bench::summary time_runs(int reps, uint64_t* checksum, F work) {
+	work();
+	std::vector<double> secs;
+	for (int r = 0; r < reps; r++) {
+		uint64_t t0 = bench::now_ns();
+		*checksum = work();
+		secs.push_back((double)(bench::now_ns() - t0) / 1e9);
+	}
+	return bench::summarize(secs);
+}
+
+/* Runs work(backend) on every backend, writes them side by side */
+template <class F>
+void compare(bench::json& out, const char* name, int threads, int reps, F work) {
+	bench::summary secs[NBACKENDS];
+	uint64_t checksum[NBACKENDS];
+	for (int b = 0; b < NBACKENDS; b++) {
+		fprintf(stderr, "%s, %s\n", name, BACKENDS[b]);
+		if (b == 0) g_thpool = thpool_init(threads);
+		if (b == 3) g_naive  = new naive_pool(threads);
+		secs[b] = time_runs(reps, &checksum[b], [&] { return work(b); });
+		if (b == 0) thpool_destroy(g_thpool);
+		if (b == 3) {
+			delete g_naive;
+			g_naive = nullptr;
+		}
+	}
+
+	out.begin_object();
+	out.field("workload", name).field("threads", threads);
+	bool agree = true;
+	for (int b = 1; b < NBACKENDS; b++) agree = agree && checksum[b] == checksum[0];
+	out.field("checksums_agree", agree);
+	out.begin_object("seconds");
+	for (int b = 0; b < NBACKENDS; b++) out.field(BACKENDS[b], secs[b]);
+	out.end_object();
+	out.begin_object("relative_to_thpool");
+	for (int b = 0; b < NBACKENDS; b++) out.field(BACKENDS[b], secs[b].mean / secs[0].mean);
+	out.end_object();
+	out.end_object();
+	if (!agree) fprintf(stderr, "%s: checksums differ\n", name);
+}
+
+} /* namespace */
+
+int main(int argc, char** argv) {
+	int    threads = argc > 1 ? atoi(argv[1]) : (int)std::thread::hardware_concurrency();
+	int    reps    = argc > 2 ? atoi(argv[2]) : 5;
+	double scale   = argc > 3 ? atof(argv[3]) : 1.0;
+	if (threads < 1) threads = 1;
+	if (reps < 2) reps = 2;
+	if (scale <= 0.0) scale = 1.0;
+	omp_set_num_threads(threads);
+
+	std::vector<uint32_t> data((std::size_t)((1 << 22) * scale) + 1);
+	int rounds = (int)(FAN_ROUNDS * scale) > 1 ? (int)(FAN_ROUNDS * scale) : 1;
+	std::vector<block> blocks((std::size_t)(1024 * scale) + 1);
+
+	bench::json out(stdout);
+	out.begin_object();
+	out.field("benchmark", "bench_compare");
+	out.meta();
+	out.field("threads", threads).field("reps", reps).field("scale", scale);
+	out.begin_array("results");
+
+	compare(out, "parallel_for", threads, reps, [&](int b) {
+		return b == 1 ? for_async(data, threads) : b == 2 ? for_omp(data, threads) : for_pool(data, threads);
+	});
+	compare(out, "fib", threads, reps, [&](int b) {
+		return b == 1 ? fib_async(threads) : b == 2 ? fib_omp(threads) : fib_pool(threads);
+	});
+	compare(out, "fan_out", threads, reps, [&](int b) {
+		return b == 0 ? fan_thpool(threads, rounds) : b == 1 ? fan_async(threads, rounds) :
+		       b == 2 ? fan_omp(threads, rounds)    : fan_naive(threads, rounds);
+	});
+	compare(out, "pipeline", threads, reps, [&](int b) {
+		return b == 1 ? pipe_async(blocks) : b == 2 ? pipe_omp(blocks) : pipe_pool(blocks);
+	});
+
+	out.end_array();
+	out.end_object();
+	out.finish();
+	return 0;
+}
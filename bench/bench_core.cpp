@@ -0,0 +1,221 @@
+/**********************************
+ * License:     MIT
+ *
+ **********************************/
+/*! \file bench_core.cpp
+ *
+ *  Microbenchmarks of the pool's core paths, written as JSON to stdout:
+ *
+ *    empty_job_throughput  queue and run empty jobs, per thread count
+ *    submit_cost           thpool_add_work() cost, one and many producers
+ *    wake_to_run           from queueing a job on an idle pool to its start
+ *    wait_round_trip       one job queued and thpool_wait() returning
+ *    decsem_fan            fan-out of jobs on a decsemaphore and fan-in
+ *    init / destroy        thpool_init() and thpool_destroy() time
+ *
+ *  Latencies are issued open loop and taken from their due time, see
+ *  bench_common.h. scale multiplies the job and sample counts.
+ *
+ *  usage: bench_core [max_threads] [scale] > core.json
+ *
+ ********************************/
+
+#include "../thpool.h"
+#include "bench_common.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+namespace {
+
+void empty_job(void*) {}
+
+std::atomic<uint64_t> started_at{0};
+
+void stamp_job(void*) {
+	started_at.store(bench::now_ns(), std::memory_order_release);
+}
+
+
+void bench_throughput(bench::json& out, int threads, long jobs) {
+	threadpool pool = thpool_init(threads);
+	uint64_t t0 = bench::now_ns();
+	for (long i = 0; i < jobs; i++) thpool_add_work(pool, empty_job, nullptr);
+	thpool_wait(pool);
+	double secs = (double)(bench::now_ns() - t0) / 1e9;
+	thpool_destroy(pool);
+
+	out.begin_object();
+	out.field("name", "empty_job_throughput").field("threads", threads).field("jobs", jobs);
+	out.field("seconds", secs).field("jobs_per_sec", (double)jobs / secs);
+	out.end_object();
+}
+
+
+/* Every producer queues jobs / producers jobs at once, only the
+ * thpool_add_work() loops are timed */
+void bench_submit(bench::json& out, int threads, int producers, long jobs) {
+	threadpool pool = thpool_init(threads);
+	long per_producer = jobs / producers;
+	std::atomic<int> ready{0};
+	std::vector<uint64_t> elapsed(producers);
+	std::vector<std::thread> workers;
+	for (int p = 0; p < producers; p++) {
+		workers.emplace_back([&, p] {
+			ready.fetch_add(1);
+			while (ready.load() < producers) BENCH_CPU_RELAX();
+			uint64_t t0 = bench::now_ns();
+			for (long i = 0; i < per_producer; i++) thpool_add_work(pool, empty_job, nullptr);
+			elapsed[p] = bench::now_ns() - t0;
+		});
+	}
+	for (std::thread& t : workers) t.join();
+	thpool_wait(pool);
+	thpool_destroy(pool);
+
+	uint64_t slowest = 0, total = 0;
+	for (uint64_t e : elapsed) {
+		total += e;
+		if (e > slowest) slowest = e;
+	}
+	out.begin_object();
+	out.field("name", "submit_cost").field("threads", threads).field("producers", producers);
+	out.field("jobs", per_producer * producers);
+	out.field("ns_per_job", (double)total / (double)(per_producer * producers));
+	out.field("jobs_per_sec", (double)(per_producer * producers) * 1e9 / (double)slowest);
+	out.end_object();
+}
+
+
+/* The gap lets the workers go back to sleep before the next job */
+void bench_wake(bench::json& out, int threads, int samples, uint64_t gap_ns) {
+	threadpool pool = thpool_init(threads);
+	bench::latency lat;
+	bench::pacer pace;
+	for (int i = 0; i < samples; i++) {
+		started_at.store(0, std::memory_order_relaxed);
+		uint64_t due = pace.next(gap_ns);
+		thpool_add_work(pool, stamp_job, nullptr);
+		uint64_t started;
+		while ((started = started_at.load(std::memory_order_acquire)) == 0) BENCH_CPU_RELAX();
+		lat.record(started - due);
+	}
+	thpool_wait(pool);
+	thpool_destroy(pool);
+
+	out.begin_object();
+	out.field("name", "wake_to_run").field("threads", threads).field("interval_ns", (unsigned long long)gap_ns);
+	out.field("latency", lat);
+	out.end_object();
+}
+
+
+void bench_wait(bench::json& out, int threads, int samples, uint64_t gap_ns) {
+	threadpool pool = thpool_init(threads);
+	bench::latency lat;
+	bench::pacer pace;
+	for (int i = 0; i < samples; i++) {
+		uint64_t due = pace.next(gap_ns);
+		thpool_add_work(pool, empty_job, nullptr);
+		thpool_wait(pool);
+		lat.record(bench::now_ns() - due);
+	}
+	thpool_destroy(pool);
+
+	out.begin_object();
+	out.field("name", "wait_round_trip").field("threads", threads).field("interval_ns", (unsigned long long)gap_ns);
+	out.field("latency", lat);
+	out.end_object();
+}
+
+
+/* fan_out: due time until all jobs are queued, fan_in: from there until
+ * the decsemaphore released the caller */
+void bench_decsem(bench::json& out, int threads, int fan, int samples, uint64_t gap_ns) {
+	threadpool pool = thpool_init(threads);
+	bench::latency fan_out, fan_in, total;
+	bench::pacer pace;
+	for (int i = 0; i < samples; i++) {
+		uint64_t due = pace.next(gap_ns);
+		thpool_decsemaphore sem;
+		thpool_decsem_init(&sem, fan);
+		for (int j = 0; j < fan; j++) thpool_add_work_with_sem(pool, sem, empty_job, nullptr);
+		uint64_t queued = bench::now_ns();
+		thpool_wait_cond(&sem);
+		uint64_t done = bench::now_ns();
+		fan_out.record(queued - due);
+		fan_in.record(done - queued);
+		total.record(done - due);
+	}
+	thpool_destroy(pool);
+
+	out.begin_object();
+	out.field("name", "decsem_fan").field("threads", threads).field("fan", fan);
+	out.field("interval_ns", (unsigned long long)gap_ns);
+	out.field("fan_out", fan_out).field("fan_in", fan_in).field("total", total);
+	out.end_object();
+}
+
+
+void bench_lifecycle(bench::json& out, int threads, int samples) {
+	bench::latency init, destroy;
+	for (int i = 0; i < samples; i++) {
+		uint64_t t0 = bench::now_ns();
+		threadpool pool = thpool_init(threads);
+		uint64_t t1 = bench::now_ns();
+		thpool_destroy(pool);
+		uint64_t t2 = bench::now_ns();
+		init.record(t1 - t0);
+		destroy.record(t2 - t1);
+	}
+
+	out.begin_object();
+	out.field("name", "lifecycle").field("threads", threads);
+	out.field("init", init).field("destroy", destroy);
+	out.end_object();
+}
+
+} /* namespace */
+
+int main(int argc, char** argv) {
+	int    max_threads = argc > 1 ? atoi(argv[1]) : (int)std::thread::hardware_concurrency();
+	double scale       = argc > 2 ? atof(argv[2]) : 1.0;
+	if (max_threads < 1) max_threads = 1;
+	if (scale <= 0.0) scale = 1.0;
+
+	long jobs    = (long)(200000 * scale);
+	int  samples = (int)(2000 * scale) > 10 ? (int)(2000 * scale) : 10;
+	std::vector<int> counts = bench::thread_counts(max_threads);
+
+	bench::json out(stdout);
+	out.begin_object();
+	out.field("benchmark", "bench_core");
+	out.meta();
+	out.field("max_threads", max_threads).field("scale", scale);
+	out.begin_array("results");
+
+	for (int threads : counts) {
+		fprintf(stderr, "throughput, %d threads\n", threads);
+		bench_throughput(out, threads, jobs);
+	}
+	for (int producers : counts) {
+		fprintf(stderr, "submit cost, %d producers\n", producers);
+		bench_submit(out, max_threads, producers, jobs);
+	}
+	fprintf(stderr, "wake to run\n");
+	bench_wake(out, max_threads, samples, 1000000);
+	fprintf(stderr, "wait round trip\n");
+	bench_wait(out, max_threads, samples, 200000);
+	fprintf(stderr, "decsemaphore fan-out / fan-in\n");
+	bench_decsem(out, max_threads, 4 * max_threads, samples, 500000);
+	fprintf(stderr, "init / destroy\n");
+	bench_lifecycle(out, max_threads, samples / 20 > 5 ? samples / 20 : 5);
+
+	out.end_array();
+	out.end_object();
+	out.finish();
+	return 0;
+}
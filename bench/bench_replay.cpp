@@ -0,0 +1,341 @@
+/**********************************
+ * License:     MIT
+ *
+ **********************************/
+/*! \file bench_replay.cpp
+ *
+ *  Replays a recorded trace of jobs against a pool and reports the
+ *  queueing delay of every job, written as JSON to stdout.
+ *
+ *  Each job of the trace has an arrival time, a duration and the jobs it
+ *  depends on. The replay queues a job once it has arrived and all its
+ *  dependencies have finished, and the job spins for its duration. The
+ *  queueing delay is from that release to the start of the job; the
+ *  response time is from the arrival to the end of the job. Arrivals are
+ *  issued at their due time however late the driver is (see
+ *  bench_common.h), so runs of the same trace can be compared between
+ *  builds of the pool.
+ *
+ *  CSV trace, one job per line, ids are line numbers from 0 on, lines
+ *  starting with '#' and a header line are skipped:
+ *
+ *    arrival_us,duration_us,dependencies
+ *    0,12.5,
+ *    3,40,0
+ *    3.5,8,0 1
+ *
+ *  Dependencies are ids of earlier jobs separated by spaces or ';', and
+ *  arrivals must not decrease. The binary trace holds the same in native
+ *  byte order: "THPTRC01", the u64 job count, then per job the u64 arrival
+ *  and duration in ns, the u32 dependency count and the u32 dependencies.
+ *
+ *  usage: bench_replay <trace> [threads] [speedup] [jobs.csv] > replay.json
+ *         bench_replay --convert <trace.csv> <trace.bin>
+ *
+ *  speedup divides the arrival times, leaving the durations as they are.
+ *  jobs.csv receives id, arrival, release, start and end in ns from the
+ *  start of the replay, and the queueing delay.
+ *
+ ********************************/
+
+#include "../thpool.h"
+#include "bench_common.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace {
+
+const char     TRACE_MAGIC[8] = { 'T', 'H', 'P', 'T', 'R', 'C', '0', '1' };
+const uint32_t NO_JOB         = 0xffffffffu;
+
+/* Jobs of a trace, dependencies as offsets into one array */
+struct trace {
+	std::vector<uint64_t> arrival_ns;
+	std::vector<uint64_t> duration_ns;
+	std::vector<uint32_t> dep_first;   /* job count + 1 entries */
+	std::vector<uint32_t> deps;
+
+	std::size_t size() const { return arrival_ns.size(); }
+};
+
+bool add_job(trace& t, uint64_t arrival, uint64_t duration, const std::vector<uint32_t>& deps,
+             const char* path, long line) {
+	uint32_t id = (uint32_t)t.size();
+	if (id == NO_JOB) {
+		fprintf(stderr, "%s: too many jobs\n", path);
+		return false;
+	}
+	if (id > 0 && arrival < t.arrival_ns.back()) {
+		fprintf(stderr, "%s:%ld: arrival before the previous job's\n", path, line);
+		return false;
+	}
+	for (uint32_t dep : deps) {
+		if (dep >= id) {
+			fprintf(stderr, "%s:%ld: job %u depends on job %u, not an earlier one\n", path, line, id, dep);
+			return false;
+		}
+	}
+	if (t.dep_first.empty()) t.dep_first.push_back(0);
+	t.arrival_ns.push_back(arrival);
+	t.duration_ns.push_back(duration);
+	t.deps.insert(t.deps.end(), deps.begin(), deps.end());
+	t.dep_first.push_back((uint32_t)t.deps.size());
+	return true;
+}
+
+bool load_csv(trace& t, FILE* in, const char* path) {
+	char buf[4096];
+	long line = 0;
+	std::vector<uint32_t> deps;
+	while (fgets(buf, sizeof(buf), in)) {
+		line++;
+		char* p = buf;
+		while (*p == ' ' || *p == '\t') p++;
+		if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0') continue;
+		if (line == 1 && !(*p >= '0' && *p <= '9') && *p != '.') continue;   /* header */
+
+		char* end;
+		double arrival = strtod(p, &end);
+		if (end == p || *end != ',') {
+			fprintf(stderr, "%s:%ld: expected arrival_us,duration_us[,dependencies]\n", path, line);
+			return false;
+		}
+		p = end + 1;
+		double duration = strtod(p, &end);
+		if (end == p || arrival < 0.0 || duration < 0.0) {
+			fprintf(stderr, "%s:%ld: bad duration\n", path, line);
+			return false;
+		}
+		p = end;
+		deps.clear();
+		if (*p == ',') {
+			for (p++; ; ) {
+				while (*p == ' ' || *p == ';' || *p == '\t') p++;
+				if (*p < '0' || *p > '9') break;
+				deps.push_back((uint32_t)strtoul(p, &end, 10));
+				p = end;
+			}
+		}
+		if (*p != '\n' && *p != '\r' && *p != '\0') {
+			fprintf(stderr, "%s:%ld: bad dependency list\n", path, line);
+			return false;
+		}
+		if (!add_job(t, (uint64_t)(arrival * 1000.0 + 0.5), (uint64_t)(duration * 1000.0 + 0.5), deps, path, line))
+			return false;
+	}
+	return true;
+}
+
+bool load_binary(trace& t, FILE* in, const char* path) {
+	uint64_t count;
+	if (fread(&count, sizeof(count), 1, in) != 1) {
+		fprintf(stderr, "%s: truncated header\n", path);
+		return false;
+	}
+	std::vector<uint32_t> deps;
+	for (uint64_t i = 0; i < count; i++) {
+		uint64_t times[2];
+		uint32_t dep_count;
+		if (fread(times, sizeof(times), 1, in) != 1 || fread(&dep_count, sizeof(dep_count), 1, in) != 1) {
+			fprintf(stderr, "%s: truncated at job %llu\n", path, (unsigned long long)i);
+			return false;
+		}
+		deps.resize(dep_count);
+		if (dep_count > 0 && fread(deps.data(), sizeof(uint32_t), dep_count, in) != dep_count) {
+			fprintf(stderr, "%s: truncated at job %llu\n", path, (unsigned long long)i);
+			return false;
+		}
+		if (!add_job(t, times[0], times[1], deps, path, (long)i)) return false;
+	}
+	return true;
+}
+
+/* Binary if the file starts with the magic, CSV otherwise */
+bool load_trace(trace& t, const char* path) {
+	FILE* in = fopen(path, "rb");
+	if (in == nullptr) {
+		perror(path);
+		return false;
+	}
+	char magic[sizeof(TRACE_MAGIC)];
+	bool binary = fread(magic, sizeof(magic), 1, in) == 1 && memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0;
+	if (!binary) rewind(in);
+	bool ok = binary ? load_binary(t, in, path) : load_csv(t, in, path);
+	fclose(in);
+	return ok;
+}
+
+bool save_binary(const trace& t, const char* path) {
+	FILE* out = fopen(path, "wb");
+	if (out == nullptr) {
+		perror(path);
+		return false;
+	}
+	uint64_t count = t.size();
+	bool ok = fwrite(TRACE_MAGIC, sizeof(TRACE_MAGIC), 1, out) == 1 && fwrite(&count, sizeof(count), 1, out) == 1;
+	for (std::size_t i = 0; ok && i < t.size(); i++) {
+		uint64_t times[2] = { t.arrival_ns[i], t.duration_ns[i] };
+		uint32_t dep_count = t.dep_first[i + 1] - t.dep_first[i];
+		ok = fwrite(times, sizeof(times), 1, out) == 1 && fwrite(&dep_count, sizeof(dep_count), 1, out) == 1;
+		if (ok && dep_count > 0)
+			ok = fwrite(&t.deps[t.dep_first[i]], sizeof(uint32_t), dep_count, out) == dep_count;
+	}
+	if (fclose(out) != 0) ok = false;
+	if (!ok) perror(path);
+	return ok;
+}
+
+
+/* ----------------------------- replay ----------------------------- */
+
+/* A job runs once its arrival and each of its dependencies have counted
+ * down pending; whoever takes it to zero queues it */
+struct replay_job {
+	std::atomic<uint32_t> pending;
+	uint64_t              release;
+	uint64_t              start;
+	uint64_t              end;
+};
+
+struct replay {
+	const trace*                  t;
+	std::unique_ptr<replay_job[]> jobs;
+	std::vector<uint32_t>         dependent_first;   /* reverse of trace::deps */
+	std::vector<uint32_t>         dependents;
+	threadpool                    pool;
+};
+
+replay g_replay;
+
+void replay_run(void* arg);
+
+void replay_release(uint32_t id, uint64_t now) {
+	replay_job& job = g_replay.jobs[id];
+	if (job.pending.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+	job.release = now;
+	thpool_add_work(g_replay.pool, replay_run, (void*)(uintptr_t)id);
+}
+
+void replay_run(void* arg) {
+	uint32_t id = (uint32_t)(uintptr_t)arg;
+	replay_job& job = g_replay.jobs[id];
+	job.start = bench::now_ns();
+	uint64_t end = job.start + g_replay.t->duration_ns[id];
+	while (bench::now_ns() < end) {}
+	job.end = bench::now_ns();
+	for (uint32_t i = g_replay.dependent_first[id]; i < g_replay.dependent_first[id + 1]; i++)
+		replay_release(g_replay.dependents[i], job.end);
+}
+
+void index_dependents(replay& r, const trace& t) {
+	r.dependent_first.assign(t.size() + 1, 0);
+	for (uint32_t dep : t.deps) r.dependent_first[dep + 1]++;
+	for (std::size_t i = 0; i < t.size(); i++) r.dependent_first[i + 1] += r.dependent_first[i];
+	r.dependents.resize(t.deps.size());
+	std::vector<uint32_t> fill(r.dependent_first.begin(), r.dependent_first.end() - 1);
+	for (uint32_t id = 0; id < t.size(); id++)
+		for (uint32_t i = t.dep_first[id]; i < t.dep_first[id + 1]; i++)
+			r.dependents[fill[t.deps[i]]++] = id;
+}
+
+void write_jobs(const char* path, const trace& t, uint64_t base) {
+	FILE* out = fopen(path, "w");
+	if (out == nullptr) {
+		perror(path);
+		return;
+	}
+	fprintf(out, "id,arrival_ns,release_ns,start_ns,end_ns,queue_delay_ns\n");
+	for (std::size_t i = 0; i < t.size(); i++) {
+		const replay_job& job = g_replay.jobs[i];
+		fprintf(out, "%zu,%llu,%llu,%llu,%llu,%llu\n", i,
+		        (unsigned long long)(t.arrival_ns[i]), (unsigned long long)(job.release - base),
+		        (unsigned long long)(job.start - base), (unsigned long long)(job.end - base),
+		        (unsigned long long)(job.start - job.release));
+	}
+	if (fclose(out) != 0) perror(path);
+}
+
+} /* namespace */
+
+int main(int argc, char** argv) {
+	if (argc == 4 && strcmp(argv[1], "--convert") == 0) {
+		trace t;
+		return load_trace(t, argv[2]) && save_binary(t, argv[3]) ? 0 : 1;
+	}
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <trace> [threads] [speedup] [jobs.csv]\n"
+		                "       %s --convert <trace.csv> <trace.bin>\n", argv[0], argv[0]);
+		return 2;
+	}
+	const char* path    = argv[1];
+	int         threads = argc > 2 ? atoi(argv[2]) : (int)std::thread::hardware_concurrency();
+	double      speedup = argc > 3 ? atof(argv[3]) : 1.0;
+	const char* jobs    = argc > 4 ? argv[4] : nullptr;
+	if (threads < 1) threads = 1;
+	if (speedup <= 0.0) speedup = 1.0;
+
+	trace t;
+	if (!load_trace(t, path)) return 1;
+	for (uint64_t& a : t.arrival_ns) a = (uint64_t)((double)a / speedup);
+	fprintf(stderr, "%zu jobs, %zu dependencies\n", t.size(), t.deps.size());
+
+	g_replay.t = &t;
+	g_replay.jobs.reset(new replay_job[t.size()]);
+	for (std::size_t i = 0; i < t.size(); i++)
+		g_replay.jobs[i].pending.store(t.dep_first[i + 1] - t.dep_first[i] + 1, std::memory_order_relaxed);
+	index_dependents(g_replay, t);
+	g_replay.pool = thpool_init(threads);
+
+	thpool_stats before, after;
+	int counted = thpool_stats_snapshot(g_replay.pool, &before);
+	uint64_t base = bench::now_ns();
+	for (uint32_t id = 0; id < t.size(); id++) {
+		uint64_t due = base + t.arrival_ns[id];
+		bench::wait_until(due);
+		replay_release(id, due);
+	}
+	thpool_wait(g_replay.pool);
+	uint64_t wall = bench::now_ns() - base;
+	counted |= thpool_stats_snapshot(g_replay.pool, &after);
+	thpool_destroy(g_replay.pool);
+
+	bench::latency queue_delay, response, blocked;
+	uint64_t work = 0;
+	for (std::size_t i = 0; i < t.size(); i++) {
+		const replay_job& job = g_replay.jobs[i];
+		uint64_t arrival = base + t.arrival_ns[i];
+		queue_delay.record(job.start - job.release);
+		response.record(job.end - arrival);
+		blocked.record(job.release - arrival);
+		work += t.duration_ns[i];
+	}
+	if (jobs) write_jobs(jobs, t, base);
+
+	bench::json out(stdout);
+	out.begin_object();
+	out.field("benchmark", "bench_replay");
+	out.meta();
+	out.field("trace", path).field("threads", threads).field("speedup", speedup);
+	out.field("jobs", (unsigned long)t.size()).field("dependencies", (unsigned long)t.deps.size());
+	out.field("seconds", (double)wall / 1e9);
+	if (t.size() > 0 && t.arrival_ns.back() > 0)
+		out.field("offered_load", (double)work / ((double)t.arrival_ns.back() * threads));
+	if (counted == 0) {
+		out.field("efficiency", (double)(after.busy_ns - before.busy_ns) / ((double)wall * threads));
+		out.field("parks", (unsigned long long)(after.parks - before.parks));
+		out.field("wakes", (unsigned long long)(after.wakes - before.wakes));
+		out.field("empty_pulls", (unsigned long long)(after.empty_pulls - before.empty_pulls));
+	}
+	out.field("queue_delay", queue_delay);
+	out.field("dependency_wait", blocked);
+	out.field("response", response);
+	out.end_object();
+	out.finish();
+	return 0;
+}
@@ -0,0 +1,258 @@
+/**********************************
+ * License:     MIT
+ *
+ **********************************/
+/*! \file bench_sweep.cpp
+ *
+ *  Scalability sweep over thread count, producer count and job size,
+ *  written as JSON to stdout.
+ *
+ *  Every point runs one warm-up and reps timed runs. In each run the
+ *  producers queue their share of the jobs at once and the run ends when
+ *  thpool_wait() returns. A point reports jobs per second over its runs
+ *  as mean, standard deviation and 95% confidence interval, and the
+ *  pool's counters summed over the runs: parks, wakes, empty pulls and,
+ *  built with -DTHPOOL_LOCK_STATS, the contention of each pool lock. A
+ *  slowdown then comes with the counters that explain it.
+ *
+ *  Given a baseline (an earlier output of bench_sweep) every point is
+ *  compared with the baseline's point of the same id using Welch's t-test.
+ *  A point regressed if it is slower by more than MIN_CHANGE and the
+ *  difference is significant at 95%. The exit status is 1 if any point
+ *  regressed.
+ *
+ *  usage: bench_sweep [max_threads] [reps] [scale] [baseline.json] > sweep.json
+ *
+ ********************************/
+
+#include "../thpool.h"
+#include "bench_common.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+const uint64_t JOB_SIZES[] = { 0, 1000, 10000, 100000 };
+const double   MIN_CHANGE  = 0.02;   /* smaller changes are not reported */
+
+void spin_job(void* arg) {
+	uint64_t ns = (uint64_t)(uintptr_t)arg;
+	if (ns == 0) return;
+	uint64_t end = bench::now_ns() + ns;
+	while (bench::now_ns() < end) {}
+}
+
+
+struct point {
+	int                 threads;
+	int                 producers;
+	uint64_t            job_ns;
+	long                jobs;              /* per run */
+	std::vector<double> jobs_per_sec;      /* per run */
+	thpool_stats        stats;             /* summed over the timed runs */
+	bool                counted;
+};
+
+void stats_add(thpool_stats& sum, const thpool_stats& before, const thpool_stats& after) {
+	sum.parks       += after.parks       - before.parks;
+	sum.wakes       += after.wakes       - before.wakes;
+	sum.empty_pulls += after.empty_pulls - before.empty_pulls;
+	for (int i = 0; i < THPOOL_LOCKS; i++) {
+		sum.locks[i].acquisitions += after.locks[i].acquisitions - before.locks[i].acquisitions;
+		sum.locks[i].contended    += after.locks[i].contended    - before.locks[i].contended;
+		sum.locks[i].wait_ns      += after.locks[i].wait_ns      - before.locks[i].wait_ns;
+	}
+}
+
+/* One run: producers start together, returns jobs per second */
+double run_once(threadpool pool, int producers, long jobs, uint64_t job_ns) {
+	long per_producer = jobs / producers;
+	std::atomic<int> ready{0};
+	std::atomic<uint64_t> t0{0};
+	std::vector<std::thread> feeders;
+	for (int p = 0; p < producers; p++) {
+		feeders.emplace_back([&, p] {
+			ready.fetch_add(1);
+			while (ready.load() < producers) BENCH_CPU_RELAX();
+			if (p == 0) t0.store(bench::now_ns());
+			for (long i = 0; i < per_producer; i++) thpool_add_work(pool, spin_job, (void*)(uintptr_t)job_ns);
+		});
+	}
+	for (std::thread& t : feeders) t.join();
+	thpool_wait(pool);
+	uint64_t elapsed = bench::now_ns() - t0.load();
+	return (double)(per_producer * producers) * 1e9 / (double)elapsed;
+}
+
+void run_point(point& pt, int reps) {
+	threadpool pool = thpool_init(pt.threads);
+	run_once(pool, pt.producers, pt.jobs, pt.job_ns);
+	pt.stats   = thpool_stats();
+	pt.counted = true;
+	for (int r = 0; r < reps; r++) {
+		thpool_stats before, after;
+		int counted = thpool_stats_snapshot(pool, &before);
+		pt.jobs_per_sec.push_back(run_once(pool, pt.producers, pt.jobs, pt.job_ns));
+		counted |= thpool_stats_snapshot(pool, &after);
+		if (counted != 0) pt.counted = false;
+		else              stats_add(pt.stats, before, after);
+	}
+	thpool_destroy(pool);
+}
+
+std::string point_id(const point& pt) {
+	char id[64];
+	snprintf(id, sizeof(id), "t%d_p%d_j%llu", pt.threads, pt.producers, (unsigned long long)pt.job_ns);
+	return id;
+}
+
+
+/* ----------------------------- baseline ----------------------------- */
+
+/* Number following "key": between from and to, NAN if missing */
+double number_in(const std::string& text, std::size_t from, std::size_t to, const char* key) {
+	std::string quoted = std::string("\"") + key + "\":";
+	std::size_t at = text.find(quoted, from);
+	if (at == std::string::npos || at >= to) return NAN;
+	return strtod(text.c_str() + at + quoted.size(), nullptr);
+}
+
+/* jobs_per_sec of the point with id in an earlier output */
+bool baseline_point(const std::string& text, const std::string& id, bench::summary& s) {
+	std::size_t at = text.find("\"id\": \"" + id + "\"");
+	if (at == std::string::npos) return false;
+	at = text.find("\"jobs_per_sec\": {", at);
+	if (at == std::string::npos) return false;
+	std::size_t end = text.find('}', at);
+	double n = number_in(text, at, end, "n");
+	s.mean   = number_in(text, at, end, "mean");
+	s.stddev = number_in(text, at, end, "stddev");
+	s.ci95   = number_in(text, at, end, "ci95");
+	if (std::isnan(n) || std::isnan(s.mean) || std::isnan(s.stddev)) return false;
+	s.n = (int)n;
+	return true;
+}
+
+bool read_file(const char* path, std::string& text) {
+	FILE* in = fopen(path, "rb");
+	if (in == nullptr) {
+		perror(path);
+		return false;
+	}
+	char buf[65536];
+	std::size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), in)) > 0) text.append(buf, n);
+	fclose(in);
+	return true;
+}
+
+/* Writes the comparison, returns whether the point regressed */
+bool compare(bench::json& out, const bench::summary& now, const bench::summary& base) {
+	double df;
+	double t      = bench::welch_t(now, base, &df);
+	double change = base.mean > 0.0 ? now.mean / base.mean - 1.0 : 0.0;
+	bool   significant = std::fabs(t) > bench::t95(df) && std::fabs(change) > MIN_CHANGE;
+	out.begin_object("baseline");
+	out.field("jobs_per_sec", base);
+	out.field("change", change);
+	out.field("t", std::isinf(t) ? (t > 0 ? 1e9 : -1e9) : t).field("df", df);
+	out.field("significant", significant);
+	out.field("regression", significant && change < 0.0);
+	out.end_object();
+	return significant && change < 0.0;
+}
+
+
+void write_stats(bench::json& out, const point& pt) {
+	if (!pt.counted) return;
+	out.begin_object("stats");
+	out.field("parks", (unsigned long long)pt.stats.parks);
+	out.field("wakes", (unsigned long long)pt.stats.wakes);
+	out.field("empty_pulls", (unsigned long long)pt.stats.empty_pulls);
+#ifdef THPOOL_LOCK_STATS
+	static const char* lock_names[THPOOL_LOCKS] = { "queue", "count", "has_jobs" };
+	out.begin_object("locks");
+	for (int i = 0; i < THPOOL_LOCKS; i++) {
+		const thpool_lock_stats& l = pt.stats.locks[i];
+		out.begin_object(lock_names[i]);
+		out.field("acquisitions", (unsigned long long)l.acquisitions);
+		out.field("contended", (unsigned long long)l.contended);
+		out.field("wait_ns", (unsigned long long)l.wait_ns);
+		out.end_object();
+	}
+	out.end_object();
+#endif
+	out.end_object();
+}
+
+} /* namespace */
+
+int main(int argc, char** argv) {
+	int         max_threads = argc > 1 ? atoi(argv[1]) : (int)std::thread::hardware_concurrency();
+	int         reps        = argc > 2 ? atoi(argv[2]) : 5;
+	double      scale       = argc > 3 ? atof(argv[3]) : 1.0;
+	const char* baseline    = argc > 4 ? argv[4] : nullptr;
+	if (max_threads < 1) max_threads = 1;
+	if (reps < 2) reps = 2;
+	if (scale <= 0.0) scale = 1.0;
+
+	std::string base_text;
+	if (baseline && !read_file(baseline, base_text)) return 2;
+
+	std::vector<int> counts = bench::thread_counts(max_threads);
+	bench::json out(stdout);
+	out.begin_object();
+	out.field("benchmark", "bench_sweep");
+	out.meta();
+	out.field("max_threads", max_threads).field("reps", reps).field("scale", scale);
+	if (baseline) out.field("baseline", baseline);
+	out.begin_array("points");
+
+	int regressions = 0, compared = 0;
+	for (uint64_t job_ns : JOB_SIZES) {
+		for (int threads : counts) {
+			for (int producers : counts) {
+				point pt;
+				pt.threads   = threads;
+				pt.producers = producers;
+				pt.job_ns    = job_ns;
+				/* about 50 ms of work per worker and run */
+				double jobs  = 5e7 * threads / (double)(job_ns + 500);
+				pt.jobs      = (long)(scale * (jobs < 100000.0 ? jobs : 100000.0));
+				if (pt.jobs < 100 * producers) pt.jobs = 100 * producers;
+				std::string id = point_id(pt);
+				fprintf(stderr, "%s\n", id.c_str());
+				run_point(pt, reps);
+
+				bench::summary s = bench::summarize(pt.jobs_per_sec);
+				out.begin_object();
+				out.field("id", id.c_str());
+				out.field("threads", threads).field("producers", producers);
+				out.field("job_ns", (unsigned long long)job_ns).field("jobs", pt.jobs);
+				out.field("jobs_per_sec", s);
+				write_stats(out, pt);
+				bench::summary base;
+				if (baseline && baseline_point(base_text, id, base)) {
+					compared++;
+					if (compare(out, s, base)) {
+						regressions++;
+						fprintf(stderr, "  regression: %.0f -> %.0f jobs/s\n", base.mean, s.mean);
+					}
+				}
+				out.end_object();
+			}
+		}
+	}
+
+	out.end_array();
+	if (baseline) out.field("compared", compared).field("regressions", regressions);
+	out.end_object();
+	out.finish();
+	return regressions > 0 ? 1 : 0;
+}
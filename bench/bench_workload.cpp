@@ -0,0 +1,322 @@
+/**********************************
+ * License:     MIT
+ *
+ **********************************/
+/*! \file bench_workload.cpp
+ *
+ *  The pool under synthetic production-like job mixes, written as JSON to
+ *  stdout:
+ *
+ *    bimodal_poisson   99% 1 us / 1% 10 ms jobs, Poisson arrivals
+ *    bimodal_bursty    same jobs, arriving in bursts of 32
+ *    blocking          20 us jobs, 5% of them sleep 2 ms instead
+ *    fork_join         trees of fanout 4 and depth 4, leaves spin 5 us
+ *    streaming         triad over 4 MiB arrays per job, memory bound
+ *
+ *  Arrivals are open loop at load times the pool's capacity; latency is
+ *  from an arrival's due time to the end of its job (or tree). Besides
+ *  throughput and latency every run reports
+ *
+ *    efficiency        time in jobs / (wall time * threads), from the
+ *                      pool's own counters
+ *    cpu_utilization   cpu time of the workers / (wall time * threads)
+ *
+ *  usage: bench_workload [threads] [scale] [load] > workload.json
+ *
+ ********************************/
+
+#include "../thpool.h"
+#include "bench_common.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <time.h>
+#include <vector>
+
+namespace {
+
+threadpool g_pool;
+
+void spin_for(uint64_t ns) {
+	uint64_t end = bench::now_ns() + ns;
+	while (bench::now_ns() < end) {}
+}
+
+uint64_t cpu_ns(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+
+/* Wall time, worker cpu time and pool counters of one run
+ *
+ * Jobs are queued by the main thread only, so the workers' cpu time is
+ * that of the process minus the main thread's.
+ */
+class window {
+public:
+	void begin() {
+		wall_ = bench::now_ns();
+		cpu_  = cpu_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu_ns(CLOCK_THREAD_CPUTIME_ID);
+		thpool_stats_snapshot(g_pool, &stats_);
+	}
+
+	/* Writes the run's fields, returns its wall time */
+	uint64_t end(bench::json& out, int threads, long jobs) {
+		uint64_t wall = bench::now_ns() - wall_;
+		uint64_t cpu  = cpu_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_;
+		thpool_stats stats;
+		int counted = thpool_stats_snapshot(g_pool, &stats);
+		double capacity = (double)wall * threads;
+		out.field("threads", threads).field("jobs", jobs);
+		out.field("seconds", (double)wall / 1e9).field("jobs_per_sec", (double)jobs * 1e9 / (double)wall);
+		if (counted == 0) {
+			out.field("efficiency", (double)(stats.busy_ns - stats_.busy_ns) / capacity);
+			out.field("parks", (unsigned long long)(stats.parks - stats_.parks));
+		}
+		out.field("cpu_utilization", (double)cpu / capacity);
+		return wall;
+	}
+
+private:
+	uint64_t     wall_ = 0;
+	uint64_t     cpu_  = 0;
+	thpool_stats stats_;
+};
+
+
+/* ----------------------------- job mixes ----------------------------- */
+
+struct task {
+	uint64_t due;
+	uint64_t done;
+	uint64_t work_ns;
+	bool     blocks;                   /* sleeps instead of spinning */
+};
+
+void run_task(void* arg) {
+	task* t = (task*)arg;
+	if (t->blocks) std::this_thread::sleep_for(std::chrono::nanoseconds(t->work_ns));
+	else           spin_for(t->work_ns);
+	t->done = bench::now_ns();
+}
+
+struct mix {
+	const char* name;
+	double      p_long;                /* share of long jobs */
+	uint64_t    short_ns;
+	uint64_t    long_ns;
+	bool        long_blocks;
+	int         burst;                 /* arrivals per burst, 1: Poisson */
+};
+
+void bench_mix(bench::json& out, const mix& m, int threads, long jobs, double load) {
+	std::mt19937_64 rng(42);
+	std::uniform_real_distribution<double> coin(0.0, 1.0);
+	double mean_ns = m.p_long * (double)m.long_ns + (1.0 - m.p_long) * (double)m.short_ns;
+	double rate    = load * threads / mean_ns;          /* arrivals per ns */
+	std::exponential_distribution<double> gap(rate / m.burst);
+
+	std::vector<task> tasks(jobs);
+	for (task& t : tasks) {
+		t.blocks  = coin(rng) < m.p_long;
+		t.work_ns = t.blocks ? m.long_ns : m.short_ns;
+		t.blocks  = t.blocks && m.long_blocks;
+	}
+
+	window win;
+	bench::pacer pace;
+	win.begin();
+	for (long i = 0; i < jobs; i++) {
+		uint64_t next_gap = (i + 1) % m.burst ? 0 : (uint64_t)gap(rng);
+		tasks[i].due = pace.next(next_gap);
+		thpool_add_work(g_pool, run_task, &tasks[i]);
+	}
+	thpool_wait(g_pool);
+
+	bench::latency lat;
+	for (const task& t : tasks) lat.record(t.done - t.due);
+	out.begin_object();
+	out.field("name", m.name).field("load", load);
+	win.end(out, threads, jobs);
+	out.field("latency", lat);
+	out.end_object();
+}
+
+
+/* ----------------------------- fork-join ----------------------------- */
+
+const int      FJ_FANOUT  = 4;
+const int      FJ_DEPTH   = 4;
+const uint64_t FJ_LEAF_NS = 5000;
+
+struct fj_tree {
+	uint64_t due;
+	uint64_t done;
+};
+
+struct fj_node {
+	fj_tree*         tree;
+	fj_node*         parent;
+	int              depth;
+	std::atomic<int> pending;
+};
+
+/* The last child to finish completes its parent, up to the root */
+void fj_complete(fj_node* node) {
+	while (node) {
+		fj_node* parent = node->parent;
+		fj_tree* tree   = node->tree;
+		delete node;
+		if (parent == nullptr) {
+			tree->done = bench::now_ns();
+			return;
+		}
+		if (parent->pending.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+		node = parent;
+	}
+}
+
+void fj_run(void* arg) {
+	fj_node* node = (fj_node*)arg;
+	if (node->depth == FJ_DEPTH) {
+		spin_for(FJ_LEAF_NS);
+		fj_complete(node);
+		return;
+	}
+	node->pending.store(FJ_FANOUT, std::memory_order_relaxed);
+	for (int i = 0; i < FJ_FANOUT; i++) {
+		fj_node* child = new fj_node;
+		child->tree   = node->tree;
+		child->parent = node;
+		child->depth  = node->depth + 1;
+		thpool_add_work(g_pool, fj_run, child);
+	}
+}
+
+void bench_fork_join(bench::json& out, int threads, long trees, double load) {
+	long leaves = 1, nodes = 1;
+	for (int d = 0; d < FJ_DEPTH; d++) {
+		leaves *= FJ_FANOUT;
+		nodes  += leaves;
+	}
+	std::mt19937_64 rng(42);
+	std::exponential_distribution<double> gap(load * threads / (double)(leaves * FJ_LEAF_NS));
+
+	std::vector<fj_tree> forest(trees);
+	window win;
+	bench::pacer pace;
+	win.begin();
+	for (long i = 0; i < trees; i++) {
+		forest[i].due = pace.next((uint64_t)gap(rng));
+		fj_node* root = new fj_node;
+		root->tree   = &forest[i];
+		root->parent = nullptr;
+		root->depth  = 0;
+		thpool_add_work(g_pool, fj_run, root);
+	}
+	thpool_wait(g_pool);
+
+	bench::latency lat;
+	for (const fj_tree& t : forest) lat.record(t.done - t.due);
+	out.begin_object();
+	out.field("name", "fork_join").field("load", load).field("trees", trees).field("nodes_per_tree", nodes);
+	win.end(out, threads, trees * nodes);
+	out.field("latency", lat);
+	out.end_object();
+}
+
+
+/* ----------------------------- streaming ----------------------------- */
+
+const std::size_t STREAM_LEN = (4u << 20) / sizeof(double);
+
+struct stream_chunk {
+	std::vector<double> a, b, c;
+	uint64_t            due;
+	uint64_t            done;
+};
+
+void stream_triad(void* arg) {
+	stream_chunk* ch = (stream_chunk*)arg;
+	double* a = ch->a.data();
+	const double* b = ch->b.data();
+	const double* c = ch->c.data();
+	for (std::size_t i = 0; i < STREAM_LEN; i++) a[i] = b[i] + 3.0 * c[i];
+	ch->done = bench::now_ns();
+}
+
+/* Rounds of two chunks per worker, all queued at once */
+void bench_streaming(bench::json& out, int threads, int rounds) {
+	std::vector<stream_chunk> chunks(2 * threads);
+	for (stream_chunk& ch : chunks) {
+		ch.a.assign(STREAM_LEN, 0.0);
+		ch.b.assign(STREAM_LEN, 1.0);
+		ch.c.assign(STREAM_LEN, 2.0);
+	}
+
+	bench::latency lat;
+	window win;
+	win.begin();
+	for (int r = 0; r < rounds; r++) {
+		uint64_t due = bench::now_ns();
+		for (stream_chunk& ch : chunks) {
+			ch.due = due;
+			thpool_add_work(g_pool, stream_triad, &ch);
+		}
+		thpool_wait(g_pool);
+		for (const stream_chunk& ch : chunks) lat.record(ch.done - ch.due);
+	}
+	long jobs = (long)rounds * (long)chunks.size();
+	double bytes = (double)jobs * 3.0 * STREAM_LEN * sizeof(double);   /* 2 reads, 1 write */
+
+	out.begin_object();
+	out.field("name", "streaming");
+	uint64_t wall = win.end(out, threads, jobs);
+	out.field("gb_per_sec", bytes / (double)wall);
+	out.field("latency", lat);
+	out.end_object();
+}
+
+} /* namespace */
+
+int main(int argc, char** argv) {
+	int    threads = argc > 1 ? atoi(argv[1]) : (int)std::thread::hardware_concurrency();
+	double scale   = argc > 2 ? atof(argv[2]) : 1.0;
+	double load    = argc > 3 ? atof(argv[3]) : 0.7;
+	if (threads < 1) threads = 1;
+	if (scale <= 0.0) scale = 1.0;
+	if (load <= 0.0 || load > 1.5) load = 0.7;
+
+	static const mix mixes[] = {
+		{ "bimodal_poisson", 0.01, 1000,  10000000, false, 1  },
+		{ "bimodal_bursty",  0.01, 1000,  10000000, false, 32 },
+		{ "blocking",        0.05, 20000, 2000000,  true,  1  },
+	};
+
+	g_pool = thpool_init(threads);
+	bench::json out(stdout);
+	out.begin_object();
+	out.field("benchmark", "bench_workload");
+	out.meta();
+	out.begin_array("results");
+
+	for (const mix& m : mixes) {
+		fprintf(stderr, "%s\n", m.name);
+		bench_mix(out, m, threads, (long)(20000 * scale), load);
+	}
+	fprintf(stderr, "fork_join\n");
+	bench_fork_join(out, threads, (long)(500 * scale) > 1 ? (long)(500 * scale) : 1, load);
+	fprintf(stderr, "streaming\n");
+	bench_streaming(out, threads, (int)(20 * scale) > 1 ? (int)(20 * scale) : 1);
+
+	out.end_array();
+	out.end_object();
+	out.finish();
+	thpool_destroy(g_pool);
+	return 0;
+}
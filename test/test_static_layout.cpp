@@ -0,0 +1,168 @@
+/**********************************
+ * License:     MIT
+ *
+ **********************************/
+/*! \file test_static_layout.cpp
+ *
+ *  Checks that a static pool stays inside thpool_static_size() bytes: the
+ *  buffer ends right before a PROT_NONE page, every worker fills its whole
+ *  scratch chunk, and the chunks must lie in the buffer, apart from each
+ *  other and from the workers' stacks. A second pool of more than 32
+ *  workers with SLOs and perf counters broadcasts and records SLO waits,
+ *  so its tables and letters must fit in the buffer as well. Exits with 1
+ *  on a failed check.
+ *
+ *  usage: test_static_layout
+ *
+ ********************************/
+
+#include "../thpool.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+const int    THREADS = 4;
+const size_t CHUNK   = 64 * 1024;
+
+struct worker_seen {
+	char* chunk;
+	char* stack;
+};
+
+std::atomic<int> arrived{0};
+worker_seen      seen[THREADS];
+
+/* Holds its worker until every worker runs one, so each fills its own chunk */
+void fill_chunk(void* arg) {
+	worker_seen* w = (worker_seen*)arg;
+	char local;
+	w->stack = &local;
+	w->chunk = (char*)thpool_scratch_alloc(CHUNK);
+	if (w->chunk) memset(w->chunk, 0xab, CHUNK);
+	arrived.fetch_add(1);
+	while (arrived.load() < THREADS) usleep(100);
+}
+
+int failures = 0;
+
+void check(bool ok, const char* what, int worker) {
+	if (ok) return;
+	fprintf(stderr, "worker %d: %s\n", worker, what);
+	failures++;
+}
+
+/* Buffer of size bytes ending right before a PROT_NONE page */
+struct guarded {
+	char*  map;
+	size_t span;
+	char*  buf;
+
+	explicit guarded(size_t size) {
+		size_t page = (size_t)sysconf(_SC_PAGESIZE);
+		span = (size + page - 1) & ~(page - 1);
+		map  = (char*)mmap(NULL, span + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map == MAP_FAILED) {
+			map = NULL;
+			buf = NULL;
+			return;
+		}
+		mprotect(map + span, page, PROT_NONE);
+		buf = map + span - size;
+	}
+	~guarded() {
+		if (map) munmap(map, span + (size_t)sysconf(_SC_PAGESIZE));
+	}
+};
+
+int run(unsigned int flags) {
+	thpool_config config;
+	thpool_config_init(&config);
+	config.num_threads        = THREADS;
+	config.scratch_chunk_size = CHUNK;
+	config.stack_size         = 256 * 1024;
+	config.static_flags       = flags;
+
+	size_t size = thpool_static_size(&config);
+	guarded mem(size);
+	if (mem.buf == NULL) {
+		perror("mmap");
+		return 1;
+	}
+	char* buf = mem.buf;
+
+	arrived.store(0);
+	memset(seen, 0, sizeof(seen));
+	threadpool pool = thpool_init_static(buf, size, &config);
+	for (int n = 0; n < THREADS; n++) thpool_add_work(pool, fill_chunk, &seen[n]);
+	thpool_wait(pool);
+	thpool_destroy(pool);
+
+	for (int n = 0; n < THREADS; n++) {
+		char* c = seen[n].chunk;
+		check(c != NULL, "no scratch chunk", n);
+		if (c == NULL) continue;
+		check(c >= buf && c + CHUNK <= buf + size, "chunk outside the buffer", n);
+		for (int m = 0; m < THREADS; m++) {
+			check(seen[m].stack < c || seen[m].stack >= c + CHUNK, "chunk overlaps a stack", n);
+			if (m != n && seen[m].chunk)
+				check(seen[m].chunk + CHUNK <= c || seen[m].chunk >= c + CHUNK, "chunks overlap", n);
+		}
+	}
+	return 0;
+}
+
+std::atomic<int> visited{0};
+
+void visit(void*) {
+	visited.fetch_add(1);
+}
+
+void tagged_job(void*) {}
+
+int run_tables() {
+	const int big = 40;
+	thpool_slo slo = { 1, 99.0, 1000000 };
+	thpool_config config;
+	thpool_config_init(&config);
+	config.num_threads   = big;
+	config.job_capacity  = 256;
+	config.slos          = &slo;
+	config.slo_count     = 1;
+	config.perf_counters = 1;
+
+	size_t size = thpool_static_size(&config);
+	guarded mem(size);
+	if (mem.buf == NULL) {
+		perror("mmap");
+		return 1;
+	}
+	threadpool pool = thpool_init_static(mem.buf, size, &config);
+	check(pool != NULL, "no pool with SLOs and perf counters", -1);
+	if (pool == NULL) return 0;
+	for (int n = 0; n < 200; n++) thpool_add_work_tagged(pool, 1, tagged_job, NULL);
+	visited.store(0);
+	check(thpool_broadcast(pool, visit, NULL) == 0, "broadcast failed", -1);
+	check(visited.load() == big, "broadcast missed a worker", -1);
+	check(thpool_trace_enable(pool, 1) == -1, "tracing a static pool", -1);
+	thpool_wait(pool);
+	thpool_destroy(pool);
+	return 0;
+}
+
+} /* namespace */
+
+int main() {
+	if (run(0) || run(THPOOL_STATIC_STACKS) || run_tables()) return 1;
+	if (failures) {
+		fprintf(stderr, "%d failed checks\n", failures);
+		return 1;
+	}
+	printf("static layout ok\n");
+	return 0;
+}
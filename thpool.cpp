@@ -16,6 +16,12 @@
 #include "thpool.h"
 #include <exception>
 #include <string>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define _POSIX_C_SOURCE 200809L
 #define DISABLE_PRINT
@@ -29,6 +35,20 @@
 #ifdef LINUX
 #include <sched.h>
 #include <cpuid.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <cxxabi.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#include <execinfo.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #define DO_SLEEP0ms nanosleep((const struct timespec[]){{0, 100L}}, NULL)
 #define DO_SLEEP1ms nanosleep((const struct timespec[]){{0, 1000000L}}, NULL)
 #else
@@ -62,6 +82,34 @@ public:
 //static volatile int threads_keepalive;
 //static volatile int threads_on_hold;
 
+/* Statistics are compiled out with -DTHPOOL_NO_STATS */
+#ifndef THPOOL_NO_STATS
+#define STATS_ADD(stats_p, field, n) \
+	__atomic_store_n(&(stats_p)->field, (stats_p)->field + (n), __ATOMIC_RELAXED)
+#define STATS_NOW(thpool_p) (thpool_p)->jobqueue.now()
+#define STATS_ON 1
+#else
+#define STATS_ADD(stats_p, field, n) ((void)0)
+#define STATS_NOW(thpool_p) 0
+#define STATS_ON 0
+#endif
+
+/* Lock contention counters are compiled in with -DTHPOOL_LOCK_STATS */
+#if defined(THPOOL_LOCK_STATS) && !defined(THPOOL_NO_STATS)
+#define LOCK_STATS_ON 1
+#define LOCK(mutex_p, lockstat_p)   lock_acquire(mutex_p, lockstat_p)
+#define UNLOCK(mutex_p, lockstat_p) lock_release(mutex_p, lockstat_p)
+#define COND_WAIT(cond_p, mutex_p, lockstat_p) lock_cond_wait(cond_p, mutex_p, lockstat_p)
+#else
+#define LOCK_STATS_ON 0
+#define LOCK(mutex_p, lockstat_p)   pthread_mutex_lock(mutex_p)
+#define UNLOCK(mutex_p, lockstat_p) pthread_mutex_unlock(mutex_p)
+#define COND_WAIT(cond_p, mutex_p, lockstat_p) pthread_cond_wait(cond_p, mutex_p)
+#endif
+
+/* Worker running on the calling thread, NULL off the pool */
+static thread_local struct thread* thread_self = NULL;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -75,35 +123,275 @@ typedef struct bsem {
 	pthread_mutex_t mutex;
 	pthread_cond_t   cond;
 	int v;
+	struct lockstat* lockstat;           /* contention counters, NULL */
+	uint64_t generation;                 /* unique per dec_bsem_init() */
 	bool mutex_inzed, cond_inzed;
 } bsem;
 
 
-/* Job */
+/* Job
+ *
+ * Jobs are two cache lines long. The tail of the slot holds the argument
+ * copied by thpool_add_work_copy() when it fits in THPOOL_JOB_INLINE_SIZE,
+ * 16B aligned like malloc() memory so any argument type can live there.
+ */
 typedef struct job{
 	struct job*  prev;                   /* pointer to previous job   */
 	void   (*function)(void* arg);       /* function pointer          */
 	void*  arg;                          /* function's argument       */
 	bsem*  signal_;
+	void*  owned;                        /* heap copy of arg to free  */
+	uint64_t enqueued;                   /* time of jobqueue_push()   */
+	uintptr_t tag;                       /* job class, 0: untagged    */
+	alignas(16) unsigned char payload[THPOOL_JOB_INLINE_SIZE]; /* inline copy of arg */
 } job;
 
 
+/* Job slab
+ *
+ * Jobs are carved out of chunks and recycled through a free list, so
+ * queueing a job does not go through malloc once the slab has warmed up.
+ */
+#define JOBS_PER_CHUNK 64
+
+typedef struct jobchunk{
+	struct jobchunk* next;               /* next allocated chunk      */
+	job  jobs[JOBS_PER_CHUNK];           /* 16B aligned, as malloc()  */
+} jobchunk;
+
+static_assert(offsetof(job, payload) % 16 == 0 && sizeof(job) % 16 == 0, "job payload must be 16B aligned");
+static_assert(offsetof(jobchunk, jobs) % 16 == 0, "slab jobs must be 16B aligned");
+
+typedef struct jobslab{
+	pthread_mutex_t lock;                /* guards free list, chunks  */
+	job       *free;                     /* free jobs linked by prev  */
+	jobchunk  *chunks;                   /* all chunks of the slab    */
+	bool fixed;                          /* never grows (static pool) */
+	bool lock_inzed;
+} jobslab;
+
+
 /* Job queue */
 typedef struct jobqueue{
 	pthread_mutex_t rwmutex;             /* used for queue r/w access */
 	job  *front;                         /* pointer to front of queue */
 	job  *rear;                          /* pointer to rear  of queue */
 	bsem *has_jobs;                      /* flag as binary semaphore  */
+	bsem  has_jobs_sem;                  /* storage of has_jobs       */
 	int   len;                           /* number of jobs in queue   */
+	uint64_t (*now)(void);               /* clock stamping the jobs   */
+	struct lockstat* lockstat;           /* rwmutex counters, or NULL */
 	bool rwmutex_inzed;
 } jobqueue;
 
 
+/* Broadcast letter, one per worker and broadcast */
+typedef struct mail{
+	struct mail* next;                   /* next letter in mailbox    */
+	void   (*function)(void* arg);       /* function pointer          */
+	void*  arg;                          /* function's argument       */
+	bsem*  done;                         /* counts down to completion */
+} mail;
+
+
+/* Scratch arena chunk, the usable bytes follow the header */
+typedef struct scratchchunk{
+	struct scratchchunk* next;           /* next chunk in its list    */
+	size_t size;                         /* usable bytes              */
+	size_t used;                         /* bytes handed out          */
+	bool   fixed;                        /* lives in static pool mem  */
+} scratchchunk;
+
+
+/* Per worker bump-pointer arena behind thpool_scratch_alloc() */
+typedef struct scratch{
+	scratchchunk* active;                /* chunks in use, head bumps */
+	scratchchunk* spare;                 /* chunks kept for reuse     */
+	size_t in_use;                       /* bytes used in this scope  */
+	size_t held;                         /* bytes in all chunks       */
+	size_t window_peak;                  /* max in_use in this window */
+	int    resets;                       /* resets in this window     */
+	uint64_t group;                      /* generation of the group
+	                                        scope being held, 0: none */
+} scratch;
+
+
+/* Worker counters
+ *
+ * Written only by the owning worker with relaxed stores, read by
+ * thpool_stats_snapshot() with relaxed loads; no lock on either side.
+ * Every thread struct is an allocation (or static slot) of its own, so
+ * workers do not share these cache lines.
+ */
+typedef struct workerstats{
+	uint64_t jobs;                       /* jobs run                  */
+	uint64_t busy_ns;                    /* time spent running jobs   */
+	uint64_t idle_ns;                    /* time spent between jobs   */
+	uint64_t parks;                      /* waits that went to sleep  */
+	uint64_t wakes;                      /* returns from sleep        */
+	uint64_t empty_pulls;                /* woken but queue was empty */
+	uint64_t broadcasts;                 /* mailbox letters run       */
+} workerstats;
+
+
+/* Log-linear latency histogram
+ *
+ * Values below HIST_SUB get a bucket each; above, every power of two is
+ * split into HIST_SUB linear buckets, so a bucket is at most 1/HIST_SUB
+ * of its value wide. Values of 2^(HIST_MAX_EXP+1) ns and more land in
+ * the last bucket.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP  40
+#define HIST_BUCKETS  (HIST_SUB + (HIST_MAX_EXP - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct thpool_histogram_{
+	uint64_t count;                      /* samples                   */
+	uint64_t sum;                        /* sum of samples in ns      */
+	uint64_t buckets[HIST_BUCKETS];
+} histogram;
+
+
+/* Contention counters of one of the pool's locks
+ *
+ * Only written by the thread holding the lock, see lock_acquire().
+ */
+typedef struct lockstat{
+	uint64_t acquisitions;               /* times the lock was taken  */
+	uint64_t contended;                  /* ... after waiting for it  */
+	uint64_t wait_ns;                    /* time spent waiting        */
+	uint64_t max_wait_ns;                /* longest wait              */
+	uint64_t hold_ns;                    /* time the lock was held    */
+	uint64_t max_hold_ns;                /* longest hold              */
+	uint64_t held_since;                 /* taken at, while held      */
+	uint64_t (*now)(void);               /* pool's clock              */
+	histogram waits;                     /* contended waits           */
+} lockstat;
+
+
+/* Per worker profile of one job function, see thpool_profile_snapshot()
+ *
+ * Workers keep an open addressing table each, keyed by job->function, so
+ * accounting a job needs no atomic read-modify-write.
+ */
+#define PROFILE_SLOTS 128
+
+typedef struct profileslot{
+	void   (*function)(void* arg);       /* key, NULL: free slot      */
+	uint64_t count;                      /* jobs run                  */
+	uint64_t total_ns;                   /* sum of run times          */
+	uint64_t max_ns;                     /* longest run               */
+	uint64_t wait_ns;                    /* sum of queue waits        */
+	uint64_t max_wait_ns;                /* longest queue wait        */
+} profileslot;
+
+
+/* Hardware counters of a worker, see thpool_perf_snapshot()
+ *
+ * Opened by the worker itself as one perf_event group and read at job
+ * boundaries, with rdpmc when the kernel allows it. Jobs are accounted
+ * by tag, or by function when untagged, in a table of the worker's own.
+ */
+#define PERF_CYCLES       0
+#define PERF_INSTRUCTIONS 1
+#define PERF_LLC_MISSES   2
+#define PERF_CSWITCHES    3
+#define PERF_COUNTERS     4
+#define PERF_SLOTS        64
+
+typedef struct perfslot{
+	uintptr_t key;                       /* tag or function, 0: free  */
+	uintptr_t tag;                       /* tag of the class          */
+	void    (*function)(void* arg);      /* first function seen       */
+	uint64_t  jobs;                      /* jobs run                  */
+	uint64_t  time_ns;                   /* sum of run times          */
+	uint64_t  counts[PERF_COUNTERS];     /* sums of counter deltas    */
+} perfslot;
+
+typedef struct perfcounters{
+	int       fds[PERF_COUNTERS];        /* counter fds, -1: missing  */
+	int       order[PERF_COUNTERS];      /* counters in group order   */
+	int       group_size;                /* counters in the group     */
+	struct perf_event_mmap_page* pages[PERF_LLC_MISSES + 1]; /* rdpmc */
+	bool      hw;                        /* hardware counters open    */
+	bool      rdpmc;                     /* read them with rdpmc      */
+	uint32_t  seen_lock;                 /* leader page seq last read */
+	uint64_t  cswitches;                 /* context switches so far   */
+	perfslot  slots[PERF_SLOTS];
+	uint64_t  dropped;                   /* jobs of a full table      */
+} perfcounters;
+
+
+/* Flight recorder event, see thpool_trace_enable() */
+#define TRACE_JOB  0
+#define TRACE_PARK 1
+#define TRACE_MAIL 2
+
+typedef struct traceevent{
+	uint64_t start;                      /* begin of job / sleep      */
+	uint64_t end;                        /* end of job / sleep        */
+	uint64_t enqueued;                   /* job queued, 0: unknown    */
+	void   (*function)(void* arg);       /* job or broadcast function */
+	uint32_t type;                       /* TRACE_*                   */
+} traceevent;
+
+/* Per worker ring of the latest events, written by the worker only */
+typedef struct tracering{
+	uint64_t head;                       /* events written so far     */
+	uint32_t mask;                       /* capacity - 1              */
+	traceevent events[];
+} tracering;
+
+
+/* Rolling window of an SLO class, kept by the monitor thread */
+typedef struct slostate{
+	uint64_t last[HIST_BUCKETS];         /* merged counts last tick   */
+	double   window[HIST_BUCKETS];       /* decayed counts            */
+	uint64_t p50;                        /* rolling p50 queue wait    */
+	uint64_t p99;                        /* rolling p99 queue wait    */
+	int      breached;                   /* SLO is not met            */
+} slostate;
+
+
+/* Frames of a stuck worker's stack the watchdog keeps */
+#define WATCHDOG_FRAMES 32
+
+
+/* What a worker is doing, see thpool_state_dump() */
+#define WORKER_SPINNING 0                /* awake, between jobs       */
+#define WORKER_PARKED   1                /* waiting for work          */
+#define WORKER_RUNNING  2                /* running job_function      */
+
+
 /* Thread */
 typedef struct thread{
 	int          id;                    /* friendly id               */
 	pthread_t pthread;                  /* pointer to actual thread  */
 	struct thpool_* thpool_p;           /* access to thpool          */
+	scratch      scratch;               /* job-scoped arena          */
+	void*        tls[THPOOL_TLS_SLOTS]; /* thpool_tls_get/set slots  */
+	pthread_mutex_t mbox_lock;          /* guards the mailbox        */
+	mail*        mbox_front;            /* broadcasts to run         */
+	mail*        mbox_rear;
+	volatile int mbox_len;              /* letters in the mailbox    */
+	bool mbox_lock_inzed;
+	workerstats  stats;                 /* counters of this worker   */
+	tracering*   trace;                 /* flight recorder, or NULL  */
+	perfcounters* perf;                 /* hardware counters, or NULL*/
+	uint64_t     job_started;           /* start of current job, 0   */
+	void       (*job_function)(void*);  /* function of current job   */
+	uint64_t     stuck_reported;        /* job start last reported   */
+	void*        stack_frames[WATCHDOG_FRAMES]; /* stack of stuck job */
+	int          stack_depth;           /* frames, -1: being taken   */
+	volatile int state;                 /* WORKER_*                  */
+#ifndef THPOOL_NO_STATS
+	histogram    queue_hist;            /* queue wait of its jobs    */
+	histogram    exec_hist;             /* run time of its jobs      */
+	profileslot  profile[PROFILE_SLOTS];/* run time per job function */
+	uint64_t     profile_dropped;       /* jobs of a full profile    */
+	histogram*   slo_hist;              /* queue wait per SLO class  */
+#endif
 } thread;
 
 
@@ -115,20 +403,90 @@ typedef struct thpool_{
 	pthread_mutex_t  thcount_lock;       /* used for thread count etc */
 	pthread_cond_t  threads_all_idle;    /* signal to thpool_wait     */
 	jobqueue  jobqueue;                  /* job queue                 */
+	jobslab   jobslab;                   /* job allocator             */
 	volatile int threads_keepalive;
-	bool thcount_lock_inzed, threads_all_idle_inzed;
+	thpool_config config;                /* copy of init config       */
+	char  name[16];                      /* thread name prefix        */
+	bool is_static;                      /* lives in caller's memory  */
+	pthread_mutex_t latency_lock;        /* guards latency_base       */
+	histogram* latency_base[2];          /* start of the reset window */
+	volatile int tracing;                /* flight recorder is on     */
+	pthread_t monitor;                   /* watchdog / SLO thread     */
+	pthread_mutex_t monitor_lock;        /* guards monitor_stop       */
+	pthread_cond_t  monitor_wake;        /* ends the monitor's sleep  */
+	volatile int monitor_stop;
+	bool monitor_running, monitor_lock_inzed, monitor_wake_inzed;
+	thpool_slo slos[THPOOL_SLO_MAX];     /* copy of config.slos       */
+	slostate*  slo_state;                /* windows, monitor only     */
+#ifndef THPOOL_NO_STATS
+	histogram  slo_merged;               /* monitor's scratch         */
+#endif
+#if LOCK_STATS_ON
+	lockstat locks[THPOOL_LOCKS];        /* THPOOL_LOCK_* counters    */
+#endif
+	bool thcount_lock_inzed, threads_all_idle_inzed, latency_lock_inzed;
+	histogram*    static_slo_hist;       /* static: slo_count per thr */
+	perfcounters* static_perf;           /* static: one per thread    */
+	mail*         static_letters;        /* static: broadcast mail    */
+	pthread_mutex_t static_letters_lock; /* one broadcast at a time   */
+	bool static_letters_lock_inzed;
 } thpool_;
 
 
+/* Offsets of the parts of a static pool, see thpool_static_layout() */
+typedef struct staticlayout{
+	size_t threads;                      /* thread table              */
+	size_t thread;                       /* first thread              */
+	size_t jobs;                         /* job slots                 */
+	size_t scratch;                      /* first scratch chunk       */
+	size_t slo_state;                    /* SLO windows               */
+	size_t slo_hist;                     /* SLO histograms of threads */
+	size_t perf;                         /* perf counters of threads  */
+	size_t letters;                      /* broadcast mail            */
+	size_t stacks;                       /* 0 without static stacks   */
+} staticlayout;
+
+
 
 
 
 /* ========================== PROTOTYPES ============================ */
 
+static int   thpool_start(thpool_* thpool_p, int num_threads);
+static uint64_t (*clock_source(int clock))(void);
+static size_t thpool_static_layout(const thpool_config* config_p, staticlayout* layout_p);
+static void  thpool_prepare(thpool_* thpool_p, const thpool_config* config_p);
+
 static int   thread_init(thpool_* thpool_p, struct thread** thread_p, int id, int preffed_cpu);
+static int   thread_spawn(struct thread* thread_p, int cpu);
 static void* thread_do(void* thread_p);
 static void  thread_hold(int sig_id);
 static void  thread_destroy(struct thread* thread_p);
+static void  thread_post_mail(struct thread* thread_p, mail* mail_p);
+static void  thread_read_mail(struct thread* thread_p);
+static void  trace_record(struct thread* thread_p, int type, void (*function_p)(void*),
+                          uint64_t start, uint64_t end, uint64_t enqueued);
+static void  registry_add(thpool_* thpool_p);
+static void  registry_remove(thpool_* thpool_p);
+#ifndef THPOOL_NO_STATS
+static void  slo_record(struct thread* thread_p, uintptr_t tag, uint64_t wait_ns);
+#endif
+static int   monitor_start(thpool_* thpool_p);
+static void  monitor_stop(thpool_* thpool_p);
+static void  perf_record(struct perfcounters* perf_p, struct job* job_p, uint64_t time_ns,
+                         const uint64_t* before, const uint64_t* after);
+#ifdef LINUX
+static struct perfcounters* perf_init(struct perfcounters* perf_p);
+static void  perf_close(struct perfcounters* perf_p);
+static void  perf_sample(struct perfcounters* perf_p, uint64_t* values);
+#endif
+#ifndef THPOOL_NO_STATS
+static void  profile_record(struct thread* thread_p, void (*function_p)(void*), uint64_t run_ns, uint64_t wait_ns);
+#endif
+
+static void  scratch_init(scratch* scratch_p, scratchchunk* fixed_p);
+static void  scratch_reset(scratch* scratch_p);
+static void  scratch_destroy(scratch* scratch_p);
 
 static int   jobqueue_init(jobqueue* jobqueue_p);
 static void  jobqueue_clear(jobqueue* jobqueue_p);
@@ -136,11 +494,25 @@ static void  jobqueue_push(jobqueue* jobqueue_p, struct job* newjob_p);
 static struct job* jobqueue_pull(jobqueue* jobqueue_p);
 static void  jobqueue_destroy(jobqueue* jobqueue_p);
 
+static int   jobslab_init(jobslab* jobslab_p);
+static void  jobslab_seed(jobslab* jobslab_p, job* jobs_p, int count);
+static job*  job_alloc(jobslab* jobslab_p);
+static void  job_free(jobslab* jobslab_p, job* job_p);
+static void  jobslab_destroy(jobslab* jobslab_p);
+
 static void  bsem_init(struct bsem *bsem_p, int value);
 static void  bsem_reset(struct bsem *bsem_p);
 static void  bsem_post(struct bsem *bsem_p);
 static void  bsem_post_all(struct bsem *bsem_p);
-static void  bsem_wait(struct bsem *bsem_p);
+static void  bsem_wake_all(struct bsem *bsem_p);
+static int   bsem_wait_or(struct bsem *bsem_p, volatile int* also_p);
+#if LOCK_STATS_ON
+static void  lock_acquire(pthread_mutex_t* mutex_p, struct lockstat* lockstat_p);
+static void  lock_release(pthread_mutex_t* mutex_p, struct lockstat* lockstat_p);
+static void  lock_cond_wait(pthread_cond_t* cond_p, pthread_mutex_t* mutex_p, struct lockstat* lockstat_p);
+static void  hist_record(struct thpool_histogram_* hist_p, uint64_t value);
+static void  hist_merge(struct thpool_histogram_* dst_p, const struct thpool_histogram_* src_p);
+#endif
 static void  bsem_destroy(struct bsem *bsem_p);
 
 static void  dec_bsem_init(struct bsem *bsem_p, int value);
@@ -166,6 +538,23 @@ int nprocs()
 #endif
 }
 
+/* k-th cpu the process is allowed to run on */
+static int nth_allowed_cpu(int k)
+{
+#ifdef LINUX
+  cpu_set_t cs;
+  CPU_ZERO(&cs);
+  sched_getaffinity(0, sizeof(cs), &cs);
+  int cpu;
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &cs) && k-- == 0) return cpu;
+  }
+  return -1;
+#else
+  return k;
+#endif
+}
+
 
 /* Initialise thread pool */
 struct thpool_* thpool_init(int num_threads){
@@ -173,6 +562,17 @@ struct thpool_* thpool_init(int num_threads){
 	//threads_on_hold   = 0;
 	//threads_keepalive = 1;
 
+	thpool_config config;
+	thpool_config_init(&config);
+	config.num_threads = num_threads;
+	return thpool_init_ex(&config);
+}
+
+
+/* Initialise thread pool from a configuration */
+struct thpool_* thpool_init_ex(const thpool_config* config_p){
+
+	int num_threads = config_p->num_threads;
 	if (num_threads < 0){
 		num_threads = 0;
 	}
@@ -184,11 +584,8 @@ struct thpool_* thpool_init(int num_threads){
 		err("thpool_init(): Could not allocate memory for thread pool\n");
 		return NULL;
 	}
-	thpool_p->num_threads_alive   = 0;
-	thpool_p->num_threads_working = 0;
-	thpool_p->threads_keepalive = 1;
-	thpool_p->thcount_lock_inzed = false;
-	thpool_p->threads_all_idle_inzed = false;
+	thpool_prepare(thpool_p, config_p);
+	thpool_p->is_static = false;
 
 	/* Initialise the job queue */
 	if (jobqueue_init(&thpool_p->jobqueue) == -1){
@@ -196,26 +593,265 @@ struct thpool_* thpool_init(int num_threads){
 		free(thpool_p);
 		return NULL;
 	}
+	if (jobslab_init(&thpool_p->jobslab) == -1){
+		err("thpool_init(): Could not initialize job slab\n");
+		jobqueue_destroy(&thpool_p->jobqueue);
+		free(thpool_p);
+		return NULL;
+	}
 
 	/* Make threads in pool */
 	thpool_p->threads = (struct thread**)malloc(num_threads * sizeof(struct thread *));
 	if (thpool_p->threads == NULL){
 		err("thpool_init(): Could not allocate memory for threads\n");
 		jobqueue_destroy(&thpool_p->jobqueue);
+		jobslab_destroy(&thpool_p->jobslab);
 		free(thpool_p);
 		return NULL;
 	}
 
+	if (thpool_start(thpool_p, num_threads) == -1){
+		thpool_destroy(thpool_p);
+		return NULL;
+	}
+	return thpool_p;
+}
+
+
+/* Fill a configuration with the defaults used by thpool_init() */
+void thpool_config_init(thpool_config* config_p){
+	memset(config_p, 0, sizeof(thpool_config));
+	config_p->num_threads    = nprocs();
+	config_p->job_capacity   = 1024;
+	config_p->static_flags   = 0;
+	config_p->name           = "thpool";
+	config_p->sched_policy   = THPOOL_SCHED_INHERIT;
+	config_p->affinity       = THPOOL_AFFINITY_ROUND_ROBIN;
+	config_p->scratch_chunk_size = 64 * 1024;
+	config_p->scratch_scope  = THPOOL_SCRATCH_JOB;
+	config_p->clock          = THPOOL_CLOCK_MONOTONIC;
+	config_p->trace_capacity = 4096;
+	config_p->perf_counters  = 0;
+	config_p->monitor_interval_ms = 100;
+	config_p->watchdog_ms    = 0;
+	config_p->slo_window_ticks = 10;
+}
+
+
+/* Reset counters and keep a private copy of the configuration */
+static void thpool_prepare(thpool_* thpool_p, const thpool_config* config_p){
+	thpool_p->num_threads_alive   = 0;
+	thpool_p->num_threads_working = 0;
+	thpool_p->threads_keepalive = 1;
+	thpool_p->thcount_lock_inzed = false;
+	thpool_p->threads_all_idle_inzed = false;
+
+	thpool_p->config = *config_p;
+	memset(thpool_p->name, 0, sizeof(thpool_p->name));
+	if (config_p->name){
+		strncpy(thpool_p->name, config_p->name, sizeof(thpool_p->name) - 1);
+	}
+	thpool_p->config.name = thpool_p->name;
+
+	thpool_p->jobqueue.now = clock_source(config_p->clock);
+	thpool_p->latency_base[0] = NULL;
+	thpool_p->latency_base[1] = NULL;
+	thpool_p->tracing = 0;
+	thpool_p->monitor_running    = false;
+	thpool_p->monitor_lock_inzed = false;
+	thpool_p->monitor_wake_inzed = false;
+	thpool_p->slo_state = NULL;
+	thpool_p->static_slo_hist = NULL;
+	thpool_p->static_perf     = NULL;
+	thpool_p->static_letters  = NULL;
+	thpool_p->static_letters_lock_inzed = false;
+	if (thpool_p->config.slo_count > THPOOL_SLO_MAX) thpool_p->config.slo_count = THPOOL_SLO_MAX;
+	if (thpool_p->config.slo_count < 0 || config_p->slos == NULL) thpool_p->config.slo_count = 0;
+	if (thpool_p->config.slo_count){
+		memcpy(thpool_p->slos, config_p->slos, thpool_p->config.slo_count * sizeof(thpool_slo));
+	}
+	thpool_p->config.slos = thpool_p->slos;
+#if LOCK_STATS_ON
+	memset(thpool_p->locks, 0, sizeof(thpool_p->locks));
+	int n;
+	for (n = 0; n < THPOOL_LOCKS; n++) thpool_p->locks[n].now = thpool_p->jobqueue.now;
+#endif
+	thpool_p->latency_lock_inzed = pthread_mutex_init(&thpool_p->latency_lock, NULL) == 0;
+}
+
+
+/* Layout of a static pool: pool, thread table, threads, job slots, one
+ * scratch chunk per thread, the tables SLOs and perf counters need, the
+ * letters of a broadcast too big for the stack and, with
+ * THPOOL_STATIC_STACKS, the stacks
+ *
+ * Every part starts on its own cache line, stacks on their own page.
+ */
+#define THPOOL_ALIGN_UP(x) (((x) + 63) & ~(size_t)63)
+#define THPOOL_STACK_ALIGN 4096
+#define BROADCAST_STACK_MAIL 32
+
+static size_t thpool_static_layout(const thpool_config* config_p, staticlayout* layout_p){
+	size_t num_threads  = config_p->num_threads  > 0 ? (size_t)config_p->num_threads  : 0;
+	size_t job_capacity = config_p->job_capacity > 0 ? (size_t)config_p->job_capacity : 0;
+	/* as clamped by thpool_prepare() */
+	size_t slo_count    = config_p->slos && config_p->slo_count > 0 ? (size_t)config_p->slo_count : 0;
+	if (slo_count > THPOOL_SLO_MAX) slo_count = THPOOL_SLO_MAX;
+
+	size_t size = THPOOL_ALIGN_UP(sizeof(struct thpool_));
+	layout_p->threads = size;
+	size += THPOOL_ALIGN_UP(num_threads * sizeof(struct thread*));
+	layout_p->thread = size;
+	size += num_threads * THPOOL_ALIGN_UP(sizeof(struct thread));
+	layout_p->jobs = size;
+	size += job_capacity * sizeof(struct job);
+	layout_p->scratch = size;
+	size += num_threads * (THPOOL_ALIGN_UP(sizeof(struct scratchchunk)) + THPOOL_ALIGN_UP(config_p->scratch_chunk_size));
+	layout_p->slo_state = size;
+	size += THPOOL_ALIGN_UP(slo_count * sizeof(struct slostate));
+	layout_p->slo_hist = size;
+#ifndef THPOOL_NO_STATS
+	size += THPOOL_ALIGN_UP(num_threads * slo_count * sizeof(histogram));
+#endif
+	layout_p->perf = size;
+#ifdef LINUX
+	if (config_p->perf_counters) size += THPOOL_ALIGN_UP(num_threads * sizeof(struct perfcounters));
+#endif
+	layout_p->letters = size;
+	if (num_threads > BROADCAST_STACK_MAIL) size += THPOOL_ALIGN_UP(num_threads * sizeof(struct mail));
+	layout_p->stacks = 0;
+	if ((config_p->static_flags & THPOOL_STATIC_STACKS) && config_p->stack_size){
+		size_t stack_size = (config_p->stack_size + THPOOL_STACK_ALIGN - 1) & ~(size_t)(THPOOL_STACK_ALIGN - 1);
+		size = (size + THPOOL_STACK_ALIGN - 1) & ~(size_t)(THPOOL_STACK_ALIGN - 1);
+		layout_p->stacks = size;
+		size += num_threads * stack_size;
+		size += THPOOL_STACK_ALIGN - 64; /* base is only 64B aligned */
+	}
+	return size + 63;                    /* room to align the buffer  */
+}
+
+
+/* Bytes thpool_init_static() needs for a configuration */
+size_t thpool_static_size(const thpool_config* config_p){
+	staticlayout layout;
+	return thpool_static_layout(config_p, &layout);
+}
+
+
+/* Initialise thread pool inside caller provided memory */
+struct thpool_* thpool_init_static(void* buf_p, size_t size, const thpool_config* config_p){
+	staticlayout layout;
+	size_t needed = thpool_static_layout(config_p, &layout);
+	if (buf_p == NULL || size < needed){
+		err("thpool_init_static(): Buffer is smaller than thpool_static_size()\n");
+		return NULL;
+	}
+
+#if defined(LINUX) && defined(MADV_HUGEPAGE)
+	if (config_p->static_flags & THPOOL_STATIC_HUGEPAGE){
+		long page = sysconf(_SC_PAGESIZE);
+		uintptr_t from = ((uintptr_t)buf_p + page - 1) & ~(uintptr_t)(page - 1);
+		uintptr_t to   = ((uintptr_t)buf_p + size) & ~(uintptr_t)(page - 1);
+		if (to > from) madvise((void*)from, to - from, MADV_HUGEPAGE);
+	}
+#endif
+	if (config_p->static_flags & THPOOL_STATIC_PREFAULT){
+		memset(buf_p, 0, size);
+	}
+
+	char* base = (char*)(((uintptr_t)buf_p + 63) & ~(uintptr_t)63);
+	int num_threads  = config_p->num_threads  > 0 ? config_p->num_threads  : 0;
+	int job_capacity = config_p->job_capacity > 0 ? config_p->job_capacity : 0;
+
+	thpool_* thpool_p = (struct thpool_*)base;
+	thpool_prepare(thpool_p, config_p);
+	thpool_p->is_static = true;
+	if (layout.stacks){
+		uintptr_t stacks = ((uintptr_t)base + layout.stacks + THPOOL_STACK_ALIGN - 1) & ~(uintptr_t)(THPOOL_STACK_ALIGN - 1);
+		thpool_p->config.stack_region = (void*)stacks;
+		thpool_p->config.stack_size = (config_p->stack_size + THPOOL_STACK_ALIGN - 1) & ~(size_t)(THPOOL_STACK_ALIGN - 1);
+	}
+
+	/* the tables a heap pool callocs, zeroed the same way */
+	memset(base + layout.slo_state, 0, layout.letters - layout.slo_state);
+	if (thpool_p->config.slo_count){
+		thpool_p->slo_state = (struct slostate*)(base + layout.slo_state);
+		thpool_p->static_slo_hist = (histogram*)(base + layout.slo_hist);
+	}
+#ifdef LINUX
+	if (config_p->perf_counters){
+		thpool_p->static_perf = (struct perfcounters*)(base + layout.perf);
+	}
+#endif
+	if (num_threads > BROADCAST_STACK_MAIL){
+		thpool_p->static_letters = (struct mail*)(base + layout.letters);
+		thpool_p->static_letters_lock_inzed = pthread_mutex_init(&thpool_p->static_letters_lock, NULL) == 0;
+	}
+
+	if (jobqueue_init(&thpool_p->jobqueue) == -1){
+		err("thpool_init_static(): Could not initialize job queue\n");
+		return NULL;
+	}
+	if (jobslab_init(&thpool_p->jobslab) == -1){
+		err("thpool_init_static(): Could not initialize job slab\n");
+		jobqueue_destroy(&thpool_p->jobqueue);
+		return NULL;
+	}
+	jobslab_seed(&thpool_p->jobslab, (struct job*)(base + layout.jobs), job_capacity);
+
+	thpool_p->threads = (struct thread**)(base + layout.threads);
+	size_t scratch_step = THPOOL_ALIGN_UP(sizeof(struct scratchchunk)) + THPOOL_ALIGN_UP(config_p->scratch_chunk_size);
+	int n;
+	for (n = 0; n < num_threads; n++){
+		thpool_p->threads[n] = (struct thread*)(base + layout.thread + n * THPOOL_ALIGN_UP(sizeof(struct thread)));
+		scratchchunk* chunk = NULL;
+		if (config_p->scratch_chunk_size){
+			chunk = (struct scratchchunk*)(base + layout.scratch + n * scratch_step);
+			chunk->size  = config_p->scratch_chunk_size;
+			chunk->fixed = true;
+		}
+		scratch_init(&thpool_p->threads[n]->scratch, chunk);
+	}
+
+	if (thpool_start(thpool_p, num_threads) == -1){
+		thpool_destroy(thpool_p);
+		return NULL;
+	}
+	return thpool_p;
+}
+
+
+/* Create the workers and wait until they are all alive
+ *
+ * On failure the workers created so far are left running so that
+ * thpool_destroy() can take the pool down.
+ */
+static int thpool_start(thpool_* thpool_p, int num_threads){
 	thpool_p->thcount_lock_inzed = pthread_mutex_init(&(thpool_p->thcount_lock), NULL) == 0;
 	thpool_p->threads_all_idle_inzed = pthread_cond_init(&thpool_p->threads_all_idle, NULL) == 0;
+#if LOCK_STATS_ON
+	thpool_p->jobqueue.lockstat = &thpool_p->locks[THPOOL_LOCK_QUEUE];
+	thpool_p->jobqueue.has_jobs->lockstat = &thpool_p->locks[THPOOL_LOCK_HAS_JOBS];
+#endif
 
 
+	const thpool_config* config_p = &thpool_p->config;
     int n_of_threads = nprocs();
 	/* Thread init */
 	int n;
 	int k = 0;
+	int created = 0;
 	for (n=0; n<num_threads; n++){
-		thread_init(thpool_p, &thpool_p->threads[n], n, k);
+		int cpu = -1;
+		if (config_p->affinity == THPOOL_AFFINITY_ROUND_ROBIN){
+			cpu = nth_allowed_cpu(k);
+		} else if (config_p->affinity == THPOOL_AFFINITY_LIST && config_p->cpu_count > 0){
+			cpu = config_p->cpus[n % config_p->cpu_count];
+		}
+		if (thread_init(thpool_p, &thpool_p->threads[n], n, cpu) == -1){
+			break;
+		}
+		created++;
 		k++;
 		if (k >= n_of_threads) k = 0;
 #if THPOOL_DEBUG
@@ -224,9 +860,11 @@ struct thpool_* thpool_init(int num_threads){
 	}
 
 	/* Wait for threads to initialize */
-	while (thpool_p->num_threads_alive != num_threads) {}
+	while (thpool_p->num_threads_alive != created) {}
 
-	return thpool_p;
+	if (created != num_threads) return -1;
+	registry_add(thpool_p);
+	return monitor_start(thpool_p);
 }
 
 
@@ -234,7 +872,7 @@ struct thpool_* thpool_init(int num_threads){
 int thpool_add_work(thpool_* thpool_p, void (*function_p)(void*), void* arg_p){
 	job* newjob;
 
-	newjob=(struct job*)malloc(sizeof(struct job));
+	newjob=job_alloc(&thpool_p->jobslab);
 	if (newjob==NULL){
 		err("thpool_add_work(): Could not allocate memory for new job\n");
 		return -1;
@@ -251,19 +889,76 @@ int thpool_add_work(thpool_* thpool_p, void (*function_p)(void*), void* arg_p){
 	return 0;
 }
 
-/* Add work to the thread pool */
-int thpool_add_work_with_sem(thpool_* thpool_p, bsem* signal_p, void (*function_p)(void*), void* arg_p){
+/* Add work of a job class to the thread pool */
+int thpool_add_work_tagged(thpool_* thpool_p, uintptr_t tag, void (*function_p)(void*), void* arg_p){
 	job* newjob;
 
-	newjob=(struct job*)malloc(sizeof(struct job));
+	newjob=job_alloc(&thpool_p->jobslab);
 	if (newjob==NULL){
-		err("thpool_add_work_and_wait(): Could not allocate memory for new job\n");
+		err("thpool_add_work_tagged(): Could not allocate memory for new job\n");
+		return -1;
+	}
+
+	newjob->function=function_p;
+	newjob->arg=arg_p;
+	newjob->tag=tag;
+
+	/* add job to queue */
+	jobqueue_push(&thpool_p->jobqueue, newjob);
+
+	return 0;
+}
+
+/* Add work with a private copy of its argument to the thread pool */
+int thpool_add_work_copy(thpool_* thpool_p, void (*function_p)(void*), const void* data_p, size_t len){
+	job* newjob;
+
+	newjob=job_alloc(&thpool_p->jobslab);
+	if (newjob==NULL){
+		err("thpool_add_work_copy(): Could not allocate memory for new job\n");
+		return -1;
+	}
+
+	/* small arguments live in the job slot, bigger ones on the heap */
+	if (len <= THPOOL_JOB_INLINE_SIZE){
+		newjob->arg = newjob->payload;
+	} else if (!thpool_p->is_static){
+		newjob->owned = malloc(len);
+		if (newjob->owned == NULL){
+			err("thpool_add_work_copy(): Could not allocate memory for job argument\n");
+			job_free(&thpool_p->jobslab, newjob);
+			return -1;
+		}
+		newjob->arg = newjob->owned;
+	} else {
+		err("thpool_add_work_copy(): Argument too big for a static pool\n");
+		job_free(&thpool_p->jobslab, newjob);
 		return -1;
 	}
+	if (len) memcpy(newjob->arg, data_p, len);
+
+	newjob->function=function_p;
+	newjob->signal_ = NULL;
+
+	/* add job to queue */
+	jobqueue_push(&thpool_p->jobqueue, newjob);
+
+	return 0;
+}
+
+/* Add work to the thread pool */
+int thpool_add_work_with_sem(thpool_* thpool_p, bsem* signal_p, void (*function_p)(void*), void* arg_p){
+	job* newjob;
+
 	if (signal_p == NULL) {
 		err("thpool_add_work_and_wait(): signal_p is NULL\n");
 		return -2;
 	}
+	newjob=job_alloc(&thpool_p->jobslab);
+	if (newjob==NULL){
+		err("thpool_add_work_and_wait(): Could not allocate memory for new job\n");
+		return -1;
+	}
 
 	/* add function and argument */
 	newjob->function=function_p;
@@ -279,17 +974,89 @@ int thpool_add_work_with_sem(thpool_* thpool_p, bsem* signal_p, void (*function_
 
 /* Wait until all jobs have finished */
 void thpool_wait(thpool_* thpool_p){
-	pthread_mutex_lock(&thpool_p->thcount_lock);
+	LOCK(&thpool_p->thcount_lock, &thpool_p->locks[THPOOL_LOCK_COUNT]);
 	while (thpool_p->jobqueue.len || thpool_p->num_threads_working) {
-		pthread_cond_wait(&thpool_p->threads_all_idle, &thpool_p->thcount_lock);
+		COND_WAIT(&thpool_p->threads_all_idle, &thpool_p->thcount_lock, &thpool_p->locks[THPOOL_LOCK_COUNT]);
 		DO_SLEEP0ms;
 	}
-	pthread_mutex_unlock(&thpool_p->thcount_lock);
+	UNLOCK(&thpool_p->thcount_lock, &thpool_p->locks[THPOOL_LOCK_COUNT]);
+}
+
+/* Run a function once on every worker */
+int thpool_broadcast(thpool_* thpool_p, void (*function_p)(void*), void* arg_p){
+	int num_threads = thpool_p->num_threads_alive;
+	if (num_threads == 0) return 0;
+
+	thread* self = thread_self;
+	bool own_worker = self && self->thpool_p == thpool_p;
+
+	/* letters live on the stack unless the pool is big; a big static pool
+	 * has one set in its buffer, taken in turns */
+	mail  stack_mail[BROADCAST_STACK_MAIL];
+	mail* letters = stack_mail;
+	if (num_threads > BROADCAST_STACK_MAIL && thpool_p->static_letters){
+		if (own_worker){
+			/* the broadcast holding them may be waiting for this worker */
+			while (pthread_mutex_trylock(&thpool_p->static_letters_lock) != 0){
+				thread_read_mail(self);
+				DO_SLEEP0ms;
+			}
+		} else {
+			pthread_mutex_lock(&thpool_p->static_letters_lock);
+		}
+		letters = thpool_p->static_letters;
+	} else if (num_threads > BROADCAST_STACK_MAIL){
+		letters = (struct mail*)malloc(num_threads * sizeof(struct mail));
+		if (letters == NULL){
+			err("thpool_broadcast(): Could not allocate memory for mail\n");
+			return -1;
+		}
+	}
+
+	bsem done;
+	dec_bsem_init(&done, num_threads);
+	int n;
+	for (n = 0; n < num_threads; n++){
+		letters[n].function = function_p;
+		letters[n].arg      = arg_p;
+		letters[n].done     = &done;
+		thread_post_mail(thpool_p->threads[n], &letters[n]);
+	}
+	/* wake the idle workers, busy ones read their mail after their job;
+	 * has_jobs stays as it is, the sleepers wake for their mailbox */
+	bsem_wake_all(thpool_p->jobqueue.has_jobs);
+
+	if (own_worker){
+		/* a worker broadcasting has to deliver its own letter meanwhile */
+		pthread_mutex_lock(&done.mutex);
+		while (done.v){
+			pthread_mutex_unlock(&done.mutex);
+			thread_read_mail(self);
+			pthread_mutex_lock(&done.mutex);
+			if (done.v){
+				struct timespec until;
+				clock_gettime(CLOCK_REALTIME, &until);
+				until.tv_nsec += 1000000L;
+				if (until.tv_nsec >= 1000000000L){ until.tv_sec++; until.tv_nsec -= 1000000000L; }
+				pthread_cond_timedwait(&done.cond, &done.mutex, &until);
+			}
+		}
+		pthread_mutex_unlock(&done.mutex);
+	} else {
+		dec_bsem_wait(&done);
+	}
+	bsem_destroy(&done);
+
+	if (letters == thpool_p->static_letters) pthread_mutex_unlock(&thpool_p->static_letters_lock);
+	else if (letters != stack_mail) free(letters);
+	return 0;
 }
 
+
 void thpool_wait_cond(bsem** el) {
 	dec_bsem_wait(*el);
     bsem_destroy(*el);
+    free(*el);
 }
 
 void thpool_decsem_init(bsem** el, int value) {
@@ -305,6 +1072,12 @@ void thpool_destroy(thpool_* thpool_p){
 
 	volatile int threads_total = thpool_p->num_threads_alive;
 
+	/* Scrapes and dumps read the pool, it leaves the registry first */
+	registry_remove(thpool_p);
+
+	/* The monitor reads the workers, it goes first */
+	monitor_stop(thpool_p);
+
 	/* End each thread 's infinite loop */
 	thpool_p->threads_keepalive = 0;
 
@@ -319,38 +1092,2059 @@ void thpool_destroy(thpool_* thpool_p){
 		tpassed = difftime(end,start);
 	}
 
-	/* Poll remaining threads */
-	while (thpool_p->num_threads_alive){
-		bsem_post_all(thpool_p->jobqueue.has_jobs);
-		DO_SLEEP1ms;
+	/* Poll remaining threads */
+	while (thpool_p->num_threads_alive){
+		bsem_post_all(thpool_p->jobqueue.has_jobs);
+		DO_SLEEP1ms;
+	}
+
+	/* Job queue cleanup */
+	jobqueue_destroy(&thpool_p->jobqueue);
+	jobslab_destroy(&thpool_p->jobslab);
+	/* Deallocs */
+	if (thpool_p->thcount_lock_inzed) pthread_mutex_destroy(&(thpool_p->thcount_lock));
+    if (thpool_p->threads_all_idle_inzed) pthread_cond_destroy(&(thpool_p->threads_all_idle));
+	int n;
+	for (n=0; n < threads_total; n++){
+		thread_destroy(thpool_p->threads[n]);
+	}
+	free(thpool_p->latency_base[0]);
+	free(thpool_p->latency_base[1]);
+	if (thpool_p->latency_lock_inzed) pthread_mutex_destroy(&thpool_p->latency_lock);
+	if (thpool_p->static_letters_lock_inzed) pthread_mutex_destroy(&thpool_p->static_letters_lock);
+	/* A static pool's memory belongs to the caller */
+	if (thpool_p->is_static) return;
+	free(thpool_p->threads);
+	free(thpool_p);
+}
+
+
+/* Pause all threads in threadpool */
+void thpool_pause(thpool_* thpool_p) {
+}
+
+
+/* Resume all threads in threadpool */
+void thpool_resume(thpool_* thpool_p) {
+}
+
+
+int thpool_num_threads_working(thpool_* thpool_p){
+	return thpool_p->num_threads_working;
+}
+
+
+int thpool_num_threads(thpool_* thpool_p){
+	return thpool_p->num_threads_alive;
+}
+
+
+/* ============================ CLOCKS ============================== */
+
+
+/* Monotonic clock in nanoseconds */
+static uint64_t clock_monotonic(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+
+#ifdef CLOCK_MONOTONIC_COARSE
+/* Monotonic clock at tick resolution, no more than a memory read */
+static uint64_t clock_coarse(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+
+#if defined(LINUX) && defined(__x86_64__)
+/* TSC scaled to nanoseconds, ns = tsc * tsc_mult >> 32 */
+static uint64_t tsc_mult = 0;
+static pthread_once_t tsc_once = PTHREAD_ONCE_INIT;
+
+static uint64_t clock_tsc(void){
+	return (uint64_t)(((unsigned __int128)__builtin_ia32_rdtsc() * tsc_mult) >> 32);
+}
+
+
+/* Measure the TSC against CLOCK_MONOTONIC for 10ms, if it is invariant */
+static void tsc_calibrate(void){
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1u << 8))){
+		return;
+	}
+	uint64_t t0 = clock_monotonic();
+	uint64_t c0 = __builtin_ia32_rdtsc();
+	uint64_t t1;
+	do {
+		t1 = clock_monotonic();
+	} while (t1 - t0 < 10000000ull);
+	uint64_t c1 = __builtin_ia32_rdtsc();
+	if (c1 > c0){
+		tsc_mult = (uint64_t)(((unsigned __int128)(t1 - t0) << 32) / (c1 - c0));
+	}
+}
+#endif
+
+
+/* Clock function for thpool_config.clock */
+static uint64_t (*clock_source(int clock))(void){
+#ifdef CLOCK_MONOTONIC_COARSE
+	if (clock == THPOOL_CLOCK_COARSE) return clock_coarse;
+#endif
+#if defined(LINUX) && defined(__x86_64__)
+	if (clock == THPOOL_CLOCK_TSC){
+		pthread_once(&tsc_once, tsc_calibrate);
+		if (tsc_mult) return clock_tsc;
+	}
+#endif
+	return clock_monotonic;
+}
+
+
+#ifndef THPOOL_NO_STATS
+/* Add one worker's counters to a snapshot */
+static void stats_accumulate(thpool_stats* stats_p, const thread* thread_p){
+	const workerstats* ws = &thread_p->stats;
+	stats_p->jobs        += __atomic_load_n(&ws->jobs,        __ATOMIC_RELAXED);
+	stats_p->busy_ns     += __atomic_load_n(&ws->busy_ns,     __ATOMIC_RELAXED);
+	stats_p->idle_ns     += __atomic_load_n(&ws->idle_ns,     __ATOMIC_RELAXED);
+	stats_p->parks       += __atomic_load_n(&ws->parks,       __ATOMIC_RELAXED);
+	stats_p->wakes       += __atomic_load_n(&ws->wakes,       __ATOMIC_RELAXED);
+	stats_p->empty_pulls += __atomic_load_n(&ws->empty_pulls, __ATOMIC_RELAXED);
+	stats_p->broadcasts  += __atomic_load_n(&ws->broadcasts,  __ATOMIC_RELAXED);
+}
+#endif
+
+
+/* Sum of all workers' counters, taken without any lock */
+int thpool_stats_snapshot(thpool_* thpool_p, thpool_stats* stats_p){
+	memset(stats_p, 0, sizeof(thpool_stats));
+	stats_p->num_threads         = thpool_p->num_threads_alive;
+	stats_p->num_threads_working = thpool_p->num_threads_working;
+	stats_p->queue_len           = thpool_p->jobqueue.len;
+#ifdef THPOOL_NO_STATS
+	return -1;
+#else
+	int n;
+	for (n = 0; n < stats_p->num_threads; n++){
+		stats_accumulate(stats_p, thpool_p->threads[n]);
+	}
+#if LOCK_STATS_ON
+	for (n = 0; n < THPOOL_LOCKS; n++){
+		const lockstat* ls = &thpool_p->locks[n];
+		thpool_lock_stats* out_p = &stats_p->locks[n];
+		out_p->acquisitions = __atomic_load_n(&ls->acquisitions, __ATOMIC_RELAXED);
+		out_p->contended    = __atomic_load_n(&ls->contended,    __ATOMIC_RELAXED);
+		out_p->wait_ns      = __atomic_load_n(&ls->wait_ns,      __ATOMIC_RELAXED);
+		out_p->max_wait_ns  = __atomic_load_n(&ls->max_wait_ns,  __ATOMIC_RELAXED);
+		out_p->hold_ns      = __atomic_load_n(&ls->hold_ns,      __ATOMIC_RELAXED);
+		out_p->max_hold_ns  = __atomic_load_n(&ls->max_hold_ns,  __ATOMIC_RELAXED);
+	}
+#endif
+	return 0;
+#endif
+}
+
+
+/* Histogram of the contended waits for one of the pool's locks */
+histogram* thpool_lock_wait_snapshot(thpool_* thpool_p, int lock){
+#if LOCK_STATS_ON
+	if (lock < 0 || lock >= THPOOL_LOCKS){
+		err("thpool_lock_wait_snapshot(): Unknown lock\n");
+		return NULL;
+	}
+	histogram* hist_p = (histogram*)calloc(1, sizeof(histogram));
+	if (hist_p == NULL){
+		err("thpool_lock_wait_snapshot(): Could not allocate memory for histogram\n");
+		return NULL;
+	}
+	hist_merge(hist_p, &thpool_p->locks[lock].waits);
+	return hist_p;
+#else
+	(void)thpool_p; (void)lock;
+	return NULL;
+#endif
+}
+
+
+/* ========================== HISTOGRAMS ============================ */
+
+
+#ifndef THPOOL_NO_STATS
+/* Bucket of a value */
+static int hist_index(uint64_t value){
+	if (value < HIST_SUB) return (int)value;
+	int exp = 63 - __builtin_clzll(value);
+	if (exp > HIST_MAX_EXP) return HIST_BUCKETS - 1;
+	int sub = (int)(value >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1);
+	return HIST_SUB + (exp - HIST_SUB_BITS) * HIST_SUB + sub;
+}
+#endif
+
+
+/* Largest value that falls into bucket index */
+static uint64_t hist_upper(int index){
+	if (index < HIST_SUB) return (uint64_t)index;
+	int exp = (index - HIST_SUB) / HIST_SUB + HIST_SUB_BITS;
+	uint64_t sub = (uint64_t)((index - HIST_SUB) % HIST_SUB);
+	return ((HIST_SUB + sub + 1) << (exp - HIST_SUB_BITS)) - 1;
+}
+
+
+#ifndef THPOOL_NO_STATS
+/* Record one sample, called by the owning worker only */
+static void hist_record(histogram* hist_p, uint64_t value){
+	uint64_t* bucket_p = &hist_p->buckets[hist_index(value)];
+	__atomic_store_n(bucket_p, *bucket_p + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist_p->sum, hist_p->sum + value, __ATOMIC_RELAXED);
+	__atomic_store_n(&hist_p->count, hist_p->count + 1, __ATOMIC_RELAXED);
+}
+
+
+/* Add a worker's histogram, read with relaxed loads, to dst_p */
+static void hist_merge(histogram* dst_p, const histogram* src_p){
+	int n;
+	for (n = 0; n < HIST_BUCKETS; n++){
+		dst_p->buckets[n] += __atomic_load_n(&src_p->buckets[n], __ATOMIC_RELAXED);
+	}
+	dst_p->sum   += __atomic_load_n(&src_p->sum,   __ATOMIC_RELAXED);
+	dst_p->count += __atomic_load_n(&src_p->count, __ATOMIC_RELAXED);
+}
+#endif
+
+
+/* Merged histogram of all workers, minus the window start if any */
+histogram* thpool_latency_snapshot(thpool_* thpool_p, int kind, int reset){
+#ifdef THPOOL_NO_STATS
+	(void)thpool_p; (void)kind; (void)reset;
+	return NULL;
+#else
+	if (kind != THPOOL_LATENCY_QUEUE && kind != THPOOL_LATENCY_EXEC){
+		err("thpool_latency_snapshot(): Unknown latency kind\n");
+		return NULL;
+	}
+	histogram* hist_p = (histogram*)calloc(1, sizeof(histogram));
+	if (hist_p == NULL){
+		err("thpool_latency_snapshot(): Could not allocate memory for histogram\n");
+		return NULL;
+	}
+	int n;
+	for (n = 0; n < thpool_p->num_threads_alive; n++){
+		thread* thread_p = thpool_p->threads[n];
+		hist_merge(hist_p, kind == THPOOL_LATENCY_QUEUE ? &thread_p->queue_hist : &thread_p->exec_hist);
+	}
+
+	pthread_mutex_lock(&thpool_p->latency_lock);
+	histogram* base_p = thpool_p->latency_base[kind];
+	histogram* total_p = NULL;
+	if (reset){
+		total_p = (histogram*)malloc(sizeof(histogram));
+		if (total_p) memcpy(total_p, hist_p, sizeof(histogram));
+	}
+	if (base_p){
+		/* counts only grow, but workers' fields are read at different times */
+		for (n = 0; n < HIST_BUCKETS; n++){
+			hist_p->buckets[n] = hist_p->buckets[n] > base_p->buckets[n] ?
+			                     hist_p->buckets[n] - base_p->buckets[n] : 0;
+		}
+		hist_p->sum   = hist_p->sum   > base_p->sum   ? hist_p->sum   - base_p->sum   : 0;
+		hist_p->count = hist_p->count > base_p->count ? hist_p->count - base_p->count : 0;
+	}
+	if (total_p){
+		free(base_p);
+		thpool_p->latency_base[kind] = total_p;
+	}
+	pthread_mutex_unlock(&thpool_p->latency_lock);
+	return hist_p;
+#endif
+}
+
+
+uint64_t thpool_histogram_percentile(histogram* hist_p, double percentile){
+	if (hist_p == NULL) return 0;
+	uint64_t total = 0;
+	int n;
+	for (n = 0; n < HIST_BUCKETS; n++) total += hist_p->buckets[n];
+	if (total == 0) return 0;
+
+	if (percentile < 0.0)   percentile = 0.0;
+	if (percentile > 100.0) percentile = 100.0;
+	uint64_t rank = (uint64_t)(percentile / 100.0 * (double)total + 0.5);
+	if (rank < 1) rank = 1;
+
+	uint64_t seen = 0;
+	for (n = 0; n < HIST_BUCKETS; n++){
+		seen += hist_p->buckets[n];
+		if (seen >= rank) return hist_upper(n);
+	}
+	return hist_upper(HIST_BUCKETS - 1);
+}
+
+
+uint64_t thpool_histogram_count(histogram* hist_p){
+	return hist_p ? hist_p->count : 0;
+}
+
+
+double thpool_histogram_mean(histogram* hist_p){
+	return hist_p && hist_p->count ? (double)hist_p->sum / (double)hist_p->count : 0.0;
+}
+
+
+void thpool_histogram_free(histogram* hist_p){
+	free(hist_p);
+}
+
+
+/* Counters of one worker */
+int thpool_worker_stats_snapshot(thpool_* thpool_p, int worker_id, thpool_stats* stats_p){
+	memset(stats_p, 0, sizeof(thpool_stats));
+	if (worker_id < 0 || worker_id >= thpool_p->num_threads_alive) return -1;
+	stats_p->num_threads         = 1;
+	stats_p->queue_len           = thpool_p->jobqueue.len;
+#ifdef THPOOL_NO_STATS
+	return -1;
+#else
+	stats_accumulate(stats_p, thpool_p->threads[worker_id]);
+	return 0;
+#endif
+}
+
+
+/* ============================ REGISTRY ============================ */
+
+
+#define REGISTRY_POOLS 64                /* live pools that are listed */
+
+/* Live pools of the process
+ *
+ * Slots are set and cleared under registry_lock, which the exporter also
+ * holds while it reads the pools, so a pool is not freed under a scrape.
+ * Signal handlers cannot lock and read the slots with atomic loads only.
+ */
+static thpool_* registry[REGISTRY_POOLS];
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* List a pool whose workers are all up, pools beyond the table are not */
+static void registry_add(thpool_* thpool_p){
+	pthread_mutex_lock(&registry_lock);
+	int n;
+	for (n = 0; n < REGISTRY_POOLS; n++){
+		if (registry[n] == NULL){
+			__atomic_store_n(&registry[n], thpool_p, __ATOMIC_RELEASE);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&registry_lock);
+}
+
+
+static void registry_remove(thpool_* thpool_p){
+	pthread_mutex_lock(&registry_lock);
+	int n;
+	for (n = 0; n < REGISTRY_POOLS; n++){
+		if (registry[n] == thpool_p) __atomic_store_n(&registry[n], (thpool_*)NULL, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&registry_lock);
+}
+
+
+/* Live pools, the count may exceed max_entries */
+int thpool_registry_list(thpool_registry_entry* entries, int max_entries){
+	pthread_mutex_lock(&registry_lock);
+	int n, count = 0;
+	for (n = 0; n < REGISTRY_POOLS; n++){
+		thpool_* thpool_p = registry[n];
+		if (thpool_p == NULL) continue;
+		if (count < max_entries){
+			entries[count].pool   = thpool_p;
+			entries[count].name   = thpool_p->name;
+			entries[count].config = &thpool_p->config;
+		}
+		count++;
+	}
+	pthread_mutex_unlock(&registry_lock);
+	return count;
+}
+
+
+/* ============================= TRACE ============================== */
+
+
+static char trace_signal_path[256];
+
+
+/* Claim a ring slot and fill it, called by the owning worker only
+ *
+ * The head is published after the event, so a reader only trusts events
+ * that are more than a ring behind the head it saw after reading them.
+ */
+static void trace_record(thread* thread_p, int type, void (*function_p)(void*),
+                         uint64_t start, uint64_t end, uint64_t enqueued){
+	tracering* ring_p = thread_p->trace;
+	uint64_t head = ring_p->head;
+	traceevent* ev_p = &ring_p->events[head & ring_p->mask];
+	ev_p->start    = start;
+	ev_p->end      = end;
+	ev_p->enqueued = enqueued;
+	ev_p->function = function_p;
+	ev_p->type     = (uint32_t)type;
+	__atomic_store_n(&ring_p->head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+/* Turn the flight recorder on or off, rings are allocated on first use */
+int thpool_trace_enable(thpool_* thpool_p, int on){
+	if (!on){
+		__atomic_store_n(&thpool_p->tracing, 0, __ATOMIC_RELAXED);
+		return 0;
+	}
+	if (thpool_p->is_static){
+		err("thpool_trace_enable(): Static pools have no room for trace rings\n");
+		return -1;
+	}
+
+	LOCK(&thpool_p->thcount_lock, &thpool_p->locks[THPOOL_LOCK_COUNT]);
+	uint32_t capacity = 64;
+	while (capacity < (uint32_t)thpool_p->config.trace_capacity && capacity < (1u << 24)) capacity <<= 1;
+	int n;
+	for (n = 0; n < thpool_p->num_threads_alive; n++){
+		thread* thread_p = thpool_p->threads[n];
+		if (thread_p->trace) continue;
+		tracering* ring_p = (tracering*)calloc(1, sizeof(tracering) + capacity * sizeof(traceevent));
+		if (ring_p == NULL){
+			UNLOCK(&thpool_p->thcount_lock, &thpool_p->locks[THPOOL_LOCK_COUNT]);
+			err("thpool_trace_enable(): Could not allocate memory for trace ring\n");
+			return -1;
+		}
+		ring_p->mask = capacity - 1;
+		__atomic_store_n(&thread_p->trace, ring_p, __ATOMIC_RELEASE);
+	}
+	UNLOCK(&thpool_p->thcount_lock, &thpool_p->locks[THPOOL_LOCK_COUNT]);
+
+	__atomic_store_n(&thpool_p->tracing, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+
+#ifdef LINUX
+/* Output buffer of the trace writer
+ *
+ * Formats without stdio or malloc so the writer can run in a signal
+ * handler; only write(2) touches the file. The buffer is the caller's
+ * and is written out whenever it is full.
+ */
+typedef struct tracewriter{
+	int    fd;
+	size_t len;
+	size_t size;                         /* capacity of buf           */
+	bool   in_signal;                    /* no demangling (malloc)    */
+	bool   is_socket;                    /* send(), no SIGPIPE        */
+	char*  buf;
+} tracewriter;
+
+
+static void tw_init(tracewriter* tw_p, int fd, char* buf, size_t size, bool in_signal){
+	tw_p->fd        = fd;
+	tw_p->len       = 0;
+	tw_p->size      = size;
+	tw_p->in_signal = in_signal;
+	tw_p->is_socket = false;
+	tw_p->buf       = buf;
+}
+
+
+static void tw_flush(tracewriter* tw_p){
+	size_t done = 0;
+	while (done < tw_p->len){
+		ssize_t n = tw_p->is_socket ? send(tw_p->fd, tw_p->buf + done, tw_p->len - done, MSG_NOSIGNAL)
+		                            : write(tw_p->fd, tw_p->buf + done, tw_p->len - done);
+		if (n <= 0 && errno != EINTR) break;
+		if (n > 0) done += (size_t)n;
+	}
+	tw_p->len = 0;
+}
+
+
+static void tw_char(tracewriter* tw_p, char c){
+	if (tw_p->len == tw_p->size) tw_flush(tw_p);
+	tw_p->buf[tw_p->len++] = c;
+}
+
+
+static void tw_str(tracewriter* tw_p, const char* str){
+	while (*str) tw_char(tw_p, *str++);
+}
+
+
+/* String as JSON, escaped */
+static void tw_json(tracewriter* tw_p, const char* str){
+	tw_char(tw_p, '"');
+	for (; *str; str++){
+		unsigned char c = (unsigned char)*str;
+		if (c == '"' || c == '\\'){
+			tw_char(tw_p, '\\');
+			tw_char(tw_p, (char)c);
+		} else if (c >= 0x20){
+			tw_char(tw_p, (char)c);
+		}
+	}
+	tw_char(tw_p, '"');
+}
+
+
+static void tw_u64(tracewriter* tw_p, uint64_t value){
+	char digits[24];
+	int n = 0;
+	do {
+		digits[n++] = (char)('0' + value % 10);
+		value /= 10;
+	} while (value);
+	while (n) tw_char(tw_p, digits[--n]);
+}
+
+
+/* Nanoseconds as microseconds with three decimals, the trace_event unit */
+static void tw_us(tracewriter* tw_p, uint64_t ns){
+	tw_u64(tw_p, ns / 1000);
+	tw_char(tw_p, '.');
+	tw_char(tw_p, (char)('0' + ns / 100 % 10));
+	tw_char(tw_p, (char)('0' + ns / 10 % 10));
+	tw_char(tw_p, (char)('0' + ns % 10));
+}
+
+
+static void tw_hex(tracewriter* tw_p, uintptr_t value){
+	static const char hex[] = "0123456789abcdef";
+	char digits[2 * sizeof(uintptr_t)];
+	int n = 0;
+	do {
+		digits[n++] = hex[value & 15];
+		value >>= 4;
+	} while (value);
+	tw_str(tw_p, "0x");
+	while (n) tw_char(tw_p, digits[--n]);
+}
+
+
+/* Name of a job function: symbol, demangled outside of signal handlers */
+static void tw_symbol(tracewriter* tw_p, void (*function_p)(void*)){
+	Dl_info info;
+	/* dladdr() takes the loader lock, a handler only gets the address */
+	if (!tw_p->in_signal && dladdr((void*)function_p, &info) && info.dli_sname){
+		int status = 0;
+		char* name = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+		if (name){
+			tw_json(tw_p, name);
+			free(name);
+			return;
+		}
+		tw_json(tw_p, info.dli_sname);
+		return;
+	}
+	tw_char(tw_p, '"');
+	tw_hex(tw_p, (uintptr_t)function_p);
+	tw_char(tw_p, '"');
+}
+
+
+/* One event as a trace_event object */
+static void tw_event(tracewriter* tw_p, const traceevent* ev_p, int pid, int tid){
+	tw_str(tw_p, ",\n{\"ph\":\"X\",\"pid\":");
+	tw_u64(tw_p, (uint64_t)pid);
+	tw_str(tw_p, ",\"tid\":");
+	tw_u64(tw_p, (uint64_t)tid);
+	tw_str(tw_p, ",\"ts\":");
+	tw_us(tw_p, ev_p->start);
+	tw_str(tw_p, ",\"dur\":");
+	tw_us(tw_p, ev_p->end > ev_p->start ? ev_p->end - ev_p->start : 0);
+	switch (ev_p->type){
+		case TRACE_PARK:
+			tw_str(tw_p, ",\"name\":\"park\",\"cat\":\"idle\"}");
+			return;
+		case TRACE_MAIL:
+			tw_str(tw_p, ",\"cat\":\"broadcast\",\"name\":");
+			tw_symbol(tw_p, ev_p->function);
+			tw_char(tw_p, '}');
+			return;
+		default:
+			tw_str(tw_p, ",\"cat\":\"job\",\"name\":");
+			tw_symbol(tw_p, ev_p->function);
+			if (ev_p->enqueued && ev_p->enqueued <= ev_p->start){
+				tw_str(tw_p, ",\"args\":{\"enqueued_us\":");
+				tw_us(tw_p, ev_p->enqueued);
+				tw_str(tw_p, ",\"wait_us\":");
+				tw_us(tw_p, ev_p->start - ev_p->enqueued);
+				tw_char(tw_p, '}');
+			}
+			tw_char(tw_p, '}');
+	}
+}
+
+
+/* Metadata naming a pool (process) or a worker (thread) */
+static void tw_name(tracewriter* tw_p, const char* kind, int pid, int tid, const char* name, int id){
+	tw_str(tw_p, ",\n{\"ph\":\"M\",\"name\":\"");
+	tw_str(tw_p, kind);
+	tw_str(tw_p, "\",\"pid\":");
+	tw_u64(tw_p, (uint64_t)pid);
+	tw_str(tw_p, ",\"tid\":");
+	tw_u64(tw_p, (uint64_t)tid);
+	tw_str(tw_p, ",\"args\":{\"name\":\"");
+	tw_str(tw_p, name);
+	if (id >= 0){
+		tw_char(tw_p, '-');
+		tw_u64(tw_p, (uint64_t)id);
+	}
+	tw_str(tw_p, "\"}}");
+}
+
+
+/* Events of a worker that are still in its ring */
+static void tw_ring(tracewriter* tw_p, const tracering* ring_p, int pid, int tid){
+	uint64_t head = __atomic_load_n(&ring_p->head, __ATOMIC_ACQUIRE);
+	uint64_t size = (uint64_t)ring_p->mask + 1;
+	uint64_t seq  = head > size ? head - size : 0;
+	for (; seq < head; seq++){
+		traceevent ev = ring_p->events[seq & ring_p->mask];
+		/* skip what the worker may have overwritten while we copied */
+		uint64_t now_head = __atomic_load_n(&ring_p->head, __ATOMIC_ACQUIRE);
+		if (now_head - seq > size - 1) continue;
+		tw_event(tw_p, &ev, pid, tid);
+	}
+}
+
+
+/* Write the rings of the given pools as trace_event JSON */
+static int trace_write(int fd, thpool_* const* pools, int count, bool in_signal){
+	char buf[4096];
+	tracewriter tw;
+	tw_init(&tw, fd, buf, sizeof(buf), in_signal);
+
+	tw_str(&tw, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	tw_str(&tw, "{\"ph\":\"M\",\"name\":\"trace\",\"pid\":0,\"tid\":0,\"args\":{}}");
+	int p;
+	for (p = 0; p < count; p++){
+		thpool_* thpool_p = pools[p];
+		if (thpool_p == NULL) continue;
+		tw_name(&tw, "process_name", p + 1, 0, thpool_p->name, -1);
+		int n;
+		for (n = 0; n < thpool_p->num_threads_alive; n++){
+			thread* thread_p = thpool_p->threads[n];
+			tracering* ring_p = __atomic_load_n(&thread_p->trace, __ATOMIC_ACQUIRE);
+			tw_name(&tw, "thread_name", p + 1, thread_p->id, thpool_p->name, thread_p->id);
+			if (ring_p) tw_ring(&tw, ring_p, p + 1, thread_p->id);
+		}
+	}
+	tw_str(&tw, "\n]}\n");
+	tw_flush(&tw);
+	return 0;
+}
+
+
+/* Dump every registered pool that has been traced, then let crash
+ * signals take their course */
+static void trace_signal_handler(int sig_id){
+	int saved_errno = errno;
+	int fd = open(trace_signal_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd != -1){
+		thpool_* pools[REGISTRY_POOLS];
+		int n;
+		for (n = 0; n < REGISTRY_POOLS; n++){
+			pools[n] = __atomic_load_n(&registry[n], __ATOMIC_ACQUIRE);
+			/* rings are allocated for all workers at once */
+			if (pools[n] && (pools[n]->num_threads_alive == 0 ||
+			                 __atomic_load_n(&pools[n]->threads[0]->trace, __ATOMIC_ACQUIRE) == NULL)){
+				pools[n] = NULL;
+			}
+		}
+		trace_write(fd, pools, REGISTRY_POOLS, true);
+		close(fd);
+	}
+	if (sig_id == SIGSEGV || sig_id == SIGBUS || sig_id == SIGILL ||
+	    sig_id == SIGFPE  || sig_id == SIGABRT){
+		signal(sig_id, SIG_DFL);
+		raise(sig_id);
+	}
+	errno = saved_errno;
+}
+#endif
+
+
+/* Dump a pool's flight recorder into a file */
+int thpool_trace_dump(thpool_* thpool_p, const char* path){
+#ifdef LINUX
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1){
+		err("thpool_trace_dump(): Could not open trace file\n");
+		return -1;
+	}
+	trace_write(fd, &thpool_p, 1, false);
+	close(fd);
+	return 0;
+#else
+	(void)thpool_p; (void)path;
+	err("thpool_trace_dump(): Not supported on this system\n");
+	return -1;
+#endif
+}
+
+
+/* Dump all traced pools into path when sig_id arrives */
+int thpool_trace_on_signal(int sig_id, const char* path){
+#ifdef LINUX
+	if (path == NULL || strlen(path) >= sizeof(trace_signal_path)){
+		err("thpool_trace_on_signal(): Path is missing or too long\n");
+		return -1;
+	}
+	strcpy(trace_signal_path, path);
+
+	struct sigaction act;
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = trace_signal_handler;
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = SA_RESTART;
+	if (sigaction(sig_id, &act, NULL) == -1){
+		err("thpool_trace_on_signal(): Could not install signal handler\n");
+		return -1;
+	}
+	return 0;
+#else
+	(void)sig_id; (void)path;
+	err("thpool_trace_on_signal(): Not supported on this system\n");
+	return -1;
+#endif
+}
+
+
+/* ============================ METRICS ============================= */
+
+
+#ifdef LINUX
+#define METRICS_REQUEST_MS 50            /* wait for an HTTP request   */
+
+/* Upper bounds in ns of the exported histogram buckets */
+static const uint64_t metrics_bounds[] = {
+	1000ull, 2500ull, 5000ull, 10000ull, 25000ull, 50000ull, 100000ull, 250000ull, 500000ull,
+	1000000ull, 2500000ull, 5000000ull, 10000000ull, 25000000ull, 50000000ull,
+	100000000ull, 250000000ull, 500000000ull, 1000000000ull, 2500000000ull, 5000000000ull, 10000000000ull
+};
+#define METRICS_BOUNDS (int)(sizeof(metrics_bounds) / sizeof(metrics_bounds[0]))
+
+
+/* What a scrape reports of one registered pool, copied under
+ * registry_lock so the text is written without it */
+typedef struct metricpool{
+	bool         present;                /* registry slot in use      */
+	char         name[16];
+	thpool_stats stats;
+	uint64_t     buckets[2][METRICS_BOUNDS + 1]; /* cumulative, by kind */
+	uint64_t     sum_ns[2];              /* by THPOOL_LATENCY_* kind  */
+} metricpool;
+
+/* Exporter thread of thpool_metrics_start() */
+typedef struct exporter{
+	pthread_t thread;
+	int       listen_fd;                 /* UNIX socket, -1: file     */
+	int       wake[2];                   /* pipe ending the exporter  */
+	int       interval_ms;               /* rewrite period of a file  */
+	char      path[256];
+	metricpool pools[REGISTRY_POOLS];    /* snapshot of a scrape      */
+	histogram merged;                    /* scratch of the snapshot   */
+} exporter;
+
+static exporter* metrics_exporter = NULL;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER; /* start, stop */
+
+
+/* Counters and gauges taken from thpool_stats */
+#define METRIC_GAUGE 0                   /* int, also without stats   */
+#define METRIC_COUNT 1                   /* uint64_t                  */
+#define METRIC_NS    2                   /* uint64_t ns, as seconds   */
+
+typedef struct metricdef{
+	const char* name;                    /* family name               */
+	const char* help;
+	size_t      offset;                  /* field in thpool_stats     */
+	int         kind;                    /* METRIC_*                  */
+} metricdef;
+
+static const metricdef metrics_defs[] = {
+	{ "thpool_queue_depth",   "Jobs waiting in the queue.",           offsetof(thpool_stats, queue_len),           METRIC_GAUGE },
+	{ "thpool_workers_alive", "Workers alive.",                       offsetof(thpool_stats, num_threads),         METRIC_GAUGE },
+	{ "thpool_workers_busy",  "Workers awake and serving jobs.",      offsetof(thpool_stats, num_threads_working), METRIC_GAUGE },
+	{ "thpool_jobs",          "Jobs run.",                            offsetof(thpool_stats, jobs),                METRIC_COUNT },
+	{ "thpool_busy_seconds",  "Time workers spent running jobs.",     offsetof(thpool_stats, busy_ns),             METRIC_NS    },
+	{ "thpool_idle_seconds",  "Time workers spent between jobs.",     offsetof(thpool_stats, idle_ns),             METRIC_NS    },
+	{ "thpool_parks",         "Times a worker went to sleep.",        offsetof(thpool_stats, parks),               METRIC_COUNT },
+	{ "thpool_wakes",         "Times a sleeping worker was woken.",   offsetof(thpool_stats, wakes),               METRIC_COUNT },
+	{ "thpool_empty_pulls",   "Wake ups that found the queue empty.", offsetof(thpool_stats, empty_pulls),         METRIC_COUNT },
+	{ "thpool_broadcasts",    "Broadcast letters run.",               offsetof(thpool_stats, broadcasts),          METRIC_COUNT },
+};
+
+/* Nanoseconds as seconds, without trailing zeros */
+static void tw_seconds(tracewriter* tw_p, uint64_t ns){
+	tw_u64(tw_p, ns / 1000000000ull);
+	tw_char(tw_p, '.');
+	uint64_t frac = ns % 1000000000ull;
+	char digits[9];
+	int n, len = 1;
+	for (n = 8; n >= 0; n--){
+		digits[n] = (char)('0' + frac % 10);
+		frac /= 10;
+		if (digits[n] != '0' && len == 1) len = n + 1;
+	}
+	for (n = 0; n < len; n++) tw_char(tw_p, digits[n]);
+}
+
+
+/* pool="<name>" label, pools sharing a name also get their registry slot */
+static void tw_pool_label(tracewriter* tw_p, const metricpool* pools, int p){
+	tw_str(tw_p, "pool=\"");
+	const char* c;
+	for (c = pools[p].name; *c; c++){
+		if (*c == '"' || *c == '\\') tw_char(tw_p, '\\');
+		if ((unsigned char)*c >= 0x20) tw_char(tw_p, *c);
+	}
+	int q;
+	for (q = 0; q < p; q++){
+		if (pools[q].present && strcmp(pools[q].name, pools[p].name) == 0) break;
+	}
+	if (q < p){
+		tw_char(tw_p, '-');
+		tw_u64(tw_p, (uint64_t)p);
+	}
+	tw_char(tw_p, '"');
+}
+
+
+static void tw_family(tracewriter* tw_p, const char* name, const char* type, const char* unit, const char* help){
+	tw_str(tw_p, "# TYPE ");
+	tw_str(tw_p, name);
+	tw_char(tw_p, ' ');
+	tw_str(tw_p, type);
+	if (unit){
+		tw_str(tw_p, "\n# UNIT ");
+		tw_str(tw_p, name);
+		tw_char(tw_p, ' ');
+		tw_str(tw_p, unit);
+	}
+	tw_str(tw_p, "\n# HELP ");
+	tw_str(tw_p, name);
+	tw_char(tw_p, ' ');
+	tw_str(tw_p, help);
+	tw_char(tw_p, '\n');
+}
+
+
+#ifndef THPOOL_NO_STATS
+/* Merge the workers' histograms of a pool into the exported buckets */
+static void metrics_reduce(exporter* exp_p, thpool_* thpool_p, metricpool* pool_p, int kind){
+	histogram* hist_p = &exp_p->merged;
+	memset(hist_p, 0, sizeof(histogram));
+	int n;
+	for (n = 0; n < thpool_p->num_threads_alive; n++){
+		thread* thread_p = thpool_p->threads[n];
+		hist_merge(hist_p, kind == THPOOL_LATENCY_QUEUE ? &thread_p->queue_hist : &thread_p->exec_hist);
+	}
+
+	/* counted from the buckets, so the cumulative counts never go down */
+	uint64_t seen = 0;
+	int b = 0;
+	for (n = 0; n <= METRICS_BOUNDS; n++){
+		while (b < HIST_BUCKETS && (n == METRICS_BOUNDS || hist_upper(b) <= metrics_bounds[n])){
+			seen += hist_p->buckets[b++];
+		}
+		pool_p->buckets[kind][n] = seen;
+	}
+	pool_p->sum_ns[kind] = hist_p->sum;
+}
+
+
+/* One latency histogram family */
+static void metrics_histogram(tracewriter* tw_p, const metricpool* pools, int kind,
+                              const char* name, const char* help){
+	tw_family(tw_p, name, "histogram", "seconds", help);
+	int p, n;
+	for (p = 0; p < REGISTRY_POOLS; p++){
+		if (!pools[p].present) continue;
+		const uint64_t* buckets = pools[p].buckets[kind];
+		for (n = 0; n <= METRICS_BOUNDS; n++){
+			tw_str(tw_p, name);
+			tw_str(tw_p, "_bucket{");
+			tw_pool_label(tw_p, pools, p);
+			tw_str(tw_p, ",le=\"");
+			if (n == METRICS_BOUNDS) tw_str(tw_p, "+Inf");
+			else                     tw_seconds(tw_p, metrics_bounds[n]);
+			tw_str(tw_p, "\"} ");
+			tw_u64(tw_p, buckets[n]);
+			tw_char(tw_p, '\n');
+		}
+		tw_str(tw_p, name);
+		tw_str(tw_p, "_count{");
+		tw_pool_label(tw_p, pools, p);
+		tw_str(tw_p, "} ");
+		tw_u64(tw_p, buckets[METRICS_BOUNDS]);
+		tw_char(tw_p, '\n');
+		tw_str(tw_p, name);
+		tw_str(tw_p, "_sum{");
+		tw_pool_label(tw_p, pools, p);
+		tw_str(tw_p, "} ");
+		tw_seconds(tw_p, pools[p].sum_ns[kind]);
+		tw_char(tw_p, '\n');
+	}
+}
+#endif
+
+
+/* Write every registered pool in OpenMetrics text format
+ *
+ * The pools' counters are read the way thpool_stats_snapshot() reads
+ * them, without a lock the workers take. registry_lock keeps the pools
+ * from being destroyed while they are copied into exp_p; the text is
+ * written after it is released, so a slow reader does not hold up
+ * thpool_init() and thpool_destroy().
+ */
+static void metrics_write(tracewriter* tw_p, exporter* exp_p){
+	metricpool* pools = exp_p->pools;
+	int p;
+	pthread_mutex_lock(&registry_lock);
+	for (p = 0; p < REGISTRY_POOLS; p++){
+		thpool_* thpool_p = registry[p];
+		pools[p].present = thpool_p != NULL;
+		if (thpool_p == NULL) continue;
+		memcpy(pools[p].name, thpool_p->name, sizeof(pools[p].name));
+		thpool_stats_snapshot(thpool_p, &pools[p].stats);
+#ifndef THPOOL_NO_STATS
+		metrics_reduce(exp_p, thpool_p, &pools[p], THPOOL_LATENCY_QUEUE);
+		metrics_reduce(exp_p, thpool_p, &pools[p], THPOOL_LATENCY_EXEC);
+#endif
+	}
+	pthread_mutex_unlock(&registry_lock);
+
+	size_t m;
+	for (m = 0; m < sizeof(metrics_defs) / sizeof(metrics_defs[0]); m++){
+		const metricdef* def_p = &metrics_defs[m];
+		if (!STATS_ON && def_p->kind != METRIC_GAUGE) continue;
+		tw_family(tw_p, def_p->name, def_p->kind == METRIC_GAUGE ? "gauge" : "counter",
+		          def_p->kind == METRIC_NS ? "seconds" : NULL, def_p->help);
+		for (p = 0; p < REGISTRY_POOLS; p++){
+			if (!pools[p].present) continue;
+			const char* field_p = (const char*)&pools[p].stats + def_p->offset;
+			tw_str(tw_p, def_p->name);
+			if (def_p->kind != METRIC_GAUGE) tw_str(tw_p, "_total");
+			tw_char(tw_p, '{');
+			tw_pool_label(tw_p, pools, p);
+			tw_str(tw_p, "} ");
+			if (def_p->kind == METRIC_GAUGE){
+				int value;
+				memcpy(&value, field_p, sizeof(value));
+				tw_u64(tw_p, value > 0 ? (uint64_t)value : 0);
+			} else {
+				uint64_t value;
+				memcpy(&value, field_p, sizeof(value));
+				if (def_p->kind == METRIC_NS) tw_seconds(tw_p, value);
+				else                          tw_u64(tw_p, value);
+			}
+			tw_char(tw_p, '\n');
+		}
+	}
+#ifndef THPOOL_NO_STATS
+	metrics_histogram(tw_p, pools, THPOOL_LATENCY_QUEUE, "thpool_job_queue_wait_seconds",
+	                  "Time jobs waited in the queue.");
+	metrics_histogram(tw_p, pools, THPOOL_LATENCY_EXEC, "thpool_job_run_seconds",
+	                  "Run time of jobs.");
+#endif
+	tw_str(tw_p, "# EOF\n");
+	tw_flush(tw_p);
+}
+
+
+/* Answer one connection to the socket
+ *
+ * HTTP clients (curl --unix-socket) send a request and get a response
+ * header; anything else just reads the text until the socket closes.
+ */
+static void metrics_serve(exporter* exp_p){
+	int fd = accept4(exp_p->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd == -1) return;
+	struct timeval timeout = { 1, 0 };     /* a stuck client holds up the exporter */
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	bool http = false;
+	struct pollfd request;
+	request.fd     = fd;
+	request.events = POLLIN;
+	if (poll(&request, 1, METRICS_REQUEST_MS) > 0){
+		char line[1024];
+		ssize_t n = recv(fd, line, sizeof(line), MSG_DONTWAIT);
+		http = n >= 4 && memcmp(line, "GET ", 4) == 0;
+	}
+
+	char buf[4096];
+	tracewriter tw;
+	tw_init(&tw, fd, buf, sizeof(buf), false);
+	tw.is_socket = true;
+	if (http){
+		tw_str(&tw, "HTTP/1.0 200 OK\r\n"
+		            "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+		            "Connection: close\r\n\r\n");
+	}
+	metrics_write(&tw, exp_p);
+	shutdown(fd, SHUT_WR);
+	close(fd);
+}
+
+
+/* Rewrite the file, readers only ever see a complete one */
+static void metrics_file(exporter* exp_p){
+	char tmp_path[sizeof(exp_p->path) + 4];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", exp_p->path);
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) return;
+
+	char buf[4096];
+	tracewriter tw;
+	tw_init(&tw, fd, buf, sizeof(buf), false);
+	metrics_write(&tw, exp_p);
+	close(fd);
+	rename(tmp_path, exp_p->path);
+}
+
+
+static void* metrics_do(void* p0){
+	exporter* exp_p = (exporter*)p0;
+	pthread_setname_np(pthread_self(), "thpool-metrics");
+
+	for (;;){
+		if (exp_p->listen_fd == -1) metrics_file(exp_p);
+
+		struct pollfd fds[2];
+		fds[0].fd     = exp_p->wake[0];
+		fds[0].events = POLLIN;
+		fds[1].fd     = exp_p->listen_fd;
+		fds[1].events = POLLIN;
+		int rc = exp_p->listen_fd == -1 ? poll(fds, 1, exp_p->interval_ms) : poll(fds, 2, -1);
+		if (rc > 0 && fds[0].revents) break;
+		if (rc > 0 && exp_p->listen_fd != -1 && (fds[1].revents & POLLIN)) metrics_serve(exp_p);
+	}
+	return NULL;
+}
+
+
+static void metrics_close(exporter* exp_p){
+	if (exp_p->listen_fd != -1){
+		close(exp_p->listen_fd);
+		unlink(exp_p->path);
+	}
+	if (exp_p->wake[0] != -1) close(exp_p->wake[0]);
+	if (exp_p->wake[1] != -1) close(exp_p->wake[1]);
+	free(exp_p);
+}
+#endif
+
+
+/* Export every registered pool on a UNIX socket or into a file */
+int thpool_metrics_start(const char* path, int interval_ms){
+#ifdef LINUX
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	size_t limit = interval_ms > 0 ? sizeof(((exporter*)0)->path) : sizeof(addr.sun_path);
+	if (path == NULL || strlen(path) >= limit){
+		err("thpool_metrics_start(): Path is missing or too long\n");
+		return -1;
+	}
+
+	pthread_mutex_lock(&metrics_lock);
+	if (metrics_exporter){
+		pthread_mutex_unlock(&metrics_lock);
+		err("thpool_metrics_start(): Exporter is already running\n");
+		return -1;
+	}
+	exporter* exp_p = (exporter*)calloc(1, sizeof(exporter));
+	if (exp_p == NULL){
+		pthread_mutex_unlock(&metrics_lock);
+		err("thpool_metrics_start(): Could not allocate memory for exporter\n");
+		return -1;
+	}
+	exp_p->listen_fd   = -1;
+	exp_p->wake[0]     = -1;
+	exp_p->wake[1]     = -1;
+	exp_p->interval_ms = interval_ms;
+	strcpy(exp_p->path, path);
+
+	if (pipe2(exp_p->wake, O_CLOEXEC) == -1){
+		metrics_close(exp_p);
+		pthread_mutex_unlock(&metrics_lock);
+		err("thpool_metrics_start(): Could not create pipe\n");
+		return -1;
+	}
+	if (interval_ms <= 0){
+		strcpy(addr.sun_path, path);
+		int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		unlink(path);
+		if (fd == -1 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, 16) == -1){
+			if (fd != -1) close(fd);
+			metrics_close(exp_p);
+			pthread_mutex_unlock(&metrics_lock);
+			err("thpool_metrics_start(): Could not listen on socket\n");
+			return -1;
+		}
+		exp_p->listen_fd = fd;
+	}
+	if (pthread_create(&exp_p->thread, NULL, metrics_do, exp_p) != 0){
+		metrics_close(exp_p);
+		pthread_mutex_unlock(&metrics_lock);
+		err("thpool_metrics_start(): Could not start exporter thread\n");
+		return -1;
+	}
+	metrics_exporter = exp_p;
+	pthread_mutex_unlock(&metrics_lock);
+	return 0;
+#else
+	(void)path; (void)interval_ms;
+	err("thpool_metrics_start(): Not supported on this system\n");
+	return -1;
+#endif
+}
+
+
+/* Stop the exporter, removing its socket */
+void thpool_metrics_stop(void){
+#ifdef LINUX
+	pthread_mutex_lock(&metrics_lock);
+	exporter* exp_p = metrics_exporter;
+	if (exp_p){
+		char wake = 0;
+		ssize_t n;
+		do n = write(exp_p->wake[1], &wake, 1); while (n == -1 && errno == EINTR);
+		pthread_join(exp_p->thread, NULL);
+		metrics_close(exp_p);
+		metrics_exporter = NULL;
+	}
+	pthread_mutex_unlock(&metrics_lock);
+#endif
+}
+
+
+/* ============================== STATE ============================= */
+
+
+#ifdef LINUX
+#define STATE_BUFFER (64 * 1024)         /* a dump is written in one go */
+
+static char* state_buffer = NULL;        /* allocated before a signal */
+static char  state_signal_path[256];     /* "": stderr                */
+static int   state_busy = 0;             /* a handler is writing      */
+
+
+/* Queue and workers of every registered pool
+ *
+ * Reads only what the workers publish with atomic stores, so it can run
+ * in a signal handler. The oldest job is read off the queue front without
+ * the queue lock; jobs stay in the pool's slab until it is destroyed, so
+ * at worst the age is that of a job just taken.
+ */
+static void state_write(tracewriter* tw_p){
+	tw_str(tw_p, "thpool state, pid ");
+	tw_u64(tw_p, (uint64_t)getpid());
+	tw_char(tw_p, '\n');
+	int p;
+	for (p = 0; p < REGISTRY_POOLS; p++){
+		thpool_* thpool_p = __atomic_load_n(&registry[p], __ATOMIC_ACQUIRE);
+		if (thpool_p == NULL) continue;
+		uint64_t now = thpool_p->jobqueue.now();
+		int alive = thpool_p->num_threads_alive;
+
+		tw_str(tw_p, "pool ");
+		tw_str(tw_p, thpool_p->name);
+		tw_str(tw_p, ": ");
+		tw_u64(tw_p, (uint64_t)alive);
+		tw_str(tw_p, " workers, ");
+		tw_u64(tw_p, (uint64_t)thpool_p->num_threads_working);
+		tw_str(tw_p, " working, ");
+		tw_u64(tw_p, (uint64_t)__atomic_load_n(&thpool_p->jobqueue.len, __ATOMIC_RELAXED));
+		tw_str(tw_p, " queued");
+		job* front_p = __atomic_load_n(&thpool_p->jobqueue.front, __ATOMIC_ACQUIRE);
+		uint64_t enqueued = front_p ? __atomic_load_n(&front_p->enqueued, __ATOMIC_RELAXED) : 0;
+		if (enqueued && enqueued <= now){
+			tw_str(tw_p, ", oldest for ");
+			tw_us(tw_p, now - enqueued);
+			tw_str(tw_p, " us");
+		}
+		tw_char(tw_p, '\n');
+
+		int n;
+		for (n = 0; n < alive; n++){
+			thread* thread_p = thpool_p->threads[n];
+			tw_str(tw_p, "  ");
+			tw_str(tw_p, thpool_p->name);
+			tw_char(tw_p, '-');
+			tw_u64(tw_p, (uint64_t)thread_p->id);
+			switch (__atomic_load_n(&thread_p->state, __ATOMIC_ACQUIRE)){
+				case WORKER_PARKED:
+					tw_str(tw_p, " parked\n");
+					break;
+				case WORKER_RUNNING: {
+					uint64_t started = __atomic_load_n(&thread_p->job_started, __ATOMIC_ACQUIRE);
+					tw_str(tw_p, " running ");
+					tw_symbol(tw_p, __atomic_load_n(&thread_p->job_function, __ATOMIC_RELAXED));
+					if (started && started <= now){
+						tw_str(tw_p, " for ");
+						tw_us(tw_p, now - started);
+						tw_str(tw_p, " us");
+					}
+					tw_char(tw_p, '\n');
+					break;
+				}
+				default:
+					tw_str(tw_p, " spinning\n");
+			}
+		}
+	}
+}
+
+
+static void state_signal_handler(int sig_id){
+	(void)sig_id;
+	/* signals delivered to two threads at once share the buffer */
+	if (__atomic_exchange_n(&state_busy, 1, __ATOMIC_ACQUIRE)) return;
+	int saved_errno = errno;
+	int fd = 2;
+	if (state_signal_path[0]) fd = open(state_signal_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd != -1){
+		tracewriter tw;
+		tw_init(&tw, fd, state_buffer, STATE_BUFFER, true);
+		state_write(&tw);
+		tw_flush(&tw);
+		if (fd != 2) close(fd);
+	}
+	errno = saved_errno;
+	__atomic_store_n(&state_busy, 0, __ATOMIC_RELEASE);
+}
+#endif
+
+
+/* Write the state of every registered pool to fd
+ *
+ * registry_lock keeps the pools from being destroyed meanwhile; only the
+ * signal handler goes without it.
+ */
+int thpool_state_dump(int fd){
+#ifdef LINUX
+	char buf[4096];
+	tracewriter tw;
+	tw_init(&tw, fd, buf, sizeof(buf), false);
+	pthread_mutex_lock(&registry_lock);
+	state_write(&tw);
+	tw_flush(&tw);
+	pthread_mutex_unlock(&registry_lock);
+	return 0;
+#else
+	(void)fd;
+	err("thpool_state_dump(): Not supported on this system\n");
+	return -1;
+#endif
+}
+
+
+/* Dump the state of every registered pool when sig_id arrives */
+int thpool_state_on_signal(int sig_id, const char* path){
+#ifdef LINUX
+	if (path && strlen(path) >= sizeof(state_signal_path)){
+		err("thpool_state_on_signal(): Path is too long\n");
+		return -1;
+	}
+	if (state_buffer == NULL){
+		state_buffer = (char*)malloc(STATE_BUFFER);
+		if (state_buffer == NULL){
+			err("thpool_state_on_signal(): Could not allocate memory for dump buffer\n");
+			return -1;
+		}
+	}
+	strcpy(state_signal_path, path ? path : "");
+
+	struct sigaction act;
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = state_signal_handler;
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = SA_RESTART;
+	if (sigaction(sig_id, &act, NULL) == -1){
+		err("thpool_state_on_signal(): Could not install signal handler\n");
+		return -1;
+	}
+	return 0;
+#else
+	(void)sig_id; (void)path;
+	err("thpool_state_on_signal(): Not supported on this system\n");
+	return -1;
+#endif
+}
+
+
+/* ============================ PROFILE ============================= */
+
+
+#ifndef THPOOL_NO_STATS
+/* Slot of the calling worker's profile for function_p, NULL when full */
+static profileslot* profile_slot(thread* thread_p, void (*function_p)(void*)){
+	uintptr_t key = (uintptr_t)function_p;
+	uint32_t  n = (uint32_t)((key >> 4) * 2654435761u) & (PROFILE_SLOTS - 1);
+	uint32_t  probes;
+	for (probes = 0; probes < PROFILE_SLOTS; probes++){
+		profileslot* slot_p = &thread_p->profile[n];
+		if (slot_p->function == function_p) return slot_p;
+		if (slot_p->function == NULL){
+			/* the key goes last, readers skip the slot until it is set */
+			__atomic_store_n(&slot_p->function, function_p, __ATOMIC_RELEASE);
+			return slot_p;
+		}
+		n = (n + 1) & (PROFILE_SLOTS - 1);
+	}
+	return NULL;
+}
+
+
+/* Account one job, called by the owning worker only */
+static void profile_record(thread* thread_p, void (*function_p)(void*), uint64_t run_ns, uint64_t wait_ns){
+	profileslot* slot_p = profile_slot(thread_p, function_p);
+	if (slot_p == NULL){
+		STATS_ADD(thread_p, profile_dropped, 1);
+		return;
+	}
+	STATS_ADD(slot_p, count, 1);
+	STATS_ADD(slot_p, total_ns, run_ns);
+	STATS_ADD(slot_p, wait_ns, wait_ns);
+	if (run_ns > slot_p->max_ns) __atomic_store_n(&slot_p->max_ns, run_ns, __ATOMIC_RELAXED);
+	if (wait_ns > slot_p->max_wait_ns) __atomic_store_n(&slot_p->max_wait_ns, wait_ns, __ATOMIC_RELAXED);
+}
+
+
+static int profile_by_function(const void* a, const void* b){
+	uintptr_t fa = (uintptr_t)((const thpool_profile_entry*)a)->function;
+	uintptr_t fb = (uintptr_t)((const thpool_profile_entry*)b)->function;
+	return fa < fb ? -1 : fa > fb;
+}
+
+
+static int profile_by_total(const void* a, const void* b){
+	uint64_t ta = ((const thpool_profile_entry*)a)->total_ns;
+	uint64_t tb = ((const thpool_profile_entry*)b)->total_ns;
+	return ta > tb ? -1 : ta < tb;
+}
+#endif
+
+
+/* Job functions the pool has run, most expensive first */
+int thpool_profile_snapshot(thpool_* thpool_p, thpool_profile_entry* entries, int max_entries){
+#ifdef THPOOL_NO_STATS
+	(void)thpool_p; (void)entries; (void)max_entries;
+	return -1;
+#else
+	int num_threads = thpool_p->num_threads_alive;
+	thpool_profile_entry* all = (thpool_profile_entry*)calloc((size_t)num_threads * PROFILE_SLOTS + 1,
+	                                                          sizeof(thpool_profile_entry));
+	if (all == NULL){
+		err("thpool_profile_snapshot(): Could not allocate memory for profile\n");
+		return -1;
+	}
+
+	/* gather every worker's slots, then fold equal functions together */
+	int count = 0, t, n;
+	for (t = 0; t < num_threads; t++){
+		thread* thread_p = thpool_p->threads[t];
+		for (n = 0; n < PROFILE_SLOTS; n++){
+			profileslot* slot_p = &thread_p->profile[n];
+			void (*function_p)(void*) = __atomic_load_n(&slot_p->function, __ATOMIC_ACQUIRE);
+			if (function_p == NULL) continue;
+			thpool_profile_entry* entry_p = &all[count++];
+			entry_p->function    = function_p;
+			entry_p->count       = __atomic_load_n(&slot_p->count,       __ATOMIC_RELAXED);
+			entry_p->total_ns    = __atomic_load_n(&slot_p->total_ns,    __ATOMIC_RELAXED);
+			entry_p->max_ns      = __atomic_load_n(&slot_p->max_ns,      __ATOMIC_RELAXED);
+			entry_p->wait_ns     = __atomic_load_n(&slot_p->wait_ns,     __ATOMIC_RELAXED);
+			entry_p->max_wait_ns = __atomic_load_n(&slot_p->max_wait_ns, __ATOMIC_RELAXED);
+		}
+	}
+	qsort(all, count, sizeof(thpool_profile_entry), profile_by_function);
+	int merged = 0;
+	for (n = 0; n < count; n++){
+		thpool_profile_entry* dst_p = &all[merged];
+		if (merged && all[merged - 1].function == all[n].function){
+			dst_p = &all[merged - 1];
+			dst_p->count    += all[n].count;
+			dst_p->total_ns += all[n].total_ns;
+			dst_p->wait_ns  += all[n].wait_ns;
+			if (all[n].max_ns > dst_p->max_ns) dst_p->max_ns = all[n].max_ns;
+			if (all[n].max_wait_ns > dst_p->max_wait_ns) dst_p->max_wait_ns = all[n].max_wait_ns;
+			continue;
+		}
+		if (n != merged) *dst_p = all[n];
+		merged++;
+	}
+	qsort(all, merged, sizeof(thpool_profile_entry), profile_by_total);
+
+	if (merged > max_entries) merged = max_entries;
+	for (n = 0; n < merged; n++){
+		entries[n] = all[n];
+#ifdef LINUX
+		/* symbols are looked up only for what is returned */
+		Dl_info info;
+		if (dladdr((void*)entries[n].function, &info) && info.dli_sname){
+			entries[n].name = info.dli_sname;
+		}
+#endif
+	}
+	free(all);
+	return merged;
+#endif
+}
+
+
+/* Profile as a table, sorted by total run time */
+int thpool_profile_dump(thpool_* thpool_p, FILE* out){
+	int num_entries = PROFILE_SLOTS * (thpool_p->num_threads_alive + 1);
+	thpool_profile_entry* entries = (thpool_profile_entry*)malloc(num_entries * sizeof(thpool_profile_entry));
+	if (entries == NULL){
+		err("thpool_profile_dump(): Could not allocate memory for profile\n");
+		return -1;
+	}
+	int count = thpool_profile_snapshot(thpool_p, entries, num_entries);
+	if (count < 0){
+		free(entries);
+		return -1;
+	}
+
+	uint64_t all_ns = 0;
+	int n;
+	for (n = 0; n < count; n++) all_ns += entries[n].total_ns;
+
+	fprintf(out, "%6s %10s %12s %10s %10s %10s %10s  %s\n",
+	        "%time", "calls", "total ms", "mean us", "max us", "wait us", "wait max", "function");
+	for (n = 0; n < count; n++){
+		const thpool_profile_entry* entry_p = &entries[n];
+		char hex[2 * sizeof(void*) + 3];
+		const char* name = entry_p->name;
+		char* demangled = NULL;
+#ifdef LINUX
+		int status = 0;
+		if (name) demangled = abi::__cxa_demangle(name, NULL, NULL, &status);
+		if (demangled) name = demangled;
+#endif
+		if (name == NULL){
+			snprintf(hex, sizeof(hex), "%p", (void*)entry_p->function);
+			name = hex;
+		}
+		double count_d = entry_p->count ? (double)entry_p->count : 1.0;
+		fprintf(out, "%6.2f %10llu %12.3f %10.3f %10.3f %10.3f %10.3f  %s\n",
+		        all_ns ? 100.0 * (double)entry_p->total_ns / (double)all_ns : 0.0,
+		        (unsigned long long)entry_p->count,
+		        (double)entry_p->total_ns / 1e6,
+		        (double)entry_p->total_ns / count_d / 1e3,
+		        (double)entry_p->max_ns / 1e3,
+		        (double)entry_p->wait_ns / count_d / 1e3,
+		        (double)entry_p->max_wait_ns / 1e3,
+		        name);
+		free(demangled);
+	}
+
+	uint64_t dropped = 0;
+#ifndef THPOOL_NO_STATS
+	for (n = 0; n < thpool_p->num_threads_alive; n++){
+		dropped += __atomic_load_n(&thpool_p->threads[n]->profile_dropped, __ATOMIC_RELAXED);
+	}
+#endif
+	if (dropped){
+		fprintf(out, "%llu jobs of functions beyond the first %d per worker were not profiled\n",
+		        (unsigned long long)dropped, PROFILE_SLOTS);
+	}
+	free(entries);
+	return 0;
+}
+
+
+/* ============================== PERF ============================== */
+
+
+#ifdef LINUX
+static int perf_open(uint32_t type, uint64_t config, int group_fd, bool user_only){
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size           = sizeof(attr);
+	attr.type           = type;
+	attr.config         = config;
+	attr.disabled       = group_fd == -1;
+	attr.exclude_kernel = user_only;
+	attr.exclude_hv     = 1;
+	attr.read_format    = PERF_FORMAT_GROUP;
+	return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+
+/* Open the counters of the calling worker in a zeroed table, or in a new
+ * one if perf_p is NULL
+ *
+ * Counters that cannot be opened (no PMU, perf_event_paranoid, seccomp)
+ * are left out; with none at all only the clock is accounted.
+ */
+static perfcounters* perf_init(perfcounters* perf_p){
+	if (perf_p == NULL) perf_p = (perfcounters*)calloc(1, sizeof(perfcounters));
+	if (perf_p == NULL) return NULL;
+	static const uint64_t hw_events[] = {
+		PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES
+	};
+	int n;
+	for (n = 0; n < PERF_COUNTERS; n++) perf_p->fds[n] = -1;
+
+	perf_p->fds[PERF_CYCLES] = perf_open(PERF_TYPE_HARDWARE, hw_events[PERF_CYCLES], -1, true);
+	int leader = perf_p->fds[PERF_CYCLES];
+	if (leader != -1){
+		perf_p->hw = true;
+		perf_p->order[perf_p->group_size++] = PERF_CYCLES;
+		for (n = PERF_INSTRUCTIONS; n <= PERF_LLC_MISSES; n++){
+			perf_p->fds[n] = perf_open(PERF_TYPE_HARDWARE, hw_events[n], leader, true);
+			if (perf_p->fds[n] != -1) perf_p->order[perf_p->group_size++] = n;
+		}
+	}
+	/* switches happen in the kernel, excluding it counts none */
+	perf_p->fds[PERF_CSWITCHES] = perf_open(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, leader, false);
+	if (perf_p->fds[PERF_CSWITCHES] == -1){
+		perf_p->fds[PERF_CSWITCHES] = perf_open(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, leader, true);
+	}
+	if (perf_p->fds[PERF_CSWITCHES] != -1 && leader != -1){
+		perf_p->order[perf_p->group_size++] = PERF_CSWITCHES;
+	}
+	if (leader == -1 && perf_p->fds[PERF_CSWITCHES] != -1){
+		ioctl(perf_p->fds[PERF_CSWITCHES], PERF_EVENT_IOC_ENABLE, 0);
+	}
+
+#if defined(__x86_64__)
+	/* rdpmc needs a user page per hardware counter and the kernel's consent */
+	if (perf_p->hw){
+		perf_p->rdpmc = true;
+		for (n = PERF_CYCLES; n <= PERF_LLC_MISSES; n++){
+			if (perf_p->fds[n] == -1) continue;
+			void* page = mmap(NULL, (size_t)sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, perf_p->fds[n], 0);
+			if (page == MAP_FAILED){
+				perf_p->rdpmc = false;
+				continue;
+			}
+			perf_p->pages[n] = (struct perf_event_mmap_page*)page;
+			if (!perf_p->pages[n]->cap_user_rdpmc) perf_p->rdpmc = false;
+		}
+	}
+#endif
+	if (leader != -1) ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	return perf_p;
+}
+
+
+/* Close the counters, the table stays for snapshots */
+static void perf_close(perfcounters* perf_p){
+	int n;
+	for (n = 0; n <= PERF_LLC_MISSES; n++){
+		if (perf_p->pages[n]) munmap(perf_p->pages[n], (size_t)sysconf(_SC_PAGESIZE));
+		perf_p->pages[n] = NULL;
+	}
+	for (n = PERF_COUNTERS - 1; n >= 0; n--){
+		if (perf_p->fds[n] != -1) close(perf_p->fds[n]);
+		perf_p->fds[n] = -1;
+	}
+	perf_p->hw    = false;
+	perf_p->rdpmc = false;
+}
+
+
+#if defined(__x86_64__)
+/* Read a counter from user space, see perf_event_mmap_page in perf_event.h */
+static uint64_t perf_rdpmc(struct perf_event_mmap_page* page_p){
+	uint32_t seq, index;
+	uint64_t count;
+	do {
+		seq = __atomic_load_n(&page_p->lock, __ATOMIC_ACQUIRE);
+		index = page_p->index;
+		count = (uint64_t)page_p->offset;
+		if (page_p->cap_user_rdpmc && index){
+			uint16_t width = page_p->pmc_width;
+			int64_t pmc = (int64_t)__builtin_ia32_rdpmc((int)index - 1);
+			pmc <<= 64 - width;
+			pmc >>= 64 - width;
+			count += (uint64_t)pmc;
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&page_p->lock, __ATOMIC_RELAXED) != seq);
+	return count;
+}
+#endif
+
+
+/* Current values of the worker's counters */
+static void perf_sample(perfcounters* perf_p, uint64_t* values){
+	int n;
+#if defined(__x86_64__)
+	if (perf_p->rdpmc){
+		for (n = PERF_CYCLES; n <= PERF_LLC_MISSES; n++){
+			values[n] = perf_p->pages[n] ? perf_rdpmc(perf_p->pages[n]) : 0;
+		}
+		/* the kernel rewrites the leader's page when it schedules the
+		 * group back in, only then a context switch may have happened */
+		uint32_t lock = __atomic_load_n(&perf_p->pages[PERF_CYCLES]->lock, __ATOMIC_RELAXED);
+		if (lock != perf_p->seen_lock && perf_p->fds[PERF_CSWITCHES] != -1){
+			uint64_t buf[1 + PERF_COUNTERS];
+			if (read(perf_p->fds[PERF_CYCLES], buf, sizeof(buf)) > 0){
+				for (n = 0; n < perf_p->group_size && n < (int)buf[0]; n++){
+					if (perf_p->order[n] == PERF_CSWITCHES) perf_p->cswitches = buf[1 + n];
+				}
+			}
+			perf_p->seen_lock = lock;
+		}
+		values[PERF_CSWITCHES] = perf_p->cswitches;
+		return;
+	}
+#endif
+	memset(values, 0, PERF_COUNTERS * sizeof(uint64_t));
+	uint64_t buf[1 + PERF_COUNTERS];
+	if (perf_p->hw){
+		if (read(perf_p->fds[PERF_CYCLES], buf, sizeof(buf)) > 0){
+			for (n = 0; n < perf_p->group_size && n < (int)buf[0]; n++){
+				values[perf_p->order[n]] = buf[1 + n];
+			}
+		}
+	} else if (perf_p->fds[PERF_CSWITCHES] != -1){
+		if (read(perf_p->fds[PERF_CSWITCHES], buf, 2 * sizeof(uint64_t)) > 0){
+			values[PERF_CSWITCHES] = buf[1];
+		}
+	}
+}
+#endif
+
+
+/* Account one job by tag, or by function for untagged jobs */
+static void perf_record(perfcounters* perf_p, job* job_p, uint64_t time_ns,
+                        const uint64_t* before, const uint64_t* after){
+	uintptr_t key = job_p->tag ? job_p->tag : (uintptr_t)job_p->function;
+	uint32_t  n = (uint32_t)((key >> 4) * 2654435761u) & (PERF_SLOTS - 1);
+	uint32_t  probes;
+	perfslot* slot_p = NULL;
+	for (probes = 0; probes < PERF_SLOTS; probes++){
+		perfslot* cand_p = &perf_p->slots[n];
+		if (cand_p->key == key){
+			slot_p = cand_p;
+			break;
+		}
+		if (cand_p->key == 0){
+			cand_p->tag      = job_p->tag;
+			cand_p->function = job_p->function;
+			__atomic_store_n(&cand_p->key, key, __ATOMIC_RELEASE);
+			slot_p = cand_p;
+			break;
+		}
+		n = (n + 1) & (PERF_SLOTS - 1);
+	}
+	if (slot_p == NULL){
+		__atomic_store_n(&perf_p->dropped, perf_p->dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+	__atomic_store_n(&slot_p->jobs, slot_p->jobs + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot_p->time_ns, slot_p->time_ns + time_ns, __ATOMIC_RELAXED);
+	int c;
+	for (c = 0; c < PERF_COUNTERS; c++){
+		uint64_t delta = after[c] > before[c] ? after[c] - before[c] : 0;
+		__atomic_store_n(&slot_p->counts[c], slot_p->counts[c] + delta, __ATOMIC_RELAXED);
+	}
+}
+
+
+static int perf_by_key(const void* a, const void* b){
+	const thpool_perf_entry* ea = (const thpool_perf_entry*)a;
+	const thpool_perf_entry* eb = (const thpool_perf_entry*)b;
+	uintptr_t ka = ea->tag ? ea->tag : (uintptr_t)ea->function;
+	uintptr_t kb = eb->tag ? eb->tag : (uintptr_t)eb->function;
+	return ka < kb ? -1 : ka > kb;
+}
+
+
+static int perf_by_time(const void* a, const void* b){
+	uint64_t ta = ((const thpool_perf_entry*)a)->time_ns;
+	uint64_t tb = ((const thpool_perf_entry*)b)->time_ns;
+	return ta > tb ? -1 : ta < tb;
+}
+
+
+/* Counters by job class of one worker, or of all with worker_id -1 */
+int thpool_perf_snapshot(thpool_* thpool_p, int worker_id, thpool_perf_entry* entries, int max_entries){
+	int num_threads = thpool_p->num_threads_alive;
+	if (worker_id >= num_threads || worker_id < -1) return -1;
+	int first = worker_id == -1 ? 0 : worker_id;
+	int last  = worker_id == -1 ? num_threads : worker_id + 1;
+
+	thpool_perf_entry* all = (thpool_perf_entry*)calloc((size_t)(last - first) * PERF_SLOTS + 1,
+	                                                    sizeof(thpool_perf_entry));
+	if (all == NULL){
+		err("thpool_perf_snapshot(): Could not allocate memory for counters\n");
+		return -1;
+	}
+	int count = 0, t, n;
+	for (t = first; t < last; t++){
+		perfcounters* perf_p = thpool_p->threads[t]->perf;
+		if (perf_p == NULL) continue;
+		for (n = 0; n < PERF_SLOTS; n++){
+			perfslot* slot_p = &perf_p->slots[n];
+			if (__atomic_load_n(&slot_p->key, __ATOMIC_ACQUIRE) == 0) continue;
+			thpool_perf_entry* entry_p = &all[count++];
+			entry_p->tag              = slot_p->tag;
+			entry_p->function         = slot_p->function;
+			entry_p->jobs             = __atomic_load_n(&slot_p->jobs,    __ATOMIC_RELAXED);
+			entry_p->time_ns          = __atomic_load_n(&slot_p->time_ns, __ATOMIC_RELAXED);
+			entry_p->cycles           = __atomic_load_n(&slot_p->counts[PERF_CYCLES],       __ATOMIC_RELAXED);
+			entry_p->instructions     = __atomic_load_n(&slot_p->counts[PERF_INSTRUCTIONS], __ATOMIC_RELAXED);
+			entry_p->llc_misses       = __atomic_load_n(&slot_p->counts[PERF_LLC_MISSES],   __ATOMIC_RELAXED);
+			entry_p->context_switches = __atomic_load_n(&slot_p->counts[PERF_CSWITCHES],    __ATOMIC_RELAXED);
+		}
+	}
+	qsort(all, count, sizeof(thpool_perf_entry), perf_by_key);
+	int merged = 0;
+	for (n = 0; n < count; n++){
+		if (merged && perf_by_key(&all[merged - 1], &all[n]) == 0){
+			thpool_perf_entry* dst_p = &all[merged - 1];
+			dst_p->jobs             += all[n].jobs;
+			dst_p->time_ns          += all[n].time_ns;
+			dst_p->cycles           += all[n].cycles;
+			dst_p->instructions     += all[n].instructions;
+			dst_p->llc_misses       += all[n].llc_misses;
+			dst_p->context_switches += all[n].context_switches;
+			continue;
+		}
+		if (n != merged) all[merged] = all[n];
+		merged++;
+	}
+	qsort(all, merged, sizeof(thpool_perf_entry), perf_by_time);
+
+	if (merged > max_entries) merged = max_entries;
+	memcpy(entries, all, merged * sizeof(thpool_perf_entry));
+	free(all);
+	return merged;
+}
+
+
+/* Workers counting with hardware counters */
+int thpool_perf_available(thpool_* thpool_p){
+	if (!thpool_p->config.perf_counters) return -1;
+	int available = 0, n;
+	for (n = 0; n < thpool_p->num_threads_alive; n++){
+		perfcounters* perf_p = thpool_p->threads[n]->perf;
+		if (perf_p && perf_p->hw) available++;
+	}
+	return available;
+}
+
+
+/* ============================== SLO =============================== */
+
+
+#ifndef THPOOL_NO_STATS
+/* Account a queue wait to the SLO class of the job, if any */
+static void slo_record(thread* thread_p, uintptr_t tag, uint64_t wait_ns){
+	const thpool_* thpool_p = thread_p->thpool_p;
+	int n;
+	for (n = 0; n < thpool_p->config.slo_count; n++){
+		if (thpool_p->slos[n].tag == tag){
+			hist_record(&thread_p->slo_hist[n], wait_ns);
+			return;
+		}
+	}
+}
+
+
+/* Value below which percentile of a decayed histogram falls */
+static uint64_t slo_percentile(const double* buckets, double total, double percentile){
+	if (total < 1.0) return 0;           /* less than a job left      */
+	double rank = percentile / 100.0 * total;
+	double seen = 0.0;
+	int n;
+	for (n = 0; n < HIST_BUCKETS; n++){
+		seen += buckets[n];
+		if (seen >= rank && seen > 0.0) return hist_upper(n);
+	}
+	return hist_upper(HIST_BUCKETS - 1);
+}
+
+
+/* Roll every class window forward by one tick and check its SLO
+ *
+ * The window decays by 1/slo_window_ticks per tick, so a wait counts
+ * fully when it happens and fades out over about that many ticks. A class
+ * without traffic empties out and so meets its SLO again.
+ */
+static void slo_check(thpool_* thpool_p){
+	int window = thpool_p->config.slo_window_ticks > 0 ? thpool_p->config.slo_window_ticks : 10;
+	double keep = 1.0 - 1.0 / (double)window;
+	histogram* merged_p = &thpool_p->slo_merged;
+	int s, n, b;
+	for (s = 0; s < thpool_p->config.slo_count; s++){
+		slostate* state_p = &thpool_p->slo_state[s];
+		memset(merged_p, 0, sizeof(histogram));
+		for (n = 0; n < thpool_p->num_threads_alive; n++){
+			hist_merge(merged_p, &thpool_p->threads[n]->slo_hist[s]);
+		}
+		double total = 0.0;
+		for (b = 0; b < HIST_BUCKETS; b++){
+			uint64_t now = merged_p->buckets[b];
+			uint64_t delta = now > state_p->last[b] ? now - state_p->last[b] : 0;
+			state_p->last[b] = now;
+			state_p->window[b] = state_p->window[b] * keep + (double)delta;
+			total += state_p->window[b];
+		}
+
+		const thpool_slo* slo_p = &thpool_p->slos[s];
+		uint64_t value = slo_percentile(state_p->window, total, slo_p->percentile);
+		__atomic_store_n(&state_p->p50, slo_percentile(state_p->window, total, 50.0), __ATOMIC_RELAXED);
+		__atomic_store_n(&state_p->p99, slo_percentile(state_p->window, total, 99.0), __ATOMIC_RELAXED);
+
+		int breached = value > slo_p->max_wait_ns;
+		if (breached != state_p->breached){
+			__atomic_store_n(&state_p->breached, breached, __ATOMIC_RELAXED);
+			if (thpool_p->config.on_slo){
+				thpool_p->config.on_slo(s, slo_p->tag, value, breached, thpool_p->config.hook_arg);
+			}
+		}
+	}
+}
+#endif
+
+
+/* Rolling queue wait of an SLO class as of the last monitor tick */
+int thpool_slo_status(thpool_* thpool_p, int slo, uint64_t* p50_ns, uint64_t* p99_ns){
+	if (slo < 0 || slo >= thpool_p->config.slo_count || thpool_p->slo_state == NULL) return -1;
+	slostate* state_p = &thpool_p->slo_state[slo];
+	if (p50_ns) *p50_ns = __atomic_load_n(&state_p->p50, __ATOMIC_RELAXED);
+	if (p99_ns) *p99_ns = __atomic_load_n(&state_p->p99, __ATOMIC_RELAXED);
+	return __atomic_load_n(&state_p->breached, __ATOMIC_RELAXED);
+}
+
+
+/* ============================ MONITOR ============================= */
+
+
+#define WATCHDOG_REPLY_MS 100            /* wait for a stack this long */
+
+#ifdef LINUX
+/* Each pool uses its own config.watchdog_signal; the handler goes in once
+ * per distinct signal and stays, chained to the handler it replaced */
+static pthread_mutex_t  watchdog_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool             watchdog_installed[_NSIG];
+static struct sigaction watchdog_previous[_NSIG];
+
+
+/* Runs on the stuck worker, records where it is; signals the watchdog
+ * did not ask for go to the previous handler */
+static void watchdog_handler(int sig_id, siginfo_t* info_p, void* context_p){
+	thread* thread_p = thread_self;
+	if (thread_p && __atomic_load_n(&thread_p->stack_depth, __ATOMIC_ACQUIRE) == -1){
+		int saved_errno = errno;
+		int depth = backtrace(thread_p->stack_frames, WATCHDOG_FRAMES);
+		__atomic_store_n(&thread_p->stack_depth, depth, __ATOMIC_RELEASE);
+		errno = saved_errno;
+		return;
+	}
+	struct sigaction* previous_p = &watchdog_previous[sig_id];
+	if (previous_p->sa_flags & SA_SIGINFO){
+		previous_p->sa_sigaction(sig_id, info_p, context_p);
+	} else if (previous_p->sa_handler != SIG_DFL && previous_p->sa_handler != SIG_IGN){
+		previous_p->sa_handler(sig_id);
+	}
+}
+
+
+static int watchdog_install(int sig){
+	if (sig <= 0 || sig >= _NSIG) return -1;
+	pthread_mutex_lock(&watchdog_lock);
+	if (!watchdog_installed[sig]){
+		/* backtrace() loads libgcc on first use, not in a signal handler */
+		void* frames[1];
+		backtrace(frames, 1);
+
+		struct sigaction act;
+		memset(&act, 0, sizeof(act));
+		act.sa_sigaction = watchdog_handler;
+		sigemptyset(&act.sa_mask);
+		act.sa_flags = SA_RESTART | SA_SIGINFO;
+		watchdog_installed[sig] = sigaction(sig, &act, &watchdog_previous[sig]) == 0;
+	}
+	bool installed = watchdog_installed[sig];
+	pthread_mutex_unlock(&watchdog_lock);
+	return installed ? 0 : -1;
+}
+#endif
+
+
+/* Report a worker whose job runs past the threshold */
+static void watchdog_fire(thpool_* thpool_p, thread* thread_p, void (*function_p)(void*), uint64_t running_ns){
+	int depth = 0;
+#ifdef LINUX
+	__atomic_store_n(&thread_p->stack_depth, -1, __ATOMIC_RELEASE);
+	if (pthread_kill(thread_p->pthread, thpool_p->config.watchdog_signal) == 0){
+		int waited;
+		for (waited = 0; waited < WATCHDOG_REPLY_MS; waited++){
+			if (__atomic_load_n(&thread_p->stack_depth, __ATOMIC_ACQUIRE) >= 0) break;
+			DO_SLEEP1ms;
+		}
+	}
+	depth = __atomic_load_n(&thread_p->stack_depth, __ATOMIC_ACQUIRE);
+	if (depth < 0){
+		/* no reply, later signals are not the watchdog's */
+		__atomic_store_n(&thread_p->stack_depth, 0, __ATOMIC_RELAXED);
+		depth = 0;
+	}
+#endif
+
+	if (thpool_p->config.on_stuck){
+		thpool_p->config.on_stuck(thread_p->id, function_p, running_ns,
+		                          thread_p->stack_frames, depth, thpool_p->config.hook_arg);
+		return;
+	}
+	fprintf(stderr, "thpool: worker %s-%d stuck in job %p for %llu ms\n", thpool_p->name, thread_p->id,
+	        (void*)function_p, (unsigned long long)(running_ns / 1000000));
+#ifdef LINUX
+	if (depth) backtrace_symbols_fd(thread_p->stack_frames, depth, 2);
+#endif
+}
+
+
+/* Check every worker's current job against the threshold */
+static void watchdog_check(thpool_* thpool_p){
+	uint64_t threshold = (uint64_t)thpool_p->config.watchdog_ms * 1000000ull;
+	uint64_t now = thpool_p->jobqueue.now();
+	int n;
+	for (n = 0; n < thpool_p->num_threads_alive; n++){
+		thread* thread_p = thpool_p->threads[n];
+		uint64_t started = __atomic_load_n(&thread_p->job_started, __ATOMIC_ACQUIRE);
+		void (*function_p)(void*) = __atomic_load_n(&thread_p->job_function, __ATOMIC_RELAXED);
+		/* each job is reported once */
+		if (started == 0 || started == thread_p->stuck_reported) continue;
+		if (now < started || now - started < threshold) continue;
+		thread_p->stuck_reported = started;
+		watchdog_fire(thpool_p, thread_p, function_p, now - started);
+	}
+}
+
+
+/* Background thread of a pool, runs the periodic checks */
+static void* monitor_do(void* p0){
+	thpool_* thpool_p = (thpool_*)p0;
+
+	char thread_name[32] = {0};
+	snprintf(thread_name, sizeof(thread_name), "%s-mon", thpool_p->name);
+	thread_name[15] = 0;
+#if defined(__linux__)
+	pthread_setname_np(pthread_self(), thread_name);
+#endif
+
+	int interval_ms = thpool_p->config.monitor_interval_ms > 0 ? thpool_p->config.monitor_interval_ms : 100;
+	pthread_mutex_lock(&thpool_p->monitor_lock);
+	while (!thpool_p->monitor_stop){
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec  += interval_ms / 1000;
+		until.tv_nsec += (long)(interval_ms % 1000) * 1000000L;
+		if (until.tv_nsec >= 1000000000L){
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&thpool_p->monitor_wake, &thpool_p->monitor_lock, &until);
+		if (thpool_p->monitor_stop) break;
+		pthread_mutex_unlock(&thpool_p->monitor_lock);
+
+		if (thpool_p->config.watchdog_ms > 0) watchdog_check(thpool_p);
+#ifndef THPOOL_NO_STATS
+		if (thpool_p->slo_state) slo_check(thpool_p);
+#endif
+
+		pthread_mutex_lock(&thpool_p->monitor_lock);
+	}
+	pthread_mutex_unlock(&thpool_p->monitor_lock);
+	return NULL;
+}
+
+
+/* Start the monitor thread if the configuration needs one */
+static int monitor_start(thpool_* thpool_p){
+	if (thpool_p->config.watchdog_ms <= 0 && thpool_p->config.slo_count == 0) return 0;
+
+	if (thpool_p->config.slo_count && thpool_p->slo_state == NULL){
+		thpool_p->slo_state = (slostate*)calloc(thpool_p->config.slo_count, sizeof(slostate));
+		if (thpool_p->slo_state == NULL){
+			err("thpool_init(): Could not allocate memory for SLO windows\n");
+			return -1;
+		}
 	}
 
-	/* Job queue cleanup */
-	jobqueue_destroy(&thpool_p->jobqueue);
-	/* Deallocs */
-	int n;
-	for (n=0; n < threads_total; n++){
-		thread_destroy(thpool_p->threads[n]);
+#ifdef LINUX
+	if (thpool_p->config.watchdog_ms > 0){
+		if (thpool_p->config.watchdog_signal == 0) thpool_p->config.watchdog_signal = SIGURG;
+		if (watchdog_install(thpool_p->config.watchdog_signal) == -1){
+			err("thpool_init(): Could not install the watchdog signal handler\n");
+			return -1;
+		}
 	}
-	if (thpool_p->thcount_lock_inzed) pthread_mutex_destroy(&(thpool_p->thcount_lock));
-    if (thpool_p->threads_all_idle_inzed) pthread_cond_destroy(&(thpool_p->threads_all_idle));
-	free(thpool_p->threads);
-	free(thpool_p);
+#endif
+	thpool_p->monitor_lock_inzed = pthread_mutex_init(&thpool_p->monitor_lock, NULL) == 0;
+	thpool_p->monitor_wake_inzed = pthread_cond_init(&thpool_p->monitor_wake, NULL) == 0;
+	thpool_p->monitor_stop = 0;
+	if (pthread_create(&thpool_p->monitor, NULL, monitor_do, thpool_p) != 0){
+		err("thpool_init(): Could not start monitor thread\n");
+		return -1;
+	}
+	thpool_p->monitor_running = true;
+	return 0;
 }
 
 
-/* Pause all threads in threadpool */
-void thpool_pause(thpool_* thpool_p) {
+/* Stop and join the monitor thread */
+static void monitor_stop(thpool_* thpool_p){
+	if (thpool_p->monitor_running){
+		pthread_mutex_lock(&thpool_p->monitor_lock);
+		thpool_p->monitor_stop = 1;
+		pthread_cond_signal(&thpool_p->monitor_wake);
+		pthread_mutex_unlock(&thpool_p->monitor_lock);
+		pthread_join(thpool_p->monitor, NULL);
+		thpool_p->monitor_running = false;
+	}
+	if (thpool_p->monitor_wake_inzed) pthread_cond_destroy(&thpool_p->monitor_wake);
+	if (thpool_p->monitor_lock_inzed) pthread_mutex_destroy(&thpool_p->monitor_lock);
+	thpool_p->monitor_wake_inzed = false;
+	thpool_p->monitor_lock_inzed = false;
+	if (!thpool_p->is_static) free(thpool_p->slo_state);
+	thpool_p->slo_state = NULL;
 }
 
 
-/* Resume all threads in threadpool */
-void thpool_resume(thpool_* thpool_p) {
+/* Broadcast adapter of thpool_run_on_each() */
+typedef struct spmd_call{
+	void (*function)(int worker_id, int num_workers, void* arg);
+	void*  arg;
+	int    num_workers;
+} spmd_call;
+
+static void spmd_run(void* p0){
+	spmd_call* call_p = (spmd_call*)p0;
+	call_p->function(thpool_worker_id(), call_p->num_workers, call_p->arg);
 }
 
 
-int thpool_num_threads_working(thpool_* thpool_p){
-	return thpool_p->num_threads_working;
+/* Run one (long) job on every worker, SPMD style */
+int thpool_run_on_each(thpool_* thpool_p, void (*function_p)(int, int, void*), void* arg_p){
+	spmd_call call;
+	call.function    = function_p;
+	call.arg         = arg_p;
+	call.num_workers = thpool_p->num_threads_alive;
+	return thpool_broadcast(thpool_p, spmd_run, &call);
 }
 
 
@@ -376,6 +3170,52 @@ int stick_this_thread_to_core(pthread_t thread_p, int core_id) {
 #endif // LINUX
 }
 
+/* Start the pthread of a thread
+ *
+ * Stack, scheduling class and cpu affinity from the pool configuration are
+ * set on the thread attributes, so they apply before the thread runs.
+ *
+ * @return pthread_create() result
+ */
+static int thread_spawn(struct thread* thread_p, int cpu){
+	const thpool_config* config_p = &thread_p->thpool_p->config;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+
+	if (config_p->stack_region && config_p->stack_size){
+		pthread_attr_setstack(&attr, (char*)config_p->stack_region + (size_t)thread_p->id * config_p->stack_size,
+		                      config_p->stack_size);
+	} else {
+		if (config_p->stack_size) pthread_attr_setstacksize(&attr, config_p->stack_size);
+		if (config_p->guard_size) pthread_attr_setguardsize(&attr, config_p->guard_size);
+	}
+
+	if (config_p->sched_policy != THPOOL_SCHED_INHERIT){
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = config_p->sched_priority;
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, config_p->sched_policy);
+		pthread_attr_setschedparam(&attr, &param);
+	}
+
+#ifdef LINUX
+	if (cpu >= 0 && cpu < CPU_SETSIZE) {
+		cpu_set_t cpuset;
+		CPU_ZERO(&cpuset);
+		CPU_SET(cpu, &cpuset);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpuset);
+	}
+#else
+	(void)cpu;
+#endif
+
+	int rc = pthread_create(&thread_p->pthread, &attr, thread_do, thread_p);
+	pthread_attr_destroy(&attr);
+	return rc;
+}
+
+
 /* Initialize a thread in the thread pool
  *
  * @param thread        address to the pointer of the thread to be created
@@ -385,19 +3225,64 @@ int stick_this_thread_to_core(pthread_t thread_p, int core_id) {
  */
 static int thread_init (thpool_* thpool_p, struct thread** thread_p, int id, int preffed_cpu){
 
-	*thread_p = (struct thread*)malloc(sizeof(struct thread));
-	if (thread_p == NULL){
+	/* static pools hand in a preplaced thread */
+	if (!thpool_p->is_static){
+		*thread_p = (struct thread*)malloc(sizeof(struct thread));
+		if (*thread_p != NULL) scratch_init(&(*thread_p)->scratch, NULL);
+	}
+	if (*thread_p == NULL){
 		err("thread_init(): Could not allocate memory for thread\n");
 		return -1;
 	}
 
 	(*thread_p)->thpool_p       = thpool_p;
 	(*thread_p)->id             = id;
+	memset((*thread_p)->tls, 0, sizeof((*thread_p)->tls));
+	(*thread_p)->mbox_front     = NULL;
+	(*thread_p)->mbox_rear      = NULL;
+	(*thread_p)->mbox_len       = 0;
+	(*thread_p)->mbox_lock_inzed = pthread_mutex_init(&(*thread_p)->mbox_lock, NULL) == 0;
+	memset(&(*thread_p)->stats, 0, sizeof(workerstats));
+	(*thread_p)->trace          = NULL;
+	(*thread_p)->perf           = NULL;
+	(*thread_p)->job_started    = 0;
+	(*thread_p)->job_function   = NULL;
+	(*thread_p)->stuck_reported = 0;
+	(*thread_p)->stack_depth    = 0;
+	(*thread_p)->state          = WORKER_SPINNING;
+#ifndef THPOOL_NO_STATS
+	memset(&(*thread_p)->queue_hist, 0, sizeof(histogram));
+	memset(&(*thread_p)->exec_hist, 0, sizeof(histogram));
+	memset(&(*thread_p)->profile, 0, sizeof((*thread_p)->profile));
+	(*thread_p)->profile_dropped = 0;
+	(*thread_p)->slo_hist = NULL;
+	if (thpool_p->static_slo_hist){
+		(*thread_p)->slo_hist = thpool_p->static_slo_hist + (size_t)id * thpool_p->config.slo_count;
+	} else if (thpool_p->config.slo_count){
+		(*thread_p)->slo_hist = (histogram*)calloc(thpool_p->config.slo_count, sizeof(histogram));
+		if ((*thread_p)->slo_hist == NULL){
+			err("thread_init(): Could not allocate memory for SLO histograms\n");
+			thread_destroy(*thread_p);
+			return -1;
+		}
+	}
+#endif
 
-	pthread_create(&(*thread_p)->pthread, NULL, thread_do, (*thread_p));
+	/* a cpu the process may not run on fails pthread_create, then go without */
+	int rc = thread_spawn(*thread_p, preffed_cpu);
+	if (rc == EINVAL && preffed_cpu >= 0){
+		rc = thread_spawn(*thread_p, -1);
+	}
+	if (rc != 0){
+		err("thread_init(): Could not create thread\n");
+		thread_destroy(*thread_p);
+		return -1;
+	}
+#ifndef LINUX
 	if (preffed_cpu >= 0) {
         stick_this_thread_to_core((*thread_p)->pthread, preffed_cpu);
 	}
+#endif
 	pthread_detach((*thread_p)->pthread);
 	return 0;
 }
@@ -423,78 +3308,360 @@ static void thread_hold(int sig_id) {
 */
 static void* thread_do(void * p0){
 	struct thread* thread_p = (struct thread*)p0;
+	thpool_* thpool_p = thread_p->thpool_p;
+
 	/* Set thread name for profiling and debuging */
-	//char thread_name[128] = {0};
-	//AddLog(thread_name, "thread-pool-%d", thread_p->id);
+	char thread_name[32] = {0};
+	snprintf(thread_name, sizeof(thread_name), "%s-%d", thpool_p->name, thread_p->id);
+	thread_name[15] = 0;                 /* system limit              */
 
 #if defined(__linux__)
-	/* Use prctl instead to prevent using _GNU_SOURCE flag and implicit declaration */
-	#ifdef _ANDROID_COMPILER_
-	prctl(PR_SET_NAME, thread_name);
-	#endif
+	if (thread_name[0] != '-') pthread_setname_np(pthread_self(), thread_name);
 #elif defined(__APPLE__) && defined(__MACH__)
-	pthread_setname_np(thread_name);
+	if (thread_name[0] != '-') pthread_setname_np(thread_name);
 #else
 	//err("thread_do(): pthread_setname_np is not supported on this system");
 #endif
 
-	/* Assure all threads have been created before starting serving */
-	thpool_* thpool_p = thread_p->thpool_p;
+#ifdef LINUX
+	/* nice is per thread on Linux and has no pthread attribute */
+	if (thpool_p->config.nice && thpool_p->config.sched_policy == THPOOL_SCHED_INHERIT){
+		setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), thpool_p->config.nice);
+	}
+#endif
+
+#ifdef LINUX
+	/* counters count the thread that opens them */
+	if (thpool_p->config.perf_counters){
+		perfcounters* table_p = thpool_p->static_perf ? &thpool_p->static_perf[thread_p->id] : NULL;
+		__atomic_store_n(&thread_p->perf, perf_init(table_p), __ATOMIC_RELEASE);
+	}
+#endif
+	perfcounters* perf_p = thread_p->perf;
+	bool watched = thpool_p->config.watchdog_ms > 0;
 
+	/* Assure all threads have been created before starting serving */
+	thread_self = thread_p;
+	scratch* scratch_p = &thread_p->scratch;
+	workerstats* stats_p = &thread_p->stats;
+	bool group_scope = thpool_p->config.scratch_scope == THPOOL_SCRATCH_GROUP;
+
+	/* Per worker setup, done before thpool_init() returns */
+	if (thpool_p->config.on_worker_start){
+		thpool_p->config.on_worker_start(thread_p->id, thpool_p->config.hook_arg);
+	}
 
 	/* Mark thread as alive (initialized) */
-	pthread_mutex_lock(&thpool_p->thcount_lock);
+	LOCK(&thpool_p->thcount_lock, &thpool_p->locks[THPOOL_LOCK_COUNT]);
 	thpool_p->num_threads_alive += 1;
-	pthread_mutex_unlock(&thpool_p->thcount_lock);
+	UNLOCK(&thpool_p->thcount_lock, &thpool_p->locks[THPOOL_LOCK_COUNT]);
+
+	uint64_t idle_since = STATS_NOW(thpool_p);
+	(void)stats_p; (void)idle_since;
 
 	while(thpool_p->threads_keepalive){
 
-		bsem_wait(thpool_p->jobqueue.has_jobs);
+		bool tracing = __atomic_load_n(&thpool_p->tracing, __ATOMIC_RELAXED) != 0;
+		uint64_t parked = tracing ? thpool_p->jobqueue.now() : 0;
+		__atomic_store_n(&thread_p->state, WORKER_PARKED, __ATOMIC_RELAXED);
+		int sleeps = bsem_wait_or(thpool_p->jobqueue.has_jobs, &thread_p->mbox_len);
+		__atomic_store_n(&thread_p->state, WORKER_SPINNING, __ATOMIC_RELAXED);
+		if (sleeps) {
+			STATS_ADD(stats_p, parks, 1);
+			STATS_ADD(stats_p, wakes, sleeps);
+			if (tracing) trace_record(thread_p, TRACE_PARK, NULL, parked, thpool_p->jobqueue.now(), 0);
+		}
 
 		if (thpool_p->threads_keepalive){
 
-			pthread_mutex_lock(&thpool_p->thcount_lock);
+			LOCK(&thpool_p->thcount_lock, &thpool_p->locks[THPOOL_LOCK_COUNT]);
 			thpool_p->num_threads_working++;
-			pthread_mutex_unlock(&thpool_p->thcount_lock);
+			UNLOCK(&thpool_p->thcount_lock, &thpool_p->locks[THPOOL_LOCK_COUNT]);
+
+			/* Broadcasts go in between jobs */
+			thread_read_mail(thread_p);
 
-			/* Read job from queue and execute it */
+			/* Read job from queue and execute it; a wake for mail alone
+			 * leaves has_jobs down and there is nothing to pull, a job
+			 * queued meanwhile posts it for the next bsem_wait_or() */
 			void (*func_buff)(void*);
 			void*  arg_buff;
-			job* job_p = jobqueue_pull(&thpool_p->jobqueue);
+			bool pull = __atomic_load_n(&thpool_p->jobqueue.has_jobs->v, __ATOMIC_ACQUIRE) != 0;
+			job* job_p = pull ? jobqueue_pull(&thpool_p->jobqueue) : NULL;
 			if (job_p) {
+				/* a group scope ends when a job of another group comes;
+				 * groups go by generation, a freed decsemaphore's
+				 * address comes back with the next one */
+				uint64_t group = job_p->signal_ ? job_p->signal_->generation : 0;
+				if (scratch_p->group && scratch_p->group != group) {
+					scratch_reset(scratch_p);
+				}
 				func_buff = job_p->function;
 				arg_buff  = job_p->arg;
+				tracing = __atomic_load_n(&thpool_p->tracing, __ATOMIC_RELAXED) != 0;
+				uint64_t started = 0;
+				uint64_t counters[2][PERF_COUNTERS];
+				/* for the watchdog and state dumps */
+				__atomic_store_n(&thread_p->job_function, func_buff, __ATOMIC_RELAXED);
+				__atomic_store_n(&thread_p->state, WORKER_RUNNING, __ATOMIC_RELEASE);
+				if (STATS_ON || tracing || perf_p || watched) {
+					started = thpool_p->jobqueue.now();
+					STATS_ADD(stats_p, idle_ns, started - idle_since);
+					__atomic_store_n(&thread_p->job_started, started, __ATOMIC_RELEASE);
+				}
+#ifndef THPOOL_NO_STATS
+				uint64_t waited = started > job_p->enqueued ? started - job_p->enqueued : 0;
+				hist_record(&thread_p->queue_hist, waited);
+				if (thread_p->slo_hist) slo_record(thread_p, job_p->tag, waited);
+#endif
+#ifdef LINUX
+				if (perf_p) perf_sample(perf_p, counters[0]);
+#endif
 				func_buff(arg_buff);
+#ifdef LINUX
+				if (perf_p) perf_sample(perf_p, counters[1]);
+#endif
+				if (STATS_ON || tracing || perf_p || watched) {
+					uint64_t ended = thpool_p->jobqueue.now();
+					__atomic_store_n(&thread_p->job_started, 0, __ATOMIC_RELAXED);
+					STATS_ADD(stats_p, busy_ns, ended - started);
+					STATS_ADD(stats_p, jobs, 1);
+#ifndef THPOOL_NO_STATS
+					hist_record(&thread_p->exec_hist, ended - started);
+					profile_record(thread_p, func_buff, ended - started, waited);
+#endif
+					if (tracing) trace_record(thread_p, TRACE_JOB, func_buff, started, ended, job_p->enqueued);
+					if (perf_p) perf_record(perf_p, job_p, ended - started, counters[0], counters[1]);
+					idle_since = ended;
+				}
+				__atomic_store_n(&thread_p->state, WORKER_SPINNING, __ATOMIC_RELAXED);
+				if (group_scope && job_p->signal_) {
+					scratch_p->group = group;
+				} else if (scratch_p->in_use) {
+					scratch_reset(scratch_p);
+				}
 				if (job_p->signal_) {
 					dec_bsem_post(job_p->signal_);
 				}
-				free(job_p);
+				job_free(&thpool_p->jobslab, job_p);
+			} else if (pull) {
+				STATS_ADD(stats_p, empty_pulls, 1);
 			}
 
-			pthread_mutex_lock(&thpool_p->thcount_lock);
+			LOCK(&thpool_p->thcount_lock, &thpool_p->locks[THPOOL_LOCK_COUNT]);
 			thpool_p->num_threads_working--;
 			if (!thpool_p->num_threads_working) {
 				pthread_cond_signal(&thpool_p->threads_all_idle);
 			}
-			pthread_mutex_unlock(&thpool_p->thcount_lock);
+			UNLOCK(&thpool_p->thcount_lock, &thpool_p->locks[THPOOL_LOCK_COUNT]);
 
             DO_SLEEP0ms;
 		}
 	}
-	pthread_mutex_lock(&thpool_p->thcount_lock);
+	if (thpool_p->config.on_worker_stop){
+		thpool_p->config.on_worker_stop(thread_p->id, thpool_p->config.hook_arg);
+	}
+	scratch_destroy(scratch_p);
+#ifdef LINUX
+	if (perf_p) perf_close(perf_p);
+#endif
+	thread_self = NULL;
+
+	LOCK(&thpool_p->thcount_lock, &thpool_p->locks[THPOOL_LOCK_COUNT]);
 	thpool_p->num_threads_alive --;
-	pthread_mutex_unlock(&thpool_p->thcount_lock);
+	UNLOCK(&thpool_p->thcount_lock, &thpool_p->locks[THPOOL_LOCK_COUNT]);
 
 	return NULL;
 }
 
 
+/* Id of the calling worker */
+int thpool_worker_id(void){
+	thread* thread_p = thread_self;
+	return thread_p ? thread_p->id : -1;
+}
+
+
+/* Per worker slot of the calling worker */
+void* thpool_tls_get(int slot){
+	thread* thread_p = thread_self;
+	if (thread_p == NULL || slot < 0 || slot >= THPOOL_TLS_SLOTS) return NULL;
+	return thread_p->tls[slot];
+}
+
+
+int thpool_tls_set(int slot, void* value){
+	thread* thread_p = thread_self;
+	if (thread_p == NULL || slot < 0 || slot >= THPOOL_TLS_SLOTS) return -1;
+	thread_p->tls[slot] = value;
+	return 0;
+}
+
+
 /* Frees a thread  */
 static void thread_destroy (thread* thread_p){
+	if (thread_p->mbox_lock_inzed) pthread_mutex_destroy(&thread_p->mbox_lock);
+	/* a static pool's tables are in the caller's buffer */
+	if (thread_p->thpool_p->is_static) return;
+	free(thread_p->trace);
+	free(thread_p->perf);
+#ifndef THPOOL_NO_STATS
+	free(thread_p->slo_hist);
+#endif
 	free(thread_p);
 }
 
 
+/* Drop a letter in a worker's mailbox */
+static void thread_post_mail(thread* thread_p, mail* mail_p){
+	mail_p->next = NULL;
+	pthread_mutex_lock(&thread_p->mbox_lock);
+	if (thread_p->mbox_rear) thread_p->mbox_rear->next = mail_p;
+	else                     thread_p->mbox_front = mail_p;
+	thread_p->mbox_rear = mail_p;
+	__atomic_add_fetch(&thread_p->mbox_len, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&thread_p->mbox_lock);
+}
+
+
+/* Run every letter in the calling worker's mailbox
+ *
+ * The letters belong to the broadcaster, which may return as soon as the
+ * last one has been counted down.
+ */
+static void thread_read_mail(thread* thread_p){
+	while (__atomic_load_n(&thread_p->mbox_len, __ATOMIC_ACQUIRE)){
+		pthread_mutex_lock(&thread_p->mbox_lock);
+		mail* mail_p = thread_p->mbox_front;
+		if (mail_p){
+			thread_p->mbox_front = mail_p->next;
+			if (thread_p->mbox_front == NULL) thread_p->mbox_rear = NULL;
+			__atomic_sub_fetch(&thread_p->mbox_len, 1, __ATOMIC_RELAXED);
+		}
+		pthread_mutex_unlock(&thread_p->mbox_lock);
+		if (mail_p == NULL) break;
+
+		bool tracing = __atomic_load_n(&thread_p->thpool_p->tracing, __ATOMIC_RELAXED) != 0;
+		void (*func_buff)(void*) = mail_p->function;
+		uint64_t started = tracing ? thread_p->thpool_p->jobqueue.now() : 0;
+		func_buff(mail_p->arg);
+		if (tracing) trace_record(thread_p, TRACE_MAIL, func_buff, started, thread_p->thpool_p->jobqueue.now(), 0);
+		dec_bsem_post(mail_p->done);
+		STATS_ADD(&thread_p->stats, broadcasts, 1);
+	}
+}
+
+
+/* ============================ SCRATCH ============================= */
+
+
+#define SCRATCH_ALIGN        16
+#define SCRATCH_SHRINK_EVERY 64      /* resets per high-water window    */
+
+
+/* Initialize an arena, optionally around a chunk it must never free */
+static void scratch_init(scratch* scratch_p, scratchchunk* fixed_p){
+	memset(scratch_p, 0, sizeof(scratch));
+	if (fixed_p){
+		fixed_p->next = NULL;
+		fixed_p->used = 0;
+		scratch_p->spare = fixed_p;
+		scratch_p->held  = fixed_p->size;
+	}
+}
+
+
+/* Release chunks held beyond twice the high-water mark of the window */
+static void scratch_shrink(scratch* scratch_p){
+	size_t keep = 2 * scratch_p->window_peak;
+	scratchchunk** link = &scratch_p->spare;
+	while (*link && scratch_p->held > keep){
+		scratchchunk* chunk = *link;
+		if (chunk->fixed){
+			link = &chunk->next;
+			continue;
+		}
+		*link = chunk->next;
+		scratch_p->held -= chunk->size;
+		free(chunk);
+	}
+	scratch_p->window_peak = 0;
+	scratch_p->resets = 0;
+}
+
+
+/* Recycle every chunk, all memory handed out is dead after this */
+static void scratch_reset(scratch* scratch_p){
+	scratchchunk* chunk = scratch_p->active;
+	while (chunk){
+		scratchchunk* next = chunk->next;
+		chunk->used = 0;
+		chunk->next = scratch_p->spare;
+		scratch_p->spare = chunk;
+		chunk = next;
+	}
+	scratch_p->active = NULL;
+	if (scratch_p->in_use > scratch_p->window_peak) scratch_p->window_peak = scratch_p->in_use;
+	scratch_p->in_use = 0;
+	scratch_p->group  = 0;
+	if (++scratch_p->resets >= SCRATCH_SHRINK_EVERY) scratch_shrink(scratch_p);
+}
+
+
+/* Free all chunks not owned by a static pool */
+static void scratch_destroy(scratch* scratch_p){
+	scratch_reset(scratch_p);
+	scratchchunk* chunk = scratch_p->spare;
+	while (chunk){
+		scratchchunk* next = chunk->next;
+		if (!chunk->fixed) free(chunk);
+		chunk = next;
+	}
+	scratch_p->spare = NULL;
+	scratch_p->held  = 0;
+}
+
+
+/* Allocate from the arena of the calling worker */
+void* thpool_scratch_alloc(size_t size){
+	thread* thread_p = thread_self;
+	if (thread_p == NULL) return NULL;
+	scratch* scratch_p = &thread_p->scratch;
+
+	size = (size + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+	scratchchunk* chunk = scratch_p->active;
+	if (chunk == NULL || chunk->size - chunk->used < size){
+		/* take the first spare chunk big enough, else make one */
+		scratchchunk** link = &scratch_p->spare;
+		while (*link && (*link)->size < size) link = &(*link)->next;
+		if (*link){
+			chunk = *link;
+			*link = chunk->next;
+		} else {
+			if (thread_p->thpool_p->is_static) return NULL;
+			size_t chunk_size = thread_p->thpool_p->config.scratch_chunk_size;
+			if (chunk_size < size) chunk_size = size;
+			chunk = (struct scratchchunk*)malloc(THPOOL_ALIGN_UP(sizeof(struct scratchchunk)) + chunk_size);
+			if (chunk == NULL) return NULL;
+			chunk->size  = chunk_size;
+			chunk->fixed = false;
+			scratch_p->held += chunk_size;
+		}
+		chunk->used = 0;
+		chunk->next = scratch_p->active;
+		scratch_p->active = chunk;
+	}
+
+	void* mem = (char*)chunk + THPOOL_ALIGN_UP(sizeof(struct scratchchunk)) + chunk->used;
+	chunk->used += size;
+	scratch_p->in_use += size;
+	return mem;
+}
+
+
+
+
+
 /* ============================ JOB QUEUE =========================== */
 
 
@@ -504,11 +3671,9 @@ static int jobqueue_init(jobqueue* jobqueue_p){
 	jobqueue_p->front = NULL;
 	jobqueue_p->rear  = NULL;
 	jobqueue_p->rwmutex_inzed = NULL;
+	jobqueue_p->lockstat = NULL;
 
-	jobqueue_p->has_jobs = (struct bsem*)malloc(sizeof(struct bsem));
-	if (jobqueue_p->has_jobs == NULL){
-		return -1;
-	}
+	jobqueue_p->has_jobs = &jobqueue_p->has_jobs_sem;
 
 	jobqueue_p->rwmutex_inzed = pthread_mutex_init(&(jobqueue_p->rwmutex), NULL) == 0;
 	bsem_init(jobqueue_p->has_jobs, 0);
@@ -517,11 +3682,15 @@ static int jobqueue_init(jobqueue* jobqueue_p){
 }
 
 
-/* Clear the queue */
+/* Clear the queue
+ *
+ * The jobs themselves belong to the slab, only argument copies are freed.
+ */
 static void jobqueue_clear(jobqueue* jobqueue_p){
 
 	while(jobqueue_p->len){
-		free(jobqueue_pull(jobqueue_p));
+		job* job_p = jobqueue_pull(jobqueue_p);
+		if (job_p && job_p->owned) free(job_p->owned);
 	}
 
 	jobqueue_p->front = NULL;
@@ -536,7 +3705,12 @@ static void jobqueue_clear(jobqueue* jobqueue_p){
  */
 static void jobqueue_push(jobqueue* jobqueue_p, struct job* newjob){
 
-	pthread_mutex_lock(&jobqueue_p->rwmutex);
+#ifndef THPOOL_NO_STATS
+	newjob->enqueued = jobqueue_p->now();
+#else
+	newjob->enqueued = 0;
+#endif
+	LOCK(&jobqueue_p->rwmutex, jobqueue_p->lockstat);
 	newjob->prev = NULL;
 
 	switch(jobqueue_p->len){
@@ -554,7 +3728,7 @@ static void jobqueue_push(jobqueue* jobqueue_p, struct job* newjob){
 	jobqueue_p->len++;
 
 	bsem_post_all(jobqueue_p->has_jobs);
-	pthread_mutex_unlock(&jobqueue_p->rwmutex);
+	UNLOCK(&jobqueue_p->rwmutex, jobqueue_p->lockstat);
 }
 
 
@@ -567,7 +3741,7 @@ static void jobqueue_push(jobqueue* jobqueue_p, struct job* newjob){
  */
 static struct job* jobqueue_pull(jobqueue* jobqueue_p){
 
-	pthread_mutex_lock(&jobqueue_p->rwmutex);
+	LOCK(&jobqueue_p->rwmutex, jobqueue_p->lockstat);
 	job* job_p = jobqueue_p->front;
 
 	switch(jobqueue_p->len){
@@ -588,15 +3762,15 @@ static struct job* jobqueue_pull(jobqueue* jobqueue_p){
 	}
 
 	if (jobqueue_p->len == 0) {
-        pthread_mutex_lock(&jobqueue_p->has_jobs->mutex);
+        LOCK(&jobqueue_p->has_jobs->mutex, jobqueue_p->has_jobs->lockstat);
         jobqueue_p->has_jobs->v = 0;
-        pthread_mutex_unlock(&jobqueue_p->has_jobs->mutex);
+        UNLOCK(&jobqueue_p->has_jobs->mutex, jobqueue_p->has_jobs->lockstat);
 	} else {
         /* more than one job in queue -> post it */
 		bsem_post_all(jobqueue_p->has_jobs);
 	}
 
-	pthread_mutex_unlock(&jobqueue_p->rwmutex);
+	UNLOCK(&jobqueue_p->rwmutex, jobqueue_p->lockstat);
 	return job_p;
 }
 
@@ -612,9 +3786,142 @@ static void jobqueue_destroy(jobqueue* jobqueue_p){
 
 
 
+/* ============================ JOB SLAB ============================ */
+
+
+/* Initialize slab */
+static int jobslab_init(jobslab* jobslab_p){
+	jobslab_p->free   = NULL;
+	jobslab_p->chunks = NULL;
+	jobslab_p->fixed  = false;
+	jobslab_p->lock_inzed = pthread_mutex_init(&(jobslab_p->lock), NULL) == 0;
+	return jobslab_p->lock_inzed ? 0 : -1;
+}
+
+
+/* Hand the slab a fixed set of jobs, it will not grow past them */
+static void jobslab_seed(jobslab* jobslab_p, job* jobs_p, int count){
+	int n;
+	for (n = count - 1; n >= 0; n--){
+		jobs_p[n].prev = jobslab_p->free;
+		jobslab_p->free = &jobs_p[n];
+	}
+	jobslab_p->fixed = true;
+}
+
+
+/* Get a cleared job, grows the slab by a chunk when it runs dry */
+static job* job_alloc(jobslab* jobslab_p){
+	pthread_mutex_lock(&jobslab_p->lock);
+	if (jobslab_p->free == NULL && jobslab_p->fixed){
+		pthread_mutex_unlock(&jobslab_p->lock);
+		return NULL;
+	}
+	if (jobslab_p->free == NULL){
+		jobchunk* chunk = (struct jobchunk*)malloc(sizeof(struct jobchunk));
+		if (chunk == NULL){
+			pthread_mutex_unlock(&jobslab_p->lock);
+			return NULL;
+		}
+		chunk->next = jobslab_p->chunks;
+		jobslab_p->chunks = chunk;
+		int n;
+		for (n = 0; n < JOBS_PER_CHUNK; n++){
+			chunk->jobs[n].prev = jobslab_p->free;
+			jobslab_p->free = &chunk->jobs[n];
+		}
+	}
+	job* job_p = jobslab_p->free;
+	jobslab_p->free = job_p->prev;
+	pthread_mutex_unlock(&jobslab_p->lock);
+
+	job_p->prev    = NULL;
+	job_p->arg     = NULL;
+	job_p->signal_ = NULL;
+	job_p->owned   = NULL;
+	job_p->tag     = 0;
+	return job_p;
+}
+
+
+/* Return a job to the slab */
+static void job_free(jobslab* jobslab_p, job* job_p){
+	if (job_p->owned) free(job_p->owned);
+	pthread_mutex_lock(&jobslab_p->lock);
+	job_p->prev = jobslab_p->free;
+	jobslab_p->free = job_p;
+	pthread_mutex_unlock(&jobslab_p->lock);
+}
+
+
+/* Free all chunks back to the system */
+static void jobslab_destroy(jobslab* jobslab_p){
+	jobchunk* chunk = jobslab_p->chunks;
+	while (chunk){
+		jobchunk* next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	jobslab_p->chunks = NULL;
+	jobslab_p->free   = NULL;
+	if (jobslab_p->lock_inzed) pthread_mutex_destroy(&(jobslab_p->lock));
+}
+
+
+
+
+
 /* ======================== SYNCHRONISATION ========================= */
 
 
+#if LOCK_STATS_ON
+/* Take a mutex, accounting whether and how long we had to wait */
+static void lock_acquire(pthread_mutex_t* mutex_p, lockstat* lockstat_p){
+	if (lockstat_p == NULL){
+		pthread_mutex_lock(mutex_p);
+		return;
+	}
+	if (pthread_mutex_trylock(mutex_p) == 0){
+		lockstat_p->held_since = lockstat_p->now();
+	} else {
+		uint64_t waiting = lockstat_p->now();
+		pthread_mutex_lock(mutex_p);
+		uint64_t now = lockstat_p->now();
+		uint64_t waited = now - waiting;
+		lockstat_p->held_since = now;
+		/* the counters belong to whoever holds the lock */
+		STATS_ADD(lockstat_p, contended, 1);
+		STATS_ADD(lockstat_p, wait_ns, waited);
+		if (waited > lockstat_p->max_wait_ns) __atomic_store_n(&lockstat_p->max_wait_ns, waited, __ATOMIC_RELAXED);
+		hist_record(&lockstat_p->waits, waited);
+	}
+	STATS_ADD(lockstat_p, acquisitions, 1);
+}
+
+
+/* Account the time the mutex was held */
+static void lock_held(lockstat* lockstat_p){
+	uint64_t held = lockstat_p->now() - lockstat_p->held_since;
+	STATS_ADD(lockstat_p, hold_ns, held);
+	if (held > lockstat_p->max_hold_ns) __atomic_store_n(&lockstat_p->max_hold_ns, held, __ATOMIC_RELAXED);
+}
+
+
+static void lock_release(pthread_mutex_t* mutex_p, lockstat* lockstat_p){
+	if (lockstat_p) lock_held(lockstat_p);
+	pthread_mutex_unlock(mutex_p);
+}
+
+
+/* A condition wait releases the mutex, the sleep is not held time */
+static void lock_cond_wait(pthread_cond_t* cond_p, pthread_mutex_t* mutex_p, lockstat* lockstat_p){
+	if (lockstat_p) lock_held(lockstat_p);
+	pthread_cond_wait(cond_p, mutex_p);
+	if (lockstat_p) lockstat_p->held_since = lockstat_p->now();
+}
+#endif
+
+
 /* Init semaphore to 1 or 0 */
 static void bsem_init(bsem *bsem_p, int value) {
     bsem_p->mutex_inzed = false;
@@ -626,48 +3933,67 @@ static void bsem_init(bsem *bsem_p, int value) {
 	bsem_p->mutex_inzed = pthread_mutex_init(&(bsem_p->mutex), NULL) == 0;
 	bsem_p->cond_inzed = pthread_cond_init(&(bsem_p->cond), NULL) == 0;
 	bsem_p->v = value;
+	bsem_p->lockstat = NULL;
 }
 
 /* Reset semaphore to 0 */
 static void bsem_reset(bsem *bsem_p) {
+	lockstat* lockstat_p = bsem_p->lockstat;
     if (bsem_p->cond_inzed) pthread_cond_destroy(&(bsem_p->cond));
     if (bsem_p->mutex_inzed) pthread_mutex_destroy(&(bsem_p->mutex));
 	bsem_init(bsem_p, 0);
+	bsem_p->lockstat = lockstat_p;
 }
 
 /* Post to at least one thread */
 static void bsem_post(bsem *bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
+	LOCK(&bsem_p->mutex, bsem_p->lockstat);
 	bsem_p->v = 1;
 	pthread_cond_signal(&bsem_p->cond);
-	pthread_mutex_unlock(&bsem_p->mutex);
+	UNLOCK(&bsem_p->mutex, bsem_p->lockstat);
 }
 
 /* Post to all threads */
 static void bsem_post_all(bsem *bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
+	LOCK(&bsem_p->mutex, bsem_p->lockstat);
 	bsem_p->v = 1;
 	pthread_cond_broadcast(&bsem_p->cond);
-	pthread_mutex_unlock(&bsem_p->mutex);
+	UNLOCK(&bsem_p->mutex, bsem_p->lockstat);
 }
 
-/* Wait on semaphore until semaphore has value 0 */
-static void bsem_wait(bsem* bsem_p) {
-	pthread_mutex_lock(&bsem_p->mutex);
-	while (bsem_p->v != 1) {
-		pthread_cond_wait(&bsem_p->cond, &bsem_p->mutex);
+/* Wake all threads, leaving the value as it is */
+static void bsem_wake_all(bsem *bsem_p) {
+	LOCK(&bsem_p->mutex, bsem_p->lockstat);
+	pthread_cond_broadcast(&bsem_p->cond);
+	UNLOCK(&bsem_p->mutex, bsem_p->lockstat);
+}
+
+/* Wait on semaphore until it has value 1 or *also_p is not 0
+ *
+ * Whoever changes *also_p has to wake the waiters afterwards, see
+ * bsem_wake_all().
+ *
+ * @return number of times the caller went to sleep
+ */
+static int bsem_wait_or(bsem* bsem_p, volatile int* also_p) {
+	int sleeps = 0;
+	LOCK(&bsem_p->mutex, bsem_p->lockstat);
+	while (bsem_p->v != 1 && __atomic_load_n(also_p, __ATOMIC_ACQUIRE) == 0) {
+		COND_WAIT(&bsem_p->cond, &bsem_p->mutex, bsem_p->lockstat);
+		sleeps++;
 	}
-	// bsem_p->v = 0;
-	pthread_mutex_unlock(&bsem_p->mutex);
+	UNLOCK(&bsem_p->mutex, bsem_p->lockstat);
+	return sleeps;
 }
 
 static void  bsem_destroy(struct bsem *bsem_p) {
     if (bsem_p->cond_inzed) pthread_cond_destroy(&(bsem_p->cond));
     if (bsem_p->mutex_inzed) pthread_mutex_destroy(&(bsem_p->mutex));
-    free(bsem_p);
 }
 
 /* Init semaphore to 1 or 0 */
+static uint64_t bsem_generations;       /* last generation handed out */
+
 static void dec_bsem_init(bsem *bsem_p, int value) {
     bsem_p->mutex_inzed = false;
     bsem_p->cond_inzed = false;
@@ -678,6 +4004,8 @@ static void dec_bsem_init(bsem *bsem_p, int value) {
 	bsem_p->mutex_inzed = pthread_mutex_init(&(bsem_p->mutex), NULL) == 0;
 	bsem_p->cond_inzed = pthread_cond_init(&(bsem_p->cond), NULL) == 0;
 	bsem_p->v = value;
+	bsem_p->lockstat = NULL;
+	bsem_p->generation = __atomic_add_fetch(&bsem_generations, 1, __ATOMIC_RELAXED);
 }
 
 /* Post to at least one thread */
@@ -706,6 +4034,144 @@ static void dec_bsem_wait(bsem* bsem_p) {
 	pthread_mutex_unlock(&bsem_p->mutex);
 }
 
+
+
+
+
+/* ============================ BARRIER ============================= */
+
+
+/* Dissemination barrier
+ *
+ * In round r participant i raises a flag of participant (i + 2^r) mod n
+ * and waits for its own flag of that round, so after ceil(log2 n) rounds
+ * everybody has heard from everybody. Flags alternate between two sets
+ * (parity) and flip meaning (sense) every other episode, so they never
+ * need resetting. Waiting spins first and then sleeps on a futex; the
+ * raising side only makes a system call when its partner sleeps.
+ */
+#define BARRIER_MAX_ROUNDS 32
+#define BARRIER_SPINS      4000
+
+typedef struct barrier_node{
+	volatile uint32_t flags[2][BARRIER_MAX_ROUNDS]; /* raised by partners */
+	volatile uint32_t sleeping;          /* waiter is in futex wait   */
+	int      parity;                     /* flag set of this episode  */
+	uint32_t sense;                      /* value meaning "raised"    */
+	char     pad_[64 - (2 * sizeof(uint32_t) + sizeof(int)) % 64];
+} barrier_node;
+
+typedef struct thpool_barrier_{
+	int           participants;
+	int           rounds;
+	int           spins;                 /* spin rounds before sleep  */
+	barrier_node* nodes;                 /* one per participant       */
+	void*         mem;                   /* allocation behind nodes   */
+} thpool_barrier_;
+
+
+static void barrier_sleep(volatile uint32_t* flag_p, uint32_t sense){
+#ifdef LINUX
+	syscall(SYS_futex, (uint32_t*)flag_p, FUTEX_WAIT_PRIVATE, sense ^ 1u, NULL, NULL, 0);
+#else
+	(void)flag_p; (void)sense;
+	DO_SLEEP0ms;
+#endif
+}
+
+static void barrier_wake(volatile uint32_t* flag_p){
+#ifdef LINUX
+	syscall(SYS_futex, (uint32_t*)flag_p, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+	(void)flag_p;
+#endif
+}
+
+
+int thpool_barrier_init(thpool_barrier_** barrier_pp, int participants){
+	if (participants < 1){
+		err("thpool_barrier_init(): Barrier needs at least one participant\n");
+		return -1;
+	}
+	thpool_barrier_* barrier_p = (struct thpool_barrier_*)malloc(sizeof(struct thpool_barrier_));
+	if (barrier_p == NULL){
+		err("thpool_barrier_init(): Could not allocate memory for barrier\n");
+		return -1;
+	}
+	barrier_p->mem = malloc(participants * sizeof(struct barrier_node) + 63);
+	if (barrier_p->mem == NULL){
+		err("thpool_barrier_init(): Could not allocate memory for barrier\n");
+		free(barrier_p);
+		return -1;
+	}
+	barrier_p->nodes = (struct barrier_node*)(((uintptr_t)barrier_p->mem + 63) & ~(uintptr_t)63);
+	memset(barrier_p->nodes, 0, participants * sizeof(struct barrier_node));
+	int n;
+	for (n = 0; n < participants; n++){
+		barrier_p->nodes[n].sense = 1;
+	}
+	barrier_p->participants = participants;
+	barrier_p->rounds = 0;
+	while ((1 << barrier_p->rounds) < participants) barrier_p->rounds++;
+	/* spinning only pays off when every participant has a cpu */
+	barrier_p->spins = participants <= nprocs() ? BARRIER_SPINS : 0;
+
+	*barrier_pp = barrier_p;
+	return 0;
+}
+
+
+int thpool_barrier_wait(thpool_barrier_* barrier_p){
+	int id = thpool_worker_id();
+	if (id < 0 || id >= barrier_p->participants){
+		err("thpool_barrier_wait(): Caller is not a participant\n");
+		return -1;
+	}
+
+	barrier_node* self = &barrier_p->nodes[id];
+	int      parity = self->parity;
+	uint32_t sense  = self->sense;
+	int r;
+	for (r = 0; r < barrier_p->rounds; r++){
+		barrier_node* partner = &barrier_p->nodes[(id + (1 << r)) % barrier_p->participants];
+
+		/* raise the partner's flag, wake it only if it went to sleep */
+		__atomic_store_n(&partner->flags[parity][r], sense, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&partner->sleeping, __ATOMIC_SEQ_CST)){
+			barrier_wake(&partner->flags[parity][r]);
+		}
+
+		volatile uint32_t* flag_p = &self->flags[parity][r];
+		int spins = 0;
+		while (__atomic_load_n(flag_p, __ATOMIC_ACQUIRE) != sense){
+			if (++spins < barrier_p->spins){
+#if defined(__x86_64__) || defined(__i386__)
+				__builtin_ia32_pause();
+#endif
+				continue;
+			}
+			__atomic_store_n(&self->sleeping, 1, __ATOMIC_SEQ_CST);
+			if (__atomic_load_n(flag_p, __ATOMIC_SEQ_CST) != sense){
+				barrier_sleep(flag_p, sense);
+			}
+			__atomic_store_n(&self->sleeping, 0, __ATOMIC_RELAXED);
+		}
+	}
+
+	if (parity == 1) self->sense = sense ^ 1u;
+	self->parity = parity ^ 1;
+	return id == 0 ? 1 : 0;
+}
+
+
+void thpool_barrier_destroy(thpool_barrier_** barrier_pp){
+	if (*barrier_pp == NULL) return;
+	free((*barrier_pp)->mem);
+	free(*barrier_pp);
+	*barrier_pp = NULL;
+}
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -10,6 +10,9 @@
 #define DISABLE_PRINT
 
 #include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -20,6 +23,160 @@ extern "C" {
 
 typedef struct thpool_* threadpool;
 typedef struct bsem* thpool_decsemaphore;
+typedef struct thpool_barrier_* thpool_barrier;
+typedef struct thpool_histogram_* thpool_histogram;
+
+/* Arguments up to this size are copied into the job slot itself */
+#define THPOOL_JOB_INLINE_SIZE 64
+
+/* thpool_config.static_flags */
+#define THPOOL_STATIC_PREFAULT  0x01     /* touch every page of the buffer up front */
+#define THPOOL_STATIC_HUGEPAGE  0x02     /* ask for transparent huge pages (Linux)  */
+#define THPOOL_STATIC_STACKS    0x04     /* carve thread stacks out of the buffer   */
+
+/* thpool_config.sched_policy: THPOOL_SCHED_INHERIT or SCHED_OTHER/FIFO/RR */
+#define THPOOL_SCHED_INHERIT    -1
+
+/* thpool_config.affinity */
+#define THPOOL_AFFINITY_NONE         0   /* let the scheduler place workers         */
+#define THPOOL_AFFINITY_ROUND_ROBIN  1   /* worker n on the n-th allowed cpu        */
+#define THPOOL_AFFINITY_LIST         2   /* worker n on cpus[n % cpu_count]         */
+
+/* Slots per worker for thpool_tls_get/set */
+#define THPOOL_TLS_SLOTS      8
+
+/* thpool_config.scratch_scope */
+#define THPOOL_SCRATCH_JOB    0          /* scratch memory dies with the job        */
+#define THPOOL_SCRATCH_GROUP  1          /* lives on through jobs of the same group */
+
+/* thpool_config.clock, timestamps of statistics and latency histograms */
+#define THPOOL_CLOCK_MONOTONIC  0        /* clock_gettime(CLOCK_MONOTONIC)          */
+#define THPOOL_CLOCK_COARSE     1        /* CLOCK_MONOTONIC_COARSE, tick resolution */
+#define THPOOL_CLOCK_TSC        2        /* calibrated invariant TSC (x86), falls
+                                            back to THPOOL_CLOCK_MONOTONIC          */
+
+/* thpool_latency_snapshot() kinds */
+#define THPOOL_LATENCY_QUEUE    0        /* from queueing to start of the job       */
+#define THPOOL_LATENCY_EXEC     1        /* from start to end of the job            */
+
+/* Locks of a pool, instrumented with -DTHPOOL_LOCK_STATS */
+#define THPOOL_LOCK_QUEUE       0        /* job queue mutex                         */
+#define THPOOL_LOCK_COUNT       1        /* worker count lock, thpool_wait()        */
+#define THPOOL_LOCK_HAS_JOBS    2        /* mutex of the has-jobs semaphore         */
+#define THPOOL_LOCKS            3
+
+/* Contention of one lock, see thpool_stats_snapshot() */
+typedef struct thpool_lock_stats {
+	uint64_t     acquisitions;       /* times the lock was taken                */
+	uint64_t     contended;          /* times it was busy and had to be waited  */
+	uint64_t     wait_ns;            /* time spent waiting for it               */
+	uint64_t     max_wait_ns;        /* longest wait                            */
+	uint64_t     hold_ns;            /* time it was held                        */
+	uint64_t     max_hold_ns;        /* longest hold                            */
+} thpool_lock_stats;
+
+/* Pool statistics, see thpool_stats_snapshot() */
+typedef struct thpool_stats {
+	int          num_threads;        /* workers alive                           */
+	int          num_threads_working;/* workers awake and serving               */
+	int          queue_len;          /* jobs waiting in the queue               */
+	uint64_t     jobs;               /* jobs run                                */
+	uint64_t     busy_ns;            /* time spent running jobs                 */
+	uint64_t     idle_ns;            /* time spent between jobs                 */
+	uint64_t     parks;              /* times a worker went to sleep            */
+	uint64_t     wakes;              /* times a sleeping worker was woken       */
+	uint64_t     empty_pulls;        /* wake ups that found the queue empty     */
+	uint64_t     broadcasts;         /* broadcast letters run                   */
+	thpool_lock_stats locks[THPOOL_LOCKS]; /* with -DTHPOOL_LOCK_STATS only    */
+} thpool_stats;
+
+/* Profile of one job function, see thpool_profile_snapshot() */
+typedef struct thpool_profile_entry {
+	void       (*function)(void*);   /* job function                            */
+	const char*  name;               /* its symbol (mangled), NULL: unknown     */
+	uint64_t     count;              /* jobs run                                */
+	uint64_t     total_ns;           /* sum of run times                        */
+	uint64_t     max_ns;             /* longest run                             */
+	uint64_t     wait_ns;            /* sum of queue waits                      */
+	uint64_t     max_wait_ns;        /* longest queue wait                      */
+} thpool_profile_entry;
+
+/* Hardware counters of one job class, see thpool_perf_snapshot() */
+typedef struct thpool_perf_entry {
+	uintptr_t    tag;                /* job tag, 0: class of untagged function  */
+	void       (*function)(void*);   /* (first) function of the class          */
+	uint64_t     jobs;               /* jobs run                                */
+	uint64_t     time_ns;            /* sum of run times                        */
+	uint64_t     cycles;             /* cpu cycles, user space                  */
+	uint64_t     instructions;       /* instructions retired, user space        */
+	uint64_t     llc_misses;         /* last level cache misses                 */
+	uint64_t     context_switches;   /* times a job was switched out            */
+} thpool_perf_entry;
+
+/* Queue wait objective of a job class, see config.slos */
+#define THPOOL_SLO_MAX          8        /* classes per pool                        */
+
+typedef struct thpool_slo {
+	uintptr_t    tag;                /* job class, 0: untagged jobs             */
+	double       percentile;         /* e.g. 99.0                               */
+	uint64_t     max_wait_ns;        /* that percentile of queue waits stays
+	                                    below this                              */
+} thpool_slo;
+
+/* Pool configuration
+ *
+ * Fill with thpool_config_init() and change only the fields you need, so
+ * code keeps working when fields are added.
+ */
+typedef struct thpool_config {
+	int          num_threads;        /* number of worker threads                */
+	int          job_capacity;       /* jobs a static pool can hold at once     */
+	unsigned int static_flags;       /* THPOOL_STATIC_* flags                   */
+
+	size_t       stack_size;         /* worker stack size, 0: pthread default   */
+	size_t       guard_size;         /* stack guard size, 0: pthread default    */
+	void*        stack_region;       /* num_threads * stack_size bytes of
+	                                    stacks, NULL: allocated by pthread      */
+	const char*  name;               /* thread name prefix, "<name>-<id>"       */
+	int          nice;               /* nice value of workers, 0: unchanged     */
+	int          sched_policy;       /* THPOOL_SCHED_INHERIT, SCHED_FIFO, ..    */
+	int          sched_priority;     /* priority for SCHED_FIFO / SCHED_RR      */
+	int          affinity;           /* THPOOL_AFFINITY_* policy                */
+	const int*   cpus;               /* cpu list for THPOOL_AFFINITY_LIST       */
+	int          cpu_count;          /* entries in cpus                         */
+
+	size_t       scratch_chunk_size; /* bytes per scratch arena chunk           */
+	int          scratch_scope;      /* THPOOL_SCRATCH_JOB / _GROUP             */
+	int          clock;              /* THPOOL_CLOCK_* timestamp source         */
+	int          trace_capacity;     /* flight recorder events per worker       */
+	int          perf_counters;      /* 1: per worker hardware counters (Linux) */
+
+	int          monitor_interval_ms;/* tick of the monitor thread              */
+	int          watchdog_ms;        /* report jobs running longer, 0: off      */
+	int          watchdog_signal;    /* signal taking their stack, 0: SIGURG    */
+	void (*on_stuck)(int worker_id, void (*function)(void*), uint64_t running_ns,
+	                 void* const* frames, int depth, void* hook_arg); /* stuck job,
+	                                    NULL: print it to stderr                */
+
+	const thpool_slo* slos;          /* queue wait objectives, copied           */
+	int          slo_count;          /* entries in slos, up to THPOOL_SLO_MAX   */
+	int          slo_window_ticks;   /* monitor ticks of the rolling window     */
+	void (*on_slo)(int slo, uintptr_t tag, uint64_t wait_ns, int breached,
+	               void* hook_arg);  /* SLO breached (1) or met again (0)       */
+
+	void (*on_worker_start)(int worker_id, void* hook_arg); /* on each worker
+	                                    before it serves jobs                   */
+	void (*on_worker_stop)(int worker_id, void* hook_arg);  /* on each worker
+	                                    after its last job                      */
+	void*        hook_arg;           /* passed to the hooks                     */
+} thpool_config;
+
+/* Live pool, see thpool_registry_list() */
+typedef struct thpool_registry_entry {
+	threadpool   pool;               /* for thpool_stats_snapshot() etc.        */
+	const char*  name;               /* config.name, at most 15 characters      */
+	const thpool_config* config;     /* the pool's copy of its configuration    */
+} thpool_registry_entry;
 
 
 /**
@@ -42,6 +199,108 @@ typedef struct bsem* thpool_decsemaphore;
 threadpool thpool_init(int num_threads);
 
 
+/**
+ * @brief Initialize a threadpool from a configuration
+ *
+ * Like thpool_init() with control over how the workers are created.
+ * Stack size, guard size, stack_region, scheduling policy and cpu affinity
+ * are set on the pthread attributes, so they are in place before a worker
+ * runs. The thread name and the nice value are applied by the worker
+ * itself before it serves its first job. Thread names are truncated to 15
+ * characters by the system.
+ *
+ * on_worker_start runs on every worker before it serves jobs, and
+ * thpool_init_ex() returns only after all of them have finished;
+ * on_worker_stop runs on every worker after its last job, before
+ * thpool_destroy() returns. Both may use thpool_worker_id() and the
+ * thpool_tls_* slots.
+ *
+ * SCHED_FIFO and SCHED_RR usually need privileges; without them the pool
+ * fails to start and NULL is returned. job_capacity and static_flags only
+ * apply to thpool_init_static().
+ *
+ * @example
+ *
+ *    thpool_config config;
+ *    thpool_config_init(&config);
+ *    config.num_threads = 256;
+ *    config.stack_size  = 256 * 1024;
+ *    config.name        = "io";
+ *    config.nice        = 5;
+ *    threadpool thpool  = thpool_init_ex(&config);
+ *
+ * @param  config_p      pool configuration
+ * @return threadpool    created threadpool on success,
+ *                       NULL on error
+ */
+threadpool thpool_init_ex(const thpool_config* config_p);
+
+
+/**
+ * @brief Fill a configuration with defaults
+ *
+ * One thread per available cpu placed round robin over the allowed cpus,
+ * default stacks and scheduling, thread names "thpool-<id>", a job
+ * capacity of 1024 and job scoped scratch arenas of 64 KiB chunks.
+ *
+ * @param  config_p      configuration to fill
+ * @return nothing
+ */
+void thpool_config_init(thpool_config* config_p);
+
+
+/**
+ * @brief Bytes thpool_init_static() needs for a configuration
+ *
+ * @param  config_p      configuration the pool will be created with
+ * @return size in bytes of the buffer to pass to thpool_init_static()
+ */
+size_t thpool_static_size(const thpool_config* config_p);
+
+
+/**
+ * @brief Initialize a threadpool inside caller provided memory
+ *
+ * The pool, its workers, config_p->job_capacity job slots, one scratch
+ * chunk of config_p->scratch_chunk_size bytes per worker, the tables of
+ * config_p->slos and config_p->perf_counters and, for more than 32
+ * workers, the letters of thpool_broadcast() are laid out inside buf_p;
+ * neither this call nor running the pool touches the heap. Broadcasts on
+ * such a pool take turns, so a function run by thpool_broadcast() must
+ * not broadcast to the same pool. thpool_trace_enable() fails on a static
+ * pool, and the snapshot and dump functions allocate what they return as
+ * for any pool.
+ * thpool_scratch_alloc() returns NULL once a worker's chunk is full.
+ * Once all job slots are in use thpool_add_work() fails with -1 instead
+ * of growing, and thpool_add_work_copy() only accepts arguments of up to
+ * THPOOL_JOB_INLINE_SIZE bytes. Thread stacks are provided by the pthread
+ * library unless THPOOL_STATIC_STACKS is set together with a stack_size,
+ * in which case they are carved out of the buffer as well.
+ *
+ * The buffer must stay valid until thpool_destroy() returns; destroying
+ * the pool leaves freeing it to the caller.
+ *
+ * @example
+ *
+ *    thpool_config config;
+ *    thpool_config_init(&config);
+ *    config.num_threads  = 8;
+ *    config.job_capacity = 4096;
+ *    config.static_flags = THPOOL_STATIC_PREFAULT;
+ *
+ *    size_t size = thpool_static_size(&config);
+ *    void*  buf  = mmap(NULL, size, ...);
+ *    threadpool thpool = thpool_init_static(buf, size, &config);
+ *
+ * @param  buf_p         memory to place the pool in
+ * @param  size          size of buf_p, at least thpool_static_size(config_p)
+ * @param  config_p      pool configuration
+ * @return threadpool    created threadpool on success,
+ *                       NULL on error
+ */
+threadpool thpool_init_static(void* buf_p, size_t size, const thpool_config* config_p);
+
+
 /**
  * @brief Add work to the job queue
  *
@@ -70,10 +329,198 @@ threadpool thpool_init(int num_threads);
  * @return 0 on successs, -1 otherwise.
  */
 int thpool_add_work(threadpool, void (*function_p)(void*), void* arg_p);
+
+
+/**
+ * @brief Add work with a private copy of its argument
+ *
+ * Copies len bytes from data_p and passes the function a pointer to the
+ * copy. Copies of up to THPOOL_JOB_INLINE_SIZE bytes are stored inside the
+ * job slot, so the job needs no allocation of its own; bigger ones are
+ * copied to the heap. The copy is released after the function returns, so
+ * the caller neither keeps data_p alive nor frees anything in the job.
+ *
+ * @example
+ *
+ *    struct range { int from, to; };
+ *
+ *    void sum_range(void* p){
+ *       struct range* r = (struct range*)p;
+ *       ..
+ *    }
+ *
+ *    struct range r = { 0, 1000 };
+ *    thpool_add_work_copy(thpool, sum_range, &r, sizeof(r));
+ *
+ * @param  threadpool    threadpool to which the work will be added
+ * @param  function_p    pointer to function to add as work
+ * @param  data_p        argument bytes to copy
+ * @param  len           number of bytes to copy
+ * @return 0 on successs, -1 otherwise.
+ */
+int thpool_add_work_copy(threadpool, void (*function_p)(void*), const void* data_p, size_t len);
+
+
+/**
+ * @brief Add work of a job class to the job queue
+ *
+ * Same as thpool_add_work(), the job is accounted under tag instead of
+ * its function by the per class instrumentation (thpool_perf_snapshot()).
+ * Tag 0 means untagged.
+ *
+ * @param threadpool    threadpool to which the work will be added
+ * @param tag           job class, e.g. a request type
+ * @param function_p    pointer to function to add as work
+ * @param arg_p         pointer to an argument
+ * @return 0 on success, -1 otherwise.
+ */
+int thpool_add_work_tagged(threadpool, uintptr_t tag, void (*function_p)(void*), void* arg_p);
+
 int thpool_add_work_with_sem(threadpool, thpool_decsemaphore, void (*function_p)(void*), void* arg_p);
 void thpool_decsem_init(thpool_decsemaphore*, int value);
 void thpool_wait_cond(thpool_decsemaphore*);
 
+/**
+ * @brief Allocate temporary memory inside a job
+ *
+ * Every worker owns a bump-pointer arena. Memory from it needs no free: with
+ * THPOOL_SCRATCH_JOB (the default) the arena is reset as soon as the job
+ * returns. With THPOOL_SCRATCH_GROUP memory allocated by a job queued with
+ * thpool_add_work_with_sem() stays valid until the same worker starts a
+ * job that does not belong to that group, so results can be handed to the
+ * thread waiting on the group. Chunks are recycled per worker; those held
+ * beyond twice the recent high-water mark are given back to the system.
+ *
+ * The memory is 16 byte aligned and must not be used by other jobs once
+ * its scope ended.
+ *
+ * @example
+ *
+ *    void parse(void* arg){
+ *       char* tmp = (char*)thpool_scratch_alloc(4096);
+ *       ..
+ *    }                                   // tmp is recycled here
+ *
+ * @param  size          bytes to allocate
+ * @return pointer to the memory, NULL when not called from a worker or
+ *         out of memory
+ */
+void* thpool_scratch_alloc(size_t size);
+
+
+/**
+ * @brief Id of the calling worker
+ *
+ * Workers of a pool are numbered densely from 0 to num_threads - 1, so a
+ * job can index per worker arrays without hashing or locking.
+ *
+ * @example
+ *
+ *    static counter_t counters[NUM_THREADS];
+ *
+ *    void count(void* arg){
+ *       counters[thpool_worker_id()].hits++;
+ *    }
+ *
+ * @return id of the worker, -1 when not called from a worker
+ */
+int thpool_worker_id(void);
+
+
+/**
+ * @brief Per worker pointer slots
+ *
+ * Every worker has THPOOL_TLS_SLOTS pointers of its own, typically filled
+ * by an on_worker_start hook (RNG state, a database connection, ..) and
+ * read by the jobs that run on it.
+ *
+ * @example
+ *
+ *    void open_db(int id, void* arg){ thpool_tls_set(0, db_connect()); }
+ *    void query(void* arg){ db_t* db = (db_t*)thpool_tls_get(0); .. }
+ *
+ * @param  slot          slot index, 0 .. THPOOL_TLS_SLOTS - 1
+ * @param  value         new value of the slot
+ * @return thpool_tls_get: value of the slot, NULL off a worker;
+ *         thpool_tls_set: 0 on success, -1 off a worker or for a bad slot
+ */
+void* thpool_tls_get(int slot);
+int   thpool_tls_set(int slot, void* value);
+
+
+/**
+ * @brief Run a function once on every worker
+ *
+ * Delivers function_p(arg_p) to the private mailbox of each live worker
+ * and returns when all of them have run it. Workers read their mailbox in
+ * between jobs, so a broadcast interleaves with queued work: idle workers
+ * run it right away, busy ones as soon as their current job is done. May
+ * be called from a job of the same pool.
+ *
+ * @example
+ *
+ *    void flush_local_buffers(void* arg){ .. }
+ *
+ *    thpool_broadcast(thpool, flush_local_buffers, NULL);
+ *
+ * @param  threadpool    threadpool whose workers run the function
+ * @param  function_p    function to run on every worker
+ * @param  arg_p         argument passed to every call
+ * @return 0 on success, -1 otherwise.
+ */
+int thpool_broadcast(threadpool, void (*function_p)(void*), void* arg_p);
+
+
+/**
+ * @brief Run one long job on every worker
+ *
+ * SPMD launcher: every worker runs function_p(worker_id, num_workers,
+ * arg_p) once, see thpool_broadcast(). Returns when all calls returned.
+ * Combined with a thpool_barrier of num_workers participants the calls can
+ * run bulk-synchronous supersteps without going back to the queue.
+ *
+ * @example
+ *
+ *    void solve(int id, int n, void* arg){
+ *       for (int step = 0; step < STEPS; step++){
+ *          relax(id, n, step);
+ *          thpool_barrier_wait(barrier);
+ *       }
+ *    }
+ *
+ *    thpool_barrier_init(&barrier, thpool_num_threads(thpool));
+ *    thpool_run_on_each(thpool, solve, NULL);
+ *    thpool_barrier_destroy(&barrier);
+ *
+ * @param  threadpool    threadpool whose workers run the function
+ * @param  function_p    function to run on every worker
+ * @param  arg_p         argument passed to every call
+ * @return 0 on success, -1 otherwise.
+ */
+int thpool_run_on_each(threadpool, void (*function_p)(int worker_id, int num_workers, void* arg), void* arg_p);
+
+
+/**
+ * @brief Worker barrier
+ *
+ * A barrier for jobs running on every worker of a pool, each participant
+ * being identified by thpool_worker_id(). It is a dissemination barrier:
+ * log2(participants) rounds of pairwise signals, no shared counter. A
+ * waiting worker spins briefly and then sleeps on a futex (Linux).
+ *
+ * thpool_barrier_wait() returns 1 on worker 0 and 0 on the others, so one
+ * participant can be picked for serial work in between supersteps, and
+ * -1 if the caller is not a participant. The barrier is reusable.
+ *
+ * @param  barrier       barrier to initialise, wait on or destroy
+ * @param  participants  number of workers taking part, ids 0 .. n-1
+ * @return init: 0 on success, -1 otherwise
+ */
+int  thpool_barrier_init(thpool_barrier* barrier, int participants);
+int  thpool_barrier_wait(thpool_barrier barrier);
+void thpool_barrier_destroy(thpool_barrier* barrier);
+
+
 /**
  * @brief Wait for all queued jobs to finish
  *
@@ -187,6 +634,294 @@ void thpool_destroy(threadpool);
 int thpool_num_threads_working(threadpool);
 
 
+/**
+ * @brief Snapshot of the pool's counters
+ *
+ * Every worker keeps its own counters, updated with plain relaxed stores
+ * at job boundaries. A snapshot sums them up without taking any lock, so
+ * it never stalls the workers; counters of different workers may be a job
+ * apart from each other. thpool_worker_stats_snapshot() returns the
+ * counters of a single worker.
+ *
+ * Counting costs two clock reads per job and can be compiled out with
+ * -DTHPOOL_NO_STATS, in which case only the gauges are filled in and -1
+ * is returned.
+ *
+ * Building with -DTHPOOL_LOCK_STATS also instruments the pool's own locks
+ * (THPOOL_LOCK_*): how often each was taken, how often it was busy, how
+ * long it was waited for and held. Waits and holds are timed with the
+ * pool's clock by the thread holding the lock, a contended wait also goes
+ * into a histogram returned by thpool_lock_wait_snapshot().
+ *
+ * @example
+ *
+ *    thpool_stats stats;
+ *    thpool_stats_snapshot(thpool, &stats);
+ *    printf("%llu jobs, %.1f%% busy\n", (unsigned long long)stats.jobs,
+ *           100.0 * stats.busy_ns / (stats.busy_ns + stats.idle_ns));
+ *
+ * @param threadpool     the threadpool of interest
+ * @param worker_id      worker of interest, 0 .. num_threads - 1
+ * @param stats_p        snapshot to fill
+ * @return 0 on success, -1 otherwise
+ */
+int thpool_stats_snapshot(threadpool, thpool_stats* stats_p);
+int thpool_worker_stats_snapshot(threadpool, int worker_id, thpool_stats* stats_p);
+thpool_histogram thpool_lock_wait_snapshot(threadpool, int lock);
+
+
+/**
+ * @brief Latency histogram of the pool's jobs
+ *
+ * Jobs are stamped when queued, when a worker picks them up and when they
+ * return. Each worker records queue wait and execution time into its own
+ * log-linear histograms (about 3% relative error, up to ~18 minutes);
+ * a snapshot merges them without stopping the workers.
+ *
+ * With reset set, the next snapshot of the same kind only covers the jobs
+ * that completed after this one. The timestamps come from
+ * thpool_config.clock; THPOOL_CLOCK_TSC keeps the cost of recording well
+ * below a microsecond job. Free the snapshot with thpool_histogram_free().
+ *
+ * @example
+ *
+ *    thpool_histogram h = thpool_latency_snapshot(thpool, THPOOL_LATENCY_QUEUE, 1);
+ *    printf("p99 queue wait %llu ns\n",
+ *           (unsigned long long)thpool_histogram_percentile(h, 99.0));
+ *    thpool_histogram_free(h);
+ *
+ * @param threadpool     the threadpool of interest
+ * @param kind           THPOOL_LATENCY_QUEUE or THPOOL_LATENCY_EXEC
+ * @param reset          1 to start a new window after this snapshot
+ * @return merged histogram, NULL on error or with -DTHPOOL_NO_STATS
+ */
+thpool_histogram thpool_latency_snapshot(threadpool, int kind, int reset);
+
+
+/**
+ * @brief Queries on a latency histogram
+ *
+ * thpool_histogram_percentile() returns the value (in ns) below which the
+ * given percentage, 0 .. 100, of the samples fall, rounded up to the end
+ * of its bucket; 0 for an empty histogram.
+ *
+ * @param histogram      snapshot from thpool_latency_snapshot()
+ * @param percentile     percentage of samples, e.g. 99.9
+ * @return latency in ns, number of samples, mean in ns
+ */
+uint64_t thpool_histogram_percentile(thpool_histogram, double percentile);
+uint64_t thpool_histogram_count(thpool_histogram);
+double   thpool_histogram_mean(thpool_histogram);
+void     thpool_histogram_free(thpool_histogram);
+
+
+/**
+ * @brief Flight recorder of the pool's workers
+ *
+ * When on, every worker writes an event for each job it runs (with the
+ * time it was queued), each broadcast and each time it sleeps into a ring
+ * of its own holding the latest config.trace_capacity events. Rings are
+ * allocated the first time tracing is turned on, which fails for a pool
+ * from thpool_init_static(); while off, the workers only check a flag.
+ *
+ * thpool_trace_dump() writes the rings as Chrome trace_event JSON, which
+ * chrome://tracing and Perfetto open; job functions are named by dladdr(),
+ * so link with -rdynamic to see names of functions of the executable.
+ * thpool_trace_on_signal() makes sig_id dump every traced pool into path,
+ * e.g. SIGUSR1 on demand or SIGSEGV/SIGABRT on crash, after which crash
+ * signals get their default action. The dump from a signal only calls
+ * async-signal-safe functions and names job functions by address.
+ * Dumping does not stop the workers. Linux only.
+ *
+ * @example
+ *
+ *    thpool_trace_enable(thpool, 1);
+ *    thpool_trace_on_signal(SIGSEGV, "/tmp/thpool-crash.json");
+ *    ...
+ *    thpool_trace_dump(thpool, "thpool.json");
+ *
+ * @param threadpool     the threadpool of interest
+ * @param on             1 to record, 0 to stop recording
+ * @param path           file to write, replaced if it exists
+ * @param sig_id         signal that triggers a dump
+ * @return 0 on success, -1 otherwise
+ */
+int thpool_trace_enable(threadpool, int on);
+int thpool_trace_dump(threadpool, const char* path);
+int thpool_trace_on_signal(int sig_id, const char* path);
+
+
+/**
+ * @brief Registry of the live pools
+ *
+ * Every pool lists itself in a process wide registry (up to 64 pools)
+ * from the moment its workers are up until thpool_destroy() is called.
+ * thpool_registry_list() fills at most max_entries entries; the handles
+ * and pointers stay valid until the pool is destroyed.
+ *
+ * thpool_state_dump() writes, for every registered pool, the queue
+ * depth, the age of the oldest queued job and what each worker is doing:
+ * running a job (its function and for how long), parked waiting for
+ * work, or spinning in between jobs. thpool_state_on_signal() makes
+ * sig_id, e.g. SIGUSR2, append the same dump to path, or to stderr if
+ * path is NULL. The handler formats the dump in a buffer allocated
+ * beforehand and writes it with write(2) and only calls async-signal-safe
+ * functions, so it names job functions by address (addr2line resolves
+ * them); thpool_state_dump() names them by dladdr(). Pools being
+ * destroyed wait for thpool_state_dump(). Ages and run times need stats,
+ * tracing, perf counters or the watchdog to be on. Linux only.
+ *
+ * @example
+ *
+ *    thpool_state_on_signal(SIGUSR2, NULL);
+ *    // kill -USR2 <pid>
+ *    //   pool io: 4 workers, 4 working, 37 queued, oldest for 1520.004 us
+ *    //     io-0 running "0x55d0c2a41c30" for 1203.310 us
+ *    //     ...
+ *
+ * @param entries        array to fill
+ * @param max_entries    size of entries
+ * @param fd             file descriptor to write to
+ * @param sig_id         signal that triggers a dump
+ * @param path           file to append to, NULL: stderr
+ * @return thpool_registry_list: number of live pools, may be more than
+ *         max_entries; others 0 on success, -1 otherwise
+ */
+int thpool_registry_list(thpool_registry_entry* entries, int max_entries);
+int thpool_state_dump(int fd);
+int thpool_state_on_signal(int sig_id, const char* path);
+
+
+/**
+ * @brief OpenMetrics exporter of all pools
+ *
+ * thpool_metrics_start() starts a thread exporting the registered pools
+ * in OpenMetrics text format, labelled pool="<config.name>" (pools
+ * sharing a name get "-<n>" appended): queue depth, workers alive and
+ * busy, job, park, wake and broadcast counters, busy and idle time, and
+ * queue wait and run time histograms.
+ *
+ * With interval_ms 0, path is a UNIX domain socket the exporter listens
+ * on; each connection is answered with one scrape, preceded by an HTTP
+ * header when the client sent a GET request, so
+ * curl --unix-socket path http://localhost/metrics works as well as
+ * socat. With interval_ms > 0 the file at path is rewritten (through a
+ * rename, never partly written) every interval_ms.
+ *
+ * A scrape reads the workers' counters and histograms like
+ * thpool_stats_snapshot() does and takes no lock the workers use; pools
+ * being created or destroyed wait for a scrape in progress. With
+ * -DTHPOOL_NO_STATS only the gauges are exported. One exporter per
+ * process, Linux only.
+ *
+ * @example
+ *
+ *    thpool_metrics_start("/run/myapp/thpool.sock", 0);
+ *    ...
+ *    thpool_metrics_stop();
+ *
+ * @param path           socket or file to write, replaced if it exists
+ * @param interval_ms    0 for a socket, else file rewrite period
+ * @return 0 on success, -1 otherwise
+ */
+int  thpool_metrics_start(const char* path, int interval_ms);
+void thpool_metrics_stop(void);
+
+
+/**
+ * @brief Run time profile by job function
+ *
+ * Every worker accounts the jobs it runs by their function: number of
+ * calls, total and longest run time, total and longest queue wait. Up to
+ * 128 distinct functions per worker are tracked, later ones are counted
+ * as dropped. thpool_profile_snapshot() merges the workers' tables and
+ * fills at most max_entries entries, most total run time first; symbols
+ * are only looked up (dladdr) for the returned entries.
+ * thpool_profile_dump() prints the whole profile as a table with
+ * demangled names.
+ *
+ * @example
+ *
+ *    thpool_profile_dump(thpool, stderr);
+ *
+ * @param threadpool     the threadpool of interest
+ * @param entries        array to fill
+ * @param max_entries    size of entries
+ * @param out            stream to print to
+ * @return number of entries filled / 0, -1 on error or with -DTHPOOL_NO_STATS
+ */
+int thpool_profile_snapshot(threadpool, thpool_profile_entry* entries, int max_entries);
+int thpool_profile_dump(threadpool, FILE* out);
+
+
+/**
+ * @brief Hardware counters by job class
+ *
+ * With config.perf_counters set every worker opens a perf_event group
+ * counting its own cycles, instructions, last level cache misses and
+ * context switches, and reads it before and after each job, with rdpmc
+ * when the kernel allows user space reads and read(2) otherwise. Jobs are
+ * accounted by tag (thpool_add_work_tagged()) or, untagged, by function;
+ * up to 64 classes per worker.
+ *
+ * Counters that cannot be opened, e.g. with a restrictive
+ * perf_event_paranoid or in a VM without a PMU, read as 0 while jobs and
+ * run times are still accounted. thpool_perf_available() tells how many
+ * workers got hardware counters.
+ *
+ * @example
+ *
+ *    thpool_perf_entry e[16];
+ *    int n = thpool_perf_snapshot(thpool, -1, e, 16);
+ *    for (int i = 0; i < n; i++)
+ *        printf("%p: %.2f IPC\n", (void*)e[i].tag, (double)e[i].instructions / e[i].cycles);
+ *
+ * @param threadpool     the threadpool of interest
+ * @param worker_id      one worker, -1 for all of them
+ * @param entries        array to fill, most run time first
+ * @param max_entries    size of entries
+ * @return number of entries filled / workers with hardware counters,
+ *         -1 on error / when config.perf_counters is off
+ */
+int thpool_perf_snapshot(threadpool, int worker_id, thpool_perf_entry* entries, int max_entries);
+int thpool_perf_available(threadpool);
+
+
+/**
+ * @brief State of a queue wait SLO
+ *
+ * Jobs of the classes in config.slos (by tag, see thpool_add_work_tagged())
+ * record their queue wait in per worker histograms. On every tick the
+ * monitor thread merges them into a rolling window of about
+ * config.slo_window_ticks ticks, and calls config.on_slo when the
+ * objective's percentile crosses max_wait_ns, either way. This returns
+ * the window's p50 and p99 as of the last tick.
+ *
+ * @example
+ *
+ *    thpool_slo slo = { 0, 99.0, 2000000 };     // p99 below 2ms
+ *    config.slos = &slo;
+ *    config.slo_count = 1;
+ *    config.on_slo = scale_out;
+ *
+ * @param threadpool     the threadpool of interest
+ * @param slo            index in config.slos
+ * @param p50_ns         rolling median queue wait, may be NULL
+ * @param p99_ns         rolling p99 queue wait, may be NULL
+ * @return 1 breached, 0 met, -1 on error
+ */
+int thpool_slo_status(threadpool, int slo, uint64_t* p50_ns, uint64_t* p99_ns);
+
+
+/**
+ * @brief Number of workers
+ *
+ * @param threadpool     the threadpool of interest
+ * @return integer       number of threads in the pool
+ */
+int thpool_num_threads(threadpool);
+
+
 #ifdef __cplusplus
 }
 #endif
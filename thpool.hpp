@@ -0,0 +1,976 @@
+/**********************************
+ * License:     MIT
+ *
+ **********************************/
+/*! \file thpool.hpp
+ *
+ *  Header-only C++ front end for thpool.
+ *
+ *  thpool::pool owns a threadpool created with thpool_init() and destroys
+ *  it when it goes out of scope. When compiled as C++20 the pool is also
+ *  an executor for coroutines:
+ *
+ *    thpool::task<int> compute(thpool::pool& pool) {
+ *        co_await pool.schedule();          // continue on a worker
+ *        co_return 42;
+ *    }
+ *
+ *    thpool::pool pool(4);
+ *    int v = thpool::sync_wait(compute(pool));
+ *
+ *  Plain callables are queued with submit(), which returns a future:
+ *
+ *    auto f = pool.submit([buf = std::move(buf)] { return parse(buf); });
+ *    auto g = std::move(f).then([](result r) { return r.size(); });
+ *    size_t n = g.get();
+ *
+ ********************************/
+
+#ifndef _THPOOL_HPP_
+#define _THPOOL_HPP_
+
+#include "thpool.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#include <condition_variable>
+#include <optional>
+#define THPOOL_HAS_COROUTINES 1
+#endif
+#endif
+
+namespace thpool {
+
+class pool;
+
+namespace detail {
+
+/* Recycling block allocator
+ *
+ * Blocks are grouped in power of two size classes from 64 up to 4096 bytes.
+ * A freed block goes back to the free list of its class and is handed out
+ * again by the next allocation of that class, so steady-state workloads
+ * never reach malloc. Bigger requests go straight to operator new.
+ *
+ * A cache is created with new and counts one reference for its creator
+ * and one for every block handed out and not yet freed. The creator gives
+ * its reference up with release(); the cache is deleted when its last
+ * block comes back. Blocks, and the futures and coroutine frames living
+ * in them, may therefore outlive the pool that allocated them.
+ */
+class block_cache {
+public:
+	static constexpr std::size_t min_block   = 64;
+	static constexpr std::size_t num_classes = 7;     /* 64 .. 4096 bytes */
+
+	block_cache() noexcept {
+		for (std::size_t i = 0; i < num_classes; i++) free_[i] = nullptr;
+	}
+
+	block_cache(const block_cache&) = delete;
+	block_cache& operator=(const block_cache&) = delete;
+
+	/* Drop the creator's reference */
+	void release() noexcept {
+		if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) delete this;
+	}
+
+	void* allocate(std::size_t n) {
+		std::size_t total = n + sizeof(header);
+		std::size_t cls = 0;
+		while (cls < num_classes && (min_block << cls) < total) cls++;
+
+		header* h;
+		if (cls == num_classes) {
+			h = static_cast<header*>(::operator new(total));
+			h->owner = nullptr;
+		} else {
+			node* blk = nullptr;
+			{
+				std::lock_guard<std::mutex> lk(lock_[cls]);
+				blk = free_[cls];
+				if (blk) free_[cls] = blk->next;
+			}
+			if (blk) h = reinterpret_cast<header*>(blk);
+			else     h = static_cast<header*>(::operator new(min_block << cls));
+			h->owner = this;
+			refs_.fetch_add(1, std::memory_order_relaxed);
+		}
+		h->cls = static_cast<std::uint32_t>(cls);
+		return h + 1;
+	}
+
+	static void deallocate(void* p) noexcept {
+		if (!p) return;
+		header* h = static_cast<header*>(p) - 1;
+		block_cache* owner = h->owner;
+		if (!owner) {
+			::operator delete(h);
+			return;
+		}
+		std::uint32_t cls = h->cls;
+		node* blk = reinterpret_cast<node*>(h);
+		{
+			std::lock_guard<std::mutex> lk(owner->lock_[cls]);
+			blk->next = owner->free_[cls];
+			owner->free_[cls] = blk;
+		}
+		owner->release();
+	}
+
+	/* Process-wide cache used when no pool is at hand, never deleted */
+	static block_cache& global() {
+		static block_cache* cache = new block_cache();
+		return *cache;
+	}
+
+private:
+	~block_cache() {
+		for (std::size_t i = 0; i < num_classes; i++) {
+			node* n = free_[i];
+			while (n) {
+				node* next = n->next;
+				::operator delete(n);
+				n = next;
+			}
+		}
+	}
+
+	struct alignas(std::max_align_t) header {
+		block_cache*  owner;                 /* NULL for oversized blocks */
+		std::uint32_t cls;                   /* size class index          */
+	};
+	struct node {
+		node* next;
+	};
+
+	std::atomic<std::size_t> refs_{1};         /* creator + live blocks */
+	std::mutex               lock_[num_classes];
+	node*                    free_[num_classes];
+};
+
+
+/* Job slot
+ *
+ * One queued callable. Callables of up to inline_size bytes are constructed
+ * directly in the slot, bigger ones are moved to the heap and the slot
+ * keeps the pointer. Slots are taken from a block_cache, so submitting a
+ * small callable costs no allocation on top of the C job itself.
+ */
+struct state_base;
+
+struct job_slot {
+	static constexpr std::size_t inline_size  = 48;
+	static constexpr std::size_t inline_align = 16;
+
+	void (*handler)(job_slot*, bool run);    /* run or just discard      */
+	state_base* state;                       /* future state or NULL     */
+	alignas(inline_align) unsigned char storage[inline_size];
+
+	template<typename F>
+	static constexpr bool fits_inline() {
+		return sizeof(F) <= inline_size && alignof(F) <= inline_align;
+	}
+
+	template<typename F>
+	F* callable() noexcept {
+		if constexpr (fits_inline<F>()) return std::launder(reinterpret_cast<F*>(storage));
+		else return *reinterpret_cast<F**>(storage);
+	}
+
+	/* Closures are invoked with the slot's future state */
+	template<typename F>
+	static void handle(job_slot* slot, bool run) {
+		F* fn = slot->callable<F>();
+		if (run) (*fn)(slot->state);
+		if constexpr (fits_inline<F>()) fn->~F();
+		else delete fn;
+	}
+
+	template<typename F>
+	static job_slot* make(block_cache& cache, state_base* state, F&& fn) {
+		using C = std::decay_t<F>;
+		job_slot* slot = static_cast<job_slot*>(cache.allocate(sizeof(job_slot)));
+		try {
+			if constexpr (fits_inline<C>()) ::new (static_cast<void*>(slot->storage)) C(std::forward<F>(fn));
+			else *reinterpret_cast<C**>(slot->storage) = new C(std::forward<F>(fn));
+		} catch (...) {
+			block_cache::deallocate(slot);
+			throw;
+		}
+		slot->handler = &handle<C>;
+		slot->state   = state;
+		return slot;
+	}
+
+	static void run(job_slot* slot) {
+		slot->handler(slot, true);
+		block_cache::deallocate(slot);
+	}
+
+	static void discard(job_slot* slot) noexcept {
+		slot->handler(slot, false);
+		block_cache::deallocate(slot);
+	}
+
+	/* thpool_add_work() entry point */
+	static void run_job(void* arg) {
+		run(static_cast<job_slot*>(arg));
+	}
+};
+
+
+/* Shared state of a future
+ *
+ * Referenced by the future and by the producer (a queued job or a
+ * continuation), released by whichever drops it last. The producer
+ * publishes the result with complete(); a continuation registered with
+ * then() runs on the thread that completes the state.
+ */
+struct state_base {
+	enum : std::uint32_t { pending, chained, ready };
+
+	std::atomic<std::uint32_t> status{pending};
+	std::atomic<int>           refs{2};
+	std::exception_ptr         error;
+	job_slot*                  next = nullptr;    /* continuation       */
+	void (*destroy)(state_base*) = nullptr;
+
+	void complete() {
+		std::uint32_t old = status.exchange(ready, std::memory_order_acq_rel);
+		if (old == chained) {
+			job_slot::run(next);
+		} else {
+#if defined(__cpp_lib_atomic_wait)
+			status.notify_all();
+#endif
+		}
+	}
+
+	void set_exception(std::exception_ptr e) {
+		error = std::move(e);
+		complete();
+	}
+
+	void wait() const noexcept {
+		std::uint32_t s;
+		while ((s = status.load(std::memory_order_acquire)) != ready) {
+#if defined(__cpp_lib_atomic_wait)
+			status.wait(s, std::memory_order_acquire);
+#else
+			std::this_thread::yield();
+#endif
+		}
+	}
+
+	/* Chain a continuation, runs it right away if already completed */
+	void chain(job_slot* slot) {
+		next = slot;
+		std::uint32_t expected = pending;
+		if (!status.compare_exchange_strong(expected, chained, std::memory_order_acq_rel))
+			job_slot::run(slot);
+	}
+
+	void release() noexcept {
+		if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1) destroy(this);
+	}
+};
+
+template<typename T>
+struct shared_state : state_base {
+	alignas(T) unsigned char value[sizeof(T)];
+	bool has_value = false;
+
+	template<typename U>
+	void set_value(U&& v) {
+		::new (static_cast<void*>(value)) T(std::forward<U>(v));
+		has_value = true;
+		complete();
+	}
+
+	T take() {
+		if (error) std::rethrow_exception(error);
+		return std::move(*std::launder(reinterpret_cast<T*>(value)));
+	}
+
+	~shared_state() {
+		if (has_value) std::launder(reinterpret_cast<T*>(value))->~T();
+	}
+};
+
+template<>
+struct shared_state<void> : state_base {
+	void set_value() { complete(); }
+
+	void take() {
+		if (error) std::rethrow_exception(error);
+	}
+};
+
+template<typename T>
+shared_state<T>* make_state(block_cache& cache) {
+	void* mem = cache.allocate(sizeof(shared_state<T>));
+	shared_state<T>* st = ::new (mem) shared_state<T>();
+	st->destroy = [](state_base* b) {
+		static_cast<shared_state<T>*>(b)->~shared_state<T>();
+		block_cache::deallocate(b);
+	};
+	return st;
+}
+
+/* Stores the outcome of fn(args...) into the state */
+template<typename T, typename F, typename... Args>
+void fulfil(shared_state<T>* st, F& fn, Args&&... args) {
+	try {
+		if constexpr (std::is_void_v<T>) {
+			std::invoke(fn, std::forward<Args>(args)...);
+			st->set_value();
+		} else {
+			st->set_value(std::invoke(fn, std::forward<Args>(args)...));
+		}
+	} catch (...) {
+		st->set_exception(std::current_exception());
+	}
+}
+
+} /* namespace detail */
+
+
+/* Result of pool::submit()
+ *
+ * Move-only handle to the value (or exception) of a queued job. get()
+ * blocks until the job has run and then returns its value or rethrows its
+ * exception; it may be called once. then() consumes the future and
+ * returns a future of the continuation's result.
+ */
+template<typename T>
+class future {
+public:
+	future() noexcept = default;
+	explicit future(detail::shared_state<T>* st, detail::block_cache* cache) noexcept
+		: state_(st), cache_(cache) {}
+	future(future&& other) noexcept
+		: state_(std::exchange(other.state_, nullptr)), cache_(other.cache_) {}
+
+	future& operator=(future&& other) noexcept {
+		if (this != &other) {
+			if (state_) state_->release();
+			state_ = std::exchange(other.state_, nullptr);
+			cache_ = other.cache_;
+		}
+		return *this;
+	}
+
+	~future() {
+		if (state_) state_->release();
+	}
+
+	future(const future&) = delete;
+	future& operator=(const future&) = delete;
+
+	bool valid() const noexcept { return state_ != nullptr; }
+
+	bool is_ready() const noexcept {
+		return state_->status.load(std::memory_order_acquire) == detail::state_base::ready;
+	}
+
+	void wait() const noexcept { state_->wait(); }
+
+	T get() {
+		state_->wait();
+		detail::shared_state<T>* st = std::exchange(state_, nullptr);
+		struct releaser {
+			detail::shared_state<T>* st;
+			~releaser() { st->release(); }
+		} guard{st};
+		return st->take();
+	}
+
+	/* Run fn(value) (fn() for future<void>) on the thread completing this
+	 * future; an exception of this future skips fn and is passed on. */
+	template<typename F>
+	auto then(F&& fn) && {
+		using R = typename std::conditional_t<std::is_void_v<T>,
+		              std::invoke_result<std::decay_t<F>&>,
+		              std::invoke_result<std::decay_t<F>&, T>>::type;
+
+		detail::shared_state<R>* dst = detail::make_state<R>(*cache_);
+		detail::shared_state<T>* src = std::exchange(state_, nullptr);
+		auto cont = [fn = std::forward<F>(fn), dst](detail::state_base* b) mutable {
+			detail::shared_state<T>* st = static_cast<detail::shared_state<T>*>(b);
+			if (st->error) {
+				dst->set_exception(st->error);
+			} else if constexpr (std::is_void_v<T>) {
+				detail::fulfil(dst, fn);
+			} else {
+				detail::fulfil(dst, fn, st->take());
+			}
+			dst->release();
+			st->release();
+		};
+
+		detail::job_slot* slot;
+		try {
+			slot = detail::job_slot::make(*cache_, src, std::move(cont));
+		} catch (...) {
+			dst->destroy(dst);
+			state_ = src;
+			throw;
+		}
+		src->chain(slot);
+		return future<R>(dst, cache_);
+	}
+
+private:
+	detail::shared_state<T>* state_ = nullptr;
+	detail::block_cache*     cache_ = nullptr;  /* kept alive by state_ */
+};
+
+
+
+#ifdef THPOOL_HAS_COROUTINES
+class schedule_awaiter;
+#endif
+
+/* RAII owner of a threadpool
+ *
+ * Futures and coroutine frames allocated through the pool keep its block
+ * cache alive, so they may be used and destroyed after the pool is gone.
+ */
+class pool {
+public:
+	explicit pool(int num_threads)
+		: blocks_(new detail::block_cache()), pool_(thpool_init(num_threads)) {
+		if (pool_ == NULL) {
+			blocks_->release();
+			throw std::runtime_error("thpool_init() failed");
+		}
+	}
+
+	~pool() {
+		thpool_wait(pool_);
+		thpool_destroy(pool_);
+		blocks_->release();
+	}
+
+	pool(const pool&) = delete;
+	pool& operator=(const pool&) = delete;
+
+	threadpool native_handle() const noexcept { return pool_; }
+
+	/* Wait for all queued jobs to finish, see thpool_wait() */
+	void wait() { thpool_wait(pool_); }
+
+	int num_threads_working() const { return thpool_num_threads_working(pool_); }
+
+	/* Queue a callable, its result or exception is delivered by the future
+	 *
+	 * The callable may be move-only; its captures are stored inline in the
+	 * job slot when they fit in detail::job_slot::inline_size bytes.
+	 */
+	template<typename F>
+	auto submit(F&& fn) -> future<std::invoke_result_t<std::decay_t<F>&>> {
+		using R = std::invoke_result_t<std::decay_t<F>&>;
+
+		detail::shared_state<R>* st = detail::make_state<R>(*blocks_);
+		auto body = [fn = std::forward<F>(fn)](detail::state_base* b) mutable {
+			detail::shared_state<R>* st = static_cast<detail::shared_state<R>*>(b);
+			detail::fulfil(st, fn);
+			st->release();
+		};
+		detail::job_slot* slot;
+		try {
+			slot = detail::job_slot::make(*blocks_, st, std::move(body));
+		} catch (...) {
+			st->destroy(st);
+			throw;
+		}
+		enqueue(slot, st);
+		return future<R>(st, blocks_);
+	}
+
+	/* Queue a callable without a future
+	 *
+	 * An exception escaping the callable terminates the program, as it
+	 * would on a std::thread.
+	 */
+	template<typename F>
+	void post(F&& fn) {
+		auto body = [fn = std::forward<F>(fn)](detail::state_base*) mutable noexcept {
+			fn();
+		};
+		enqueue(detail::job_slot::make(*blocks_, nullptr, std::move(body)), nullptr);
+	}
+
+	/* Recycling allocator for job slots, future states and coroutine frames */
+	detail::block_cache& blocks() noexcept { return *blocks_; }
+
+#ifdef THPOOL_HAS_COROUTINES
+	/* co_await pool.schedule() resumes the coroutine on a worker */
+	schedule_awaiter schedule() noexcept;
+#endif
+
+private:
+	void enqueue(detail::job_slot* slot, detail::state_base* st) {
+		if (thpool_add_work(pool_, &detail::job_slot::run_job, slot) != 0) {
+			detail::job_slot::discard(slot);
+			if (st) st->destroy(st);
+			throw std::bad_alloc();
+		}
+	}
+
+	detail::block_cache* blocks_;                  /* released last      */
+	threadpool           pool_;
+};
+
+
+#ifdef THPOOL_HAS_COROUTINES
+
+/* ========================== COROUTINES ============================ */
+
+namespace detail {
+
+/* Frame cache of the pool whose coroutine the current thread is resuming,
+ * NULL outside of schedule_awaiter::resume_on_worker() */
+inline block_cache*& current_frame_cache() noexcept {
+	static thread_local block_cache* cache = nullptr;
+	return cache;
+}
+
+inline void* frame_allocate(std::size_t n) {
+	block_cache* cache = current_frame_cache();
+	return (cache ? *cache : block_cache::global()).allocate(n);
+}
+
+/* Frame allocation shared by every coroutine type of this header
+ *
+ * A coroutine whose first parameter is a thpool::pool& takes its frame
+ * from that pool. Otherwise the frame comes from the pool the calling
+ * worker belongs to, or from the process-wide cache off the pool. A frame
+ * holds a reference on its cache, so it may be destroyed after the pool.
+ */
+struct frame_allocated {
+	static void* operator new(std::size_t n) {
+		return frame_allocate(n);
+	}
+	template<typename... Args>
+	static void* operator new(std::size_t n, pool& p, Args&...) {
+		return p.blocks().allocate(n);
+	}
+	static void operator delete(void* ptr) noexcept {
+		block_cache::deallocate(ptr);
+	}
+};
+
+} /* namespace detail */
+
+
+/* Awaiter returned by pool::schedule() */
+class schedule_awaiter {
+public:
+	explicit schedule_awaiter(pool* p) noexcept : pool_(p) {}
+
+	bool await_ready() const noexcept { return false; }
+
+	/* Falls back to resuming inline when the job can not be queued */
+	bool await_suspend(std::coroutine_handle<> h) noexcept {
+		handle_ = h;
+		return thpool_add_work(pool_->native_handle(), &resume_on_worker, this) == 0;
+	}
+
+	void await_resume() const noexcept {}
+
+private:
+	static void resume_on_worker(void* arg) {
+		schedule_awaiter* self = static_cast<schedule_awaiter*>(arg);
+		detail::block_cache*& cache = detail::current_frame_cache();
+		detail::block_cache* outer = cache;
+		cache = &self->pool_->blocks();
+		self->handle_.resume();                      /* may free self */
+		cache = outer;
+	}
+
+	pool*                   pool_;
+	std::coroutine_handle<> handle_;
+};
+
+inline schedule_awaiter pool::schedule() noexcept {
+	return schedule_awaiter(this);
+}
+
+
+template<typename T = void> class task;
+
+namespace detail {
+
+struct task_promise_base : frame_allocated {
+	struct final_awaiter {
+		bool await_ready() const noexcept { return false; }
+
+		/* Symmetric transfer: the awaiting coroutine resumes on this thread */
+		template<typename Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+			return h.promise().continuation_;
+		}
+
+		void await_resume() const noexcept {}
+	};
+
+	std::suspend_always initial_suspend() const noexcept { return {}; }
+	final_awaiter final_suspend() const noexcept { return {}; }
+	void unhandled_exception() noexcept { exception_ = std::current_exception(); }
+
+	std::coroutine_handle<> continuation_ = std::noop_coroutine();
+	std::exception_ptr      exception_;
+};
+
+template<typename T>
+struct task_promise : task_promise_base {
+	task<T> get_return_object() noexcept;
+
+	template<typename U>
+	void return_value(U&& value) {
+		::new (static_cast<void*>(&storage_)) T(std::forward<U>(value));
+		has_value_ = true;
+	}
+
+	T result() {
+		if (exception_) std::rethrow_exception(exception_);
+		return std::move(*reinterpret_cast<T*>(&storage_));
+	}
+
+	~task_promise() {
+		if (has_value_) reinterpret_cast<T*>(&storage_)->~T();
+	}
+
+	alignas(T) unsigned char storage_[sizeof(T)];
+	bool has_value_ = false;
+};
+
+template<>
+struct task_promise<void> : task_promise_base {
+	task<void> get_return_object() noexcept;
+
+	void return_void() const noexcept {}
+
+	void result() {
+		if (exception_) std::rethrow_exception(exception_);
+	}
+};
+
+} /* namespace detail */
+
+
+/* Lazily started coroutine producing a T
+ *
+ * The body does not run until the task is awaited. When it finishes, the
+ * awaiting coroutine is resumed directly on the thread that completed it.
+ */
+template<typename T>
+class task {
+public:
+	using promise_type = detail::task_promise<T>;
+	using handle_type  = std::coroutine_handle<promise_type>;
+
+	task() noexcept = default;
+	explicit task(handle_type h) noexcept : handle_(h) {}
+	task(task&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+
+	task& operator=(task&& other) noexcept {
+		if (this != &other) {
+			if (handle_) handle_.destroy();
+			handle_ = std::exchange(other.handle_, {});
+		}
+		return *this;
+	}
+
+	~task() {
+		if (handle_) handle_.destroy();
+	}
+
+	task(const task&) = delete;
+	task& operator=(const task&) = delete;
+
+	bool valid() const noexcept { return static_cast<bool>(handle_); }
+
+	auto operator co_await() && noexcept {
+		struct awaiter {
+			handle_type h;
+
+			bool await_ready() const noexcept { return !h || h.done(); }
+
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont) noexcept {
+				h.promise().continuation_ = cont;
+				return h;
+			}
+
+			T await_resume() { return h.promise().result(); }
+		};
+		return awaiter{handle_};
+	}
+
+private:
+	handle_type handle_;
+};
+
+namespace detail {
+
+template<typename T>
+inline task<T> task_promise<T>::get_return_object() noexcept {
+	return task<T>(std::coroutine_handle<task_promise<T>>::from_promise(*this));
+}
+
+inline task<void> task_promise<void>::get_return_object() noexcept {
+	return task<void>(std::coroutine_handle<task_promise<void>>::from_promise(*this));
+}
+
+/* Coroutine which starts eagerly and frees its own frame on completion */
+struct detached {
+	struct promise_type : frame_allocated {
+		detached get_return_object() const noexcept { return {}; }
+		std::suspend_never initial_suspend() const noexcept { return {}; }
+		std::suspend_never final_suspend() const noexcept { return {}; }
+		void return_void() const noexcept {}
+		void unhandled_exception() const noexcept { std::terminate(); }
+	};
+};
+
+/* Blocking one-shot event used by sync_wait() */
+struct sync_event {
+	std::mutex              mutex;
+	std::condition_variable cond;
+	bool                    set = false;
+
+	void notify() {
+		std::lock_guard<std::mutex> lk(mutex);
+		set = true;
+		cond.notify_one();
+	}
+
+	void wait() {
+		std::unique_lock<std::mutex> lk(mutex);
+		cond.wait(lk, [this] { return set; });
+	}
+};
+
+template<typename T>
+detached sync_wait_run(task<T>& t, sync_event& ev, std::exception_ptr& out_error,
+                       std::optional<T>& out) {
+	try {
+		out.emplace(co_await std::move(t));
+	} catch (...) {
+		out_error = std::current_exception();
+	}
+	ev.notify();
+}
+
+inline detached sync_wait_run(task<void>& t, sync_event& ev, std::exception_ptr& out_error) {
+	try {
+		co_await std::move(t);
+	} catch (...) {
+		out_error = std::current_exception();
+	}
+	ev.notify();
+}
+
+} /* namespace detail */
+
+
+/* Block the calling (non worker) thread until the task completes
+ *
+ * Rethrows the exception the task finished with, if any.
+ */
+template<typename T>
+T sync_wait(task<T> t) {
+	detail::sync_event ev;
+	std::exception_ptr error;
+	std::optional<T> result;
+	detail::sync_wait_run<T>(t, ev, error, result);
+	ev.wait();
+	if (error) std::rethrow_exception(error);
+	return std::move(*result);
+}
+
+inline void sync_wait(task<void> t) {
+	detail::sync_event ev;
+	std::exception_ptr error;
+	detail::sync_wait_run(t, ev, error);
+	ev.wait();
+	if (error) std::rethrow_exception(error);
+}
+
+
+/* Awaitable countdown latch
+ *
+ * Coroutines awaiting the latch are suspended until count_down() has been
+ * called enough times; they are then resumed one after another on the
+ * thread that made the final count_down().
+ */
+class async_latch {
+public:
+	explicit async_latch(std::ptrdiff_t count) noexcept
+		: count_(count), waiters_(count > 0 ? nullptr : static_cast<void*>(this)) {}
+
+	async_latch(const async_latch&) = delete;
+	async_latch& operator=(const async_latch&) = delete;
+
+	void count_down(std::ptrdiff_t n = 1) noexcept {
+		if (count_.fetch_sub(n, std::memory_order_acq_rel) == n) release();
+	}
+
+	bool try_wait() const noexcept {
+		return waiters_.load(std::memory_order_acquire) == static_cast<const void*>(this);
+	}
+
+	class awaiter {
+	public:
+		explicit awaiter(const async_latch& l) noexcept : latch_(l) {}
+
+		bool await_ready() const noexcept { return latch_.try_wait(); }
+
+		bool await_suspend(std::coroutine_handle<> h) noexcept {
+			handle_ = h;
+			const void* set = &latch_;
+			void* old = latch_.waiters_.load(std::memory_order_acquire);
+			do {
+				if (old == set) return false;
+				next_ = static_cast<awaiter*>(old);
+			} while (!latch_.waiters_.compare_exchange_weak(old, this,
+			             std::memory_order_release, std::memory_order_acquire));
+			return true;
+		}
+
+		void await_resume() const noexcept {}
+
+	private:
+		friend class async_latch;
+		const async_latch&      latch_;
+		std::coroutine_handle<> handle_;
+		awaiter*                next_ = nullptr;
+	};
+
+	awaiter operator co_await() const noexcept { return awaiter(*this); }
+
+private:
+	void release() noexcept {
+		void* old = waiters_.exchange(this, std::memory_order_acq_rel);
+		awaiter* w = static_cast<awaiter*>(old);
+		while (w) {
+			awaiter* next = w->next_;
+			w->handle_.resume();
+			w = next;
+		}
+	}
+
+	std::atomic<std::ptrdiff_t> count_;
+	mutable std::atomic<void*>  waiters_;        /* this when released  */
+};
+
+
+/* Group of tasks running concurrently on a pool
+ *
+ * spawn() starts a task on a worker right away; co_await group.join()
+ * resumes once every spawned task has finished, on the worker that
+ * finished last. The first exception thrown by a task is rethrown from
+ * join(). The group may be reused after a join completes.
+ */
+class task_group {
+public:
+	explicit task_group(pool& p) noexcept : pool_(p), count_(1) {}
+
+	task_group(const task_group&) = delete;
+	task_group& operator=(const task_group&) = delete;
+
+	void spawn(task<void> t) {
+		count_.fetch_add(1, std::memory_order_relaxed);
+		run(pool_, this, std::move(t));
+	}
+
+	class join_awaiter {
+	public:
+		explicit join_awaiter(task_group& g) noexcept : group_(g) {}
+
+		bool await_ready() const noexcept {
+			return group_.count_.load(std::memory_order_acquire) == 1;
+		}
+
+		bool await_suspend(std::coroutine_handle<> h) noexcept {
+			group_.continuation_ = h;
+			return !group_.release();
+		}
+
+		void await_resume() {
+			group_.count_.store(1, std::memory_order_relaxed);
+			std::exception_ptr e = std::exchange(group_.exception_, nullptr);
+			if (e) std::rethrow_exception(e);
+		}
+
+	private:
+		task_group& group_;
+	};
+
+	join_awaiter join() noexcept { return join_awaiter(*this); }
+
+private:
+	/* Drop one reference, true if it was the last one */
+	bool release() noexcept {
+		return count_.fetch_sub(1, std::memory_order_acq_rel) == 1;
+	}
+
+	void fail(std::exception_ptr e) {
+		std::lock_guard<std::mutex> lk(error_lock_);
+		if (!exception_) exception_ = std::move(e);
+	}
+
+	/* Last step of a spawned task: frees the runner frame and transfers
+	 * straight into the joining coroutine when this was the last task */
+	struct done_awaiter {
+		task_group* group;
+
+		bool await_ready() const noexcept { return false; }
+
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) noexcept {
+			std::coroutine_handle<> next = std::noop_coroutine();
+			if (group->release()) next = group->continuation_;
+			h.destroy();
+			return next;
+		}
+
+		void await_resume() const noexcept {}
+	};
+
+	static detail::detached run(pool& p, task_group* g, task<void> t) {
+		co_await p.schedule();
+		try {
+			co_await std::move(t);
+		} catch (...) {
+			g->fail(std::current_exception());
+		}
+		co_await done_awaiter{g};
+	}
+
+	pool&                    pool_;
+	std::atomic<std::size_t> count_;               /* spawned + join ref  */
+	std::coroutine_handle<>  continuation_;
+	std::mutex               error_lock_;
+	std::exception_ptr       exception_;
+};
+
+#endif /* THPOOL_HAS_COROUTINES */
+
+} /* namespace thpool */
+
+#endif
@@ -0,0 +1,341 @@
+/**********************************
+ * License:     MIT
+ *
+ **********************************/
+/*! \file thpool_basic.hpp
+ *
+ *  Compile-time specialized thread pool.
+ *
+ *  thpool::basic_pool<Job, QueuePolicy, IdlePolicy, Capacity> runs jobs of
+ *  a single type known at compile time. Jobs are stored by value in a
+ *  typed ring of Capacity slots and invoked with a direct call, so the
+ *  compiler can inline the job body into the worker loop. How the ring is
+ *  synchronised and how idle workers wait are chosen by policy classes:
+ *
+ *    struct scale_job {
+ *        float* v; size_t n;
+ *        void operator()() const { for (size_t i = 0; i < n; i++) v[i] *= 2; }
+ *    };
+ *
+ *    thpool::basic_pool<scale_job, thpool::mpmc_ring, thpool::hybrid_idle<>> pool(4);
+ *    pool.submit(scale_job{data, len});
+ *    pool.wait();
+ *
+ *  Job must be default constructible and move assignable: the rings hold
+ *  Capacity of them and hand them over by assignment. A worker destroys
+ *  its job right after running it, before the job counts as done; what a
+ *  moved-from Job still holds stays in its slot until the slot is reused.
+ *
+ *  Queue policies provide a nested queue<Job, Capacity> with try_push(),
+ *  try_pop() and empty(). Idle policies provide a nested state with
+ *  wait(ready), notify_one() and notify_all().
+ *
+ ********************************/
+
+#ifndef _THPOOL_BASIC_HPP_
+#define _THPOOL_BASIC_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define THPOOL_CPU_RELAX() _mm_pause()
+#else
+#define THPOOL_CPU_RELAX() std::this_thread::yield()
+#endif
+
+namespace thpool {
+
+/* ========================== QUEUE POLICIES ======================== */
+
+/* Ring guarded by one mutex */
+struct locked_ring {
+	template<typename Job, std::size_t Capacity>
+	class queue {
+	public:
+		bool try_push(Job&& job) {
+			std::lock_guard<std::mutex> lk(lock_);
+			if (tail_ - head_ == Capacity) return false;
+			slots_[tail_ % Capacity] = std::move(job);
+			tail_++;
+			return true;
+		}
+
+		bool try_pop(Job& out) {
+			std::lock_guard<std::mutex> lk(lock_);
+			if (tail_ == head_) return false;
+			out = std::move(slots_[head_ % Capacity]);
+			head_++;
+			return true;
+		}
+
+		bool empty() const {
+			std::lock_guard<std::mutex> lk(lock_);
+			return tail_ == head_;
+		}
+
+	private:
+		mutable std::mutex lock_;
+		std::size_t        head_ = 0;
+		std::size_t        tail_ = 0;
+		Job                slots_[Capacity];
+	};
+};
+
+
+/* Bounded lock-free MPMC ring (Vyukov)
+ *
+ * Every slot carries a sequence number telling producers and consumers
+ * whose turn it is, so push and pop each cost one CAS on the shared index.
+ */
+struct mpmc_ring {
+	template<typename Job, std::size_t Capacity>
+	class queue {
+		static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0,
+		              "mpmc_ring capacity must be a power of two");
+	public:
+		queue() {
+			for (std::size_t i = 0; i < Capacity; i++)
+				cells_[i].seq.store(i, std::memory_order_relaxed);
+		}
+
+		bool try_push(Job&& job) {
+			std::size_t pos = enqueue_.load(std::memory_order_relaxed);
+			for (;;) {
+				cell& c = cells_[pos & (Capacity - 1)];
+				std::size_t seq = c.seq.load(std::memory_order_acquire);
+				std::ptrdiff_t dif = (std::ptrdiff_t)seq - (std::ptrdiff_t)pos;
+				if (dif == 0) {
+					if (enqueue_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+						c.job = std::move(job);
+						c.seq.store(pos + 1, std::memory_order_release);
+						return true;
+					}
+				} else if (dif < 0) {
+					return false;                 /* full */
+				} else {
+					pos = enqueue_.load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		bool try_pop(Job& out) {
+			std::size_t pos = dequeue_.load(std::memory_order_relaxed);
+			for (;;) {
+				cell& c = cells_[pos & (Capacity - 1)];
+				std::size_t seq = c.seq.load(std::memory_order_acquire);
+				std::ptrdiff_t dif = (std::ptrdiff_t)seq - (std::ptrdiff_t)(pos + 1);
+				if (dif == 0) {
+					if (dequeue_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+						out = std::move(c.job);
+						c.seq.store(pos + Capacity, std::memory_order_release);
+						return true;
+					}
+				} else if (dif < 0) {
+					return false;                 /* empty */
+				} else {
+					pos = dequeue_.load(std::memory_order_relaxed);
+				}
+			}
+		}
+
+		bool empty() const {
+			return enqueue_.load(std::memory_order_acquire) == dequeue_.load(std::memory_order_acquire);
+		}
+
+	private:
+		struct alignas(64) cell {
+			std::atomic<std::size_t> seq;
+			Job                      job;
+		};
+
+		cell cells_[Capacity];
+		alignas(64) std::atomic<std::size_t> enqueue_{0};
+		alignas(64) std::atomic<std::size_t> dequeue_{0};
+	};
+};
+
+
+/* ========================== IDLE POLICIES ========================= */
+
+/* Idle workers sleep on a condition variable
+ *
+ * Producers only touch the mutex when a worker is actually asleep.
+ */
+struct blocking_idle {
+	class state {
+	public:
+		template<typename Ready>
+		void wait(Ready ready) {
+			std::unique_lock<std::mutex> lk(lock_);
+			sleepers_.fetch_add(1, std::memory_order_seq_cst);
+			while (!ready()) cond_.wait(lk);
+			sleepers_.fetch_sub(1, std::memory_order_relaxed);
+		}
+
+		void notify_one() {
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (sleepers_.load(std::memory_order_relaxed) == 0) return;
+			{ std::lock_guard<std::mutex> lk(lock_); }
+			cond_.notify_one();
+		}
+
+		void notify_all() {
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			{ std::lock_guard<std::mutex> lk(lock_); }
+			cond_.notify_all();
+		}
+
+	private:
+		std::mutex              lock_;
+		std::condition_variable cond_;
+		std::atomic<int>        sleepers_{0};
+	};
+};
+
+
+/* Idle workers busy-poll; lowest wake-up latency, burns a core each */
+struct spinning_idle {
+	class state {
+	public:
+		template<typename Ready>
+		void wait(Ready ready) {
+			while (!ready()) THPOOL_CPU_RELAX();
+		}
+		void notify_one() {}
+		void notify_all() {}
+	};
+};
+
+
+/* Idle workers poll for Spins rounds, then fall back to sleeping */
+template<unsigned Spins = 4096>
+struct hybrid_idle {
+	class state {
+	public:
+		template<typename Ready>
+		void wait(Ready ready) {
+			for (unsigned i = 0; i < Spins; i++) {
+				if (ready()) return;
+				THPOOL_CPU_RELAX();
+			}
+			blocking_.wait(ready);
+		}
+		void notify_one() { blocking_.notify_one(); }
+		void notify_all() { blocking_.notify_all(); }
+
+	private:
+		blocking_idle::state blocking_;
+	};
+};
+
+
+/* ============================ POOL ================================ */
+
+template<typename Job,
+         typename QueuePolicy = mpmc_ring,
+         typename IdlePolicy  = hybrid_idle<>,
+         std::size_t Capacity = 1024>
+class basic_pool {
+	static_assert(std::is_default_constructible<Job>::value && std::is_move_assignable<Job>::value,
+	              "basic_pool jobs must be default constructible and move assignable");
+public:
+	using job_type = Job;
+
+	explicit basic_pool(int num_threads) {
+		if (num_threads < 1) num_threads = 1;
+		workers_.reserve(num_threads);
+		for (int i = 0; i < num_threads; i++)
+			workers_.emplace_back([this] { run(); });
+	}
+
+	/* Runs what is still queued, then joins the workers */
+	~basic_pool() {
+		wait();
+		stop_.store(true, std::memory_order_seq_cst);
+		idle_.notify_all();
+		for (std::thread& t : workers_) t.join();
+	}
+
+	basic_pool(const basic_pool&) = delete;
+	basic_pool& operator=(const basic_pool&) = delete;
+
+	/* Queue a job, false if the ring is full */
+	bool try_submit(Job job) {
+		pending_.fetch_add(1, std::memory_order_relaxed);
+		if (!queue_.try_push(std::move(job))) {
+			finish();
+			return false;
+		}
+		idle_.notify_one();
+		return true;
+	}
+
+	/* Queue a job, yields while the ring is full */
+	void submit(Job job) {
+		pending_.fetch_add(1, std::memory_order_relaxed);
+		while (!queue_.try_push(std::move(job))) std::this_thread::yield();
+		idle_.notify_one();
+	}
+
+	/* Wait until every submitted job has run */
+	void wait() {
+		if (pending_.load(std::memory_order_acquire) == 0) return;
+		std::unique_lock<std::mutex> lk(done_lock_);
+		waiters_.fetch_add(1, std::memory_order_seq_cst);
+		while (pending_.load(std::memory_order_seq_cst) != 0) done_cond_.wait(lk);
+		waiters_.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	int num_threads() const { return (int)workers_.size(); }
+
+private:
+	void run() {
+		for (;;) {
+			if (run_one()) continue;
+			if (stop_.load(std::memory_order_acquire)) break;
+			idle_.wait([this] {
+				return !queue_.empty() || stop_.load(std::memory_order_acquire);
+			});
+		}
+	}
+
+	/* Run one queued job, false if there was none */
+	bool run_one() {
+		{
+			Job job;
+			if (!queue_.try_pop(job)) return false;
+			job();
+		}
+		finish();
+		return true;
+	}
+
+	void finish() {
+		if (pending_.fetch_sub(1, std::memory_order_seq_cst) == 1 &&
+		    waiters_.load(std::memory_order_seq_cst) != 0) {
+			std::lock_guard<std::mutex> lk(done_lock_);
+			done_cond_.notify_all();
+		}
+	}
+
+	typename QueuePolicy::template queue<Job, Capacity> queue_;
+	typename IdlePolicy::state                          idle_;
+	alignas(64) std::atomic<std::size_t>                pending_{0};
+	std::atomic<bool>                                   stop_{false};
+	std::atomic<int>                                    waiters_{0};
+	std::mutex                                          done_lock_;
+	std::condition_variable                             done_cond_;
+	std::vector<std::thread>                            workers_;
+};
+
+} /* namespace thpool */
+
+#endif